@@ -0,0 +1,66 @@
+#ifndef GLIMVEC_BATCHKB_H
+#define GLIMVEC_BATCHKB_H
+
+#include <vector>
+#include <utility>
+
+// entities may outnumber 2^32 in large KBs; relations are few
+typedef unsigned long long ent_index;
+
+/* one training batch in fixed space: a head and at most MAX_EDGES edges
+ * (relation, tail) on paths from it, path k being the edges from ends[k-1]
+ * (0 for the first) up to ends[k]. a batch may carry its own pool of
+ * negatives, shared by all its edges, in place of sampled ones. */
+struct BatchKB {
+  static constexpr unsigned int MAX_EDGES = 31;
+  static constexpr unsigned int MAX_NEGS = 64;
+
+  ent_index head = 0;
+  unsigned int size = 0;
+  unsigned int paths = 0;
+  unsigned char ends[MAX_EDGES];
+  unsigned int rels[MAX_EDGES];
+  ent_index tails[MAX_EDGES];
+  unsigned int negs = 0;
+  ent_index neg[MAX_NEGS];
+
+  void reset(ent_index h) { head = h; size = 0; paths = 0; negs = 0; }
+  bool full() const { return size == MAX_EDGES; }
+  void push(unsigned int rel, ent_index tail) { rels[size] = rel; tails[size] = tail; ++size; }
+  void pushNeg(ent_index n) { neg[negs++] = n; }
+  // closes the current path, if not empty
+  void endPath() { if (size != (paths == 0 ? 0 : ends[paths - 1])) ends[paths++] = static_cast<unsigned char>(size); }
+
+  // path k, indexed as a vector of (relation, tail)
+  struct Path {
+    const BatchKB& b;
+    unsigned int begin;
+    unsigned int len;
+    unsigned int size() const { return len; }
+    std::pair<unsigned int, ent_index> operator[](unsigned int j) const { return {b.rels[begin + j], b.tails[begin + j]}; }
+  };
+  Path path(unsigned int k) const {
+    const unsigned int begin = k == 0 ? 0 : ends[k - 1];
+    return Path {*this, begin, ends[k] - begin};
+  }
+
+  /* from the nested form, (head, paths); empty paths are skipped. returns
+   * false if there are more than MAX_EDGES edges, keeping the first ones. */
+  bool assign(ent_index h, const std::vector<std::vector<std::pair<unsigned int, ent_index>>>& pths) {
+    reset(h);
+    for (const auto& pth : pths) {
+      for (const auto& edge : pth) {
+        if (full()) {
+          endPath();
+          return false;
+        }
+        push(edge.first, edge.second);
+      }
+      endPath();
+    }
+    return true;
+  }
+};
+
+
+#endif //GLIMVEC_BATCHKB_H
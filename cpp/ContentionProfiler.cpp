@@ -0,0 +1,109 @@
+#include "ContentionProfiler.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <iostream>
+
+using namespace std;
+
+static constexpr uintptr_t LINE = 64;
+
+ContentionProfiler::ContentionProfiler(size_t entities, size_t relations, unsigned int rate) :
+    raw(new char[(MAX_THREADS + 1) * sizeof(Slot)]), rate(rate == 0 ? 1 : rate), capped(false) {
+  static_assert(sizeof(Slot) == LINE, "one slot per cache line");
+  slots = reinterpret_cast<Slot*>((reinterpret_cast<uintptr_t>(raw.get()) + LINE - 1) & ~(LINE - 1));
+  for (unsigned int t = 0; t != MAX_THREADS; ++t) {
+    new (&slots[t]) Slot;
+    slots[t].tag.store(0, memory_order_relaxed);
+    slots[t].rnd = 0x9E3779B97F4A7C15ull * (t + 1);
+  }
+  sizes[CONTEXT] = sizes[TARGET] = entities;
+  sizes[RELATION] = relations;
+  for (unsigned int k = 0; k != 3; ++k) {
+    stats[k] = unique_ptr<Stats[]>(new Stats[sizes[k]]);
+    for (size_t i = 0; i != sizes[k]; ++i) {
+      stats[k][i].sampled.store(0, memory_order_relaxed);
+      stats[k][i].concurrent.store(0, memory_order_relaxed);
+      stats[k][i].false_sharing.store(0, memory_order_relaxed);
+      stats[k][i].max_concurrent.store(0, memory_order_relaxed);
+    }
+  }
+}
+
+void ContentionProfiler::begin(unsigned int tid, Kind kind, size_t index, const void *p, size_t bytes) {
+  if (tid >= MAX_THREADS) {
+    if (!capped.load(memory_order_relaxed) && !capped.exchange(true))
+      cerr << "contention profiler: more than " << MAX_THREADS << " threads training, the others not sampled" << endl;
+    return;
+  }
+  Slot& me = slots[tid];
+  const unsigned long long first = reinterpret_cast<uintptr_t>(p) / LINE;
+  const unsigned long long last = (reinterpret_cast<uintptr_t>(p) + bytes - 1) / LINE;
+  const unsigned long long tag = (static_cast<unsigned long long>(index) << 2 | kind) + 1;
+  me.first_line.store(first, memory_order_relaxed);
+  me.last_line.store(last, memory_order_relaxed);
+  me.tag.store(tag, memory_order_release);
+  me.rnd ^= me.rnd << 13;
+  me.rnd ^= me.rnd >> 7;
+  me.rnd ^= me.rnd << 17;
+  if (me.rnd % rate != 0) return;
+
+  // slots are read without locking, so a writer may be seen half updated
+  unsigned long long concurrent = 0;
+  unsigned long long shared = 0;
+  for (unsigned int t = 0; t != MAX_THREADS; ++t) {
+    if (t == tid) continue;
+    const unsigned long long other = slots[t].tag.load(memory_order_acquire);
+    if (other == 0) continue;
+    if (other == tag) ++concurrent;
+    else if (slots[t].first_line.load(memory_order_relaxed) <= last &&
+             first <= slots[t].last_line.load(memory_order_relaxed)) ++shared;
+  }
+  Stats& s = stats[kind][index];
+  s.sampled.fetch_add(1, memory_order_relaxed);
+  if (concurrent != 0) s.concurrent.fetch_add(concurrent, memory_order_relaxed);
+  if (shared != 0) s.false_sharing.fetch_add(shared, memory_order_relaxed);
+  unsigned long long m = s.max_concurrent.load(memory_order_relaxed);
+  while (concurrent > m && !s.max_concurrent.compare_exchange_weak(m, concurrent, memory_order_relaxed));
+}
+
+void ContentionProfiler::report(ostream &out, const function<string(Kind, size_t)> &name, size_t top) const {
+  static const char* titles[] = {"context vectors (cvecs)", "target vectors (tvecs)", "relation matrices (mats)"};
+  out << "# hogwild write contention, 1 in " << rate << " writes sampled" << endl;
+  if (capped.load()) out << "# only the writes of the first " << MAX_THREADS << " threads training at once" << endl;
+  for (unsigned int k = 0; k != 3; ++k) {
+    const Stats* st = stats[k].get();
+    vector<size_t> order;
+    unsigned long long total = 0;
+    unsigned long long met = 0;
+    for (size_t i = 0; i != sizes[k]; ++i) {
+      const unsigned long long sampled = st[i].sampled.load(memory_order_relaxed);
+      total += sampled;
+      met += st[i].concurrent.load(memory_order_relaxed) + st[i].false_sharing.load(memory_order_relaxed);
+      if (sampled != 0) order.push_back(i);
+    }
+    auto collisions = [st](size_t i) {
+      return st[i].concurrent.load(memory_order_relaxed) + st[i].false_sharing.load(memory_order_relaxed);
+    };
+    sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+      const unsigned long long cx = collisions(x), cy = collisions(y);
+      if (cx != cy) return cx > cy;
+      return st[x].sampled.load(memory_order_relaxed) > st[y].sampled.load(memory_order_relaxed);
+    });
+    if (order.size() > top) order.resize(top);
+
+    out << endl << "## " << titles[k] << ": " << total * rate << " writes (est.), "
+        << met << " sampled collisions" << endl;
+    out << "rank\tname\twrites\tmean_concurrent\tmax_concurrent\tfalse_sharing" << endl;
+    for (size_t r = 0; r != order.size(); ++r) {
+      const Stats& s = st[order[r]];
+      const unsigned long long sampled = s.sampled.load(memory_order_relaxed);
+      out << r + 1 << "\t" << name(static_cast<Kind>(k), order[r]) << "\t" << sampled * rate << "\t"
+          << static_cast<double>(s.concurrent.load(memory_order_relaxed)) / sampled << "\t"
+          << s.max_concurrent.load(memory_order_relaxed) << "\t"
+          << static_cast<double>(s.false_sharing.load(memory_order_relaxed)) / sampled << endl;
+    }
+  }
+}
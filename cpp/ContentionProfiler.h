@@ -0,0 +1,59 @@
+#ifndef __CONTENTIONPROFILER_H
+#define __CONTENTIONPROFILER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <functional>
+#include <ostream>
+#include <cstddef>
+
+/* samples the hogwild writes to the parameters of entities and relations.
+ * every thread announces the cache lines it is writing in a slot of its
+ * own; one in rate writes, picked at random, also scans the slots of the other threads, and
+ * counts those writing the same parameter (concurrent writers) or another
+ * parameter on a shared cache line (false sharing). */
+class ContentionProfiler {
+public:
+  enum Kind { CONTEXT = 0, TARGET = 1, RELATION = 2 };
+  static constexpr unsigned int MAX_THREADS = 256;
+
+private:
+  struct Slot {
+    std::atomic_ullong tag;        // (index << 2 | kind) + 1, or 0 when not writing
+    std::atomic_ullong first_line;
+    std::atomic_ullong last_line;
+    unsigned long long rnd;        // owner only, xorshift state to pick samples
+    char pad[32];
+  };
+  std::unique_ptr<char[]> raw;
+  Slot* slots;
+
+  struct Stats {
+    std::atomic_ullong sampled;
+    std::atomic_ullong concurrent;
+    std::atomic_ullong false_sharing;
+    std::atomic_ullong max_concurrent;
+  };
+  std::unique_ptr<Stats[]> stats[3];
+  size_t sizes[3];
+  unsigned int rate;
+  std::atomic_bool capped;       // a thread past MAX_THREADS wrote, unsampled
+
+public:
+  ContentionProfiler(size_t entities, size_t relations, unsigned int rate);
+
+  /* thread tid starts writing bytes at p, for parameter index of kind.
+   * tids are those of the threads training at once, reused as they exit;
+   * writes of tids from MAX_THREADS up are not sampled. */
+  void begin(unsigned int tid, Kind kind, size_t index, const void* p, size_t bytes);
+  void end(unsigned int tid) { if (tid < MAX_THREADS) slots[tid].tag.store(0, std::memory_order_release); }
+
+  /* lists the top parameters of each kind, ranked by the writes that met
+   * another writer, with the estimated writes and the mean and max
+   * concurrent writers seen. */
+  void report(std::ostream& out, const std::function<std::string(Kind, size_t)>& name, size_t top) const;
+};
+
+
+#endif //__CONTENTIONPROFILER_H
@@ -0,0 +1,46 @@
+#include "GraphKB.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+void GraphKB::reset(ent_index wsz, unsigned int rsz) {
+  this->rsz = rsz;
+  rel_bits = 1;
+  while (rel_bits < 64 && (2ULL * max(rsz, 1u) - 1) >> rel_bits != 0) ++rel_bits;
+  if (rel_bits >= 64 || (wsz != 0 && (wsz - 1) >> (64 - rel_bits) != 0))
+    throw runtime_error("too many entities and relations to pack the graph in 64-bit edges");
+  rel_mask = (1ULL << rel_bits) - 1;
+  offs.assign(wsz + 1, 0);
+  edges.clear();
+  heads.clear();
+  rest.clear();
+}
+
+void GraphKB::add(ent_index head, unsigned int rel, ent_index tail) {
+  heads.push_back(head);
+  rest.push_back(tail << rel_bits | rel);
+  ++offs[head];
+  ++offs[tail];
+}
+
+/* offs[i] holds the degree of i; summed up, it is where the edges of i end,
+ * and the triples are then placed last to first, moving each offs[i] back
+ * to where the edges of i start. */
+void GraphKB::finish() {
+  const ent_index wsz = size();
+  unsigned long long total = 0;
+  for (ent_index i = 0; i != wsz; ++i) offs[i] = total += offs[i];
+  offs[wsz] = total;
+  edges.resize(total);
+  for (size_t k = heads.size(); k-- != 0;) {
+    const ent_index h = heads[k];
+    const ent_index t = rest[k] >> rel_bits;
+    const unsigned long long r = rest[k] & rel_mask;
+    edges[--offs[t]] = h << rel_bits | (r + rsz);
+    edges[--offs[h]] = rest[k];
+  }
+  vector<ent_index>().swap(heads);
+  vector<unsigned long long>().swap(rest);
+}
@@ -0,0 +1,52 @@
+#ifndef GLIMVEC_GRAPHKB_H
+#define GLIMVEC_GRAPHKB_H
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+#include "BatchKB.h"
+
+/* the neighbors (relation, tail) and (relation + rsz, head) of all entities
+ * in the train triples, in the order of the triples, packed in one array:
+ * the edges of entity i are edges[offs[i]] up to edges[offs[i + 1]], each
+ * one 64-bit word tail << rel_bits | relation. triples are added one by one,
+ * then finish lays the array out. */
+class GraphKB {
+
+  unsigned int rsz = 0;
+  unsigned int rel_bits = 0;
+  unsigned long long rel_mask = 0;
+  std::vector<unsigned long long> offs;
+  std::vector<unsigned long long> edges;
+  // triples as added, (head, relation | tail << rel_bits), until finish
+  std::vector<ent_index> heads;
+  std::vector<unsigned long long> rest;
+
+public:
+  // the edges of one entity, indexed as a vector of (relation, tail)
+  struct Edges {
+    const unsigned long long* p;
+    size_t n;
+    unsigned int bits;
+    unsigned long long mask;
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    std::pair<unsigned int, ent_index> operator[](size_t j) const {
+      return {static_cast<unsigned int>(p[j] & mask), p[j] >> bits};
+    }
+  };
+
+  // throws if wsz entities and 2 * rsz relations do not fit in 64 bits
+  void reset(ent_index wsz, unsigned int rsz);
+  void add(ent_index head, unsigned int rel, ent_index tail);
+  void finish();
+
+  ent_index size() const { return offs.empty() ? 0 : offs.size() - 1; }
+  size_t numEdges() const { return edges.size(); }
+  Edges operator[](ent_index i) const { return Edges {edges.data() + offs[i], offs[i + 1] - offs[i], rel_bits, rel_mask}; }
+  size_t bytes() const { return (offs.capacity() + edges.capacity()) * sizeof(unsigned long long); }
+};
+
+
+#endif //GLIMVEC_GRAPHKB_H
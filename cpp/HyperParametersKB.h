@@ -26,4 +26,22 @@ constexpr float JOINT_M_LAMBDA = M_LAMBDA / 4;
 
 constexpr bool DISABLE_AUTOENCODER = false;
 
+/* the hyper parameters a TrainerKB takes at run time, the constants above by
+ * default; DIM and CODE_LEN stay fixed at compile time. */
+struct HyperParamsKB {
+  float vEta = V_ETA;
+  float vLambda = V_LAMBDA;
+  float mEta = M_ETA;
+  float mLambda = M_LAMBDA;
+  double orthSkip = ORTH_SKIP;
+  float orthRate = ORTH_RATE;
+  float orthCoef = ORTH_COEF;
+  float autoEta = AUTOENC_ETA;
+  double autoSkip = AUTOENC_SKIP;
+  float autoLambda = AUTOENC_LAMBDA;
+  float jointMEta = JOINT_M_ETA;
+  float jointMLambda = JOINT_M_LAMBDA;
+  bool disableAutoencoder = DISABLE_AUTOENCODER;
+};
+
 #endif //GLIMVEC_HYPERPARAMETERSKB_H
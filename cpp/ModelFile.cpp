@@ -0,0 +1,278 @@
+#include "ModelFile.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+
+#include "Eigen/Core"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "misc.h"
+
+using namespace std;
+using namespace misc;
+
+static const char MAGIC[8] = {'G', 'L', 'V', 'M', 'O', 'D', 'E', 'L'};
+static constexpr size_t HEADER_SIZE = 64;
+static constexpr size_t ENTRY_SIZE = 256;
+static constexpr size_t NAME_SIZE = 48;
+static constexpr size_t DESCR_SIZE = 16;
+static constexpr unsigned int MAX_DIMS = 8;
+static constexpr size_t WRITE_BLOCK = 1 << 22;
+
+static size_t align_up(size_t x) {
+  return (x + ModelFile::ALIGN - 1) / ModelFile::ALIGN * ModelFile::ALIGN;
+}
+
+template <typename T>
+static void put(string& s, size_t pos, T x) {
+  s.replace(pos, sizeof(T), toBytes(x, isLittleEndian()));
+}
+
+template <typename T>
+static T get(const char* p) {
+  return fromBytes<T>(p, p + sizeof(T), isLittleEndian());
+}
+
+// size of one item of a numpy dtype such as "<f4"
+static size_t item_size(const string& descr) {
+  const size_t pos = descr.find_first_of("0123456789");
+  if (pos == string::npos) throw runtime_error("unsupported dtype " + descr);
+  return stoul(descr.substr(pos));
+}
+
+// running state of the checksum over consecutive words
+struct Sum {
+  unsigned long long a = 0;
+  unsigned long long b = 0;
+
+  void update(const char* p, size_t bytes) {
+    const size_t words = bytes / 8;
+    unsigned long long w, sa = a, sb = b;
+    for (size_t i = 0; i != words; ++i) {
+      memcpy(&w, p + i * 8, 8);
+      sa += w;
+      sb += sa;
+    }
+    if (bytes % 8 != 0) {
+      w = 0;
+      memcpy(&w, p + words * 8, bytes % 8);
+      sa += w;
+      sb += sa;
+    }
+    a = sa;
+    b = sb;
+  }
+  unsigned long long value() const { return b * 0x9E3779B97F4A7C15ULL + a; }
+};
+
+unsigned long long ModelFile::checksum(const char *p, size_t bytes) {
+  Sum s;
+  s.update(p, bytes);
+  return s.value();
+}
+
+bool ModelFile::isModelFile(const string &fn) {
+  ifstream in(fn, ios::binary);
+  char buf[8];
+  return in.read(buf, 8) && memcmp(buf, MAGIC, 8) == 0;
+}
+
+ModelFile::ModelFile(const string &fn) : file(fn) {
+#ifndef _WIN32
+  int fd = ::open(fn.c_str(), O_RDONLY);
+  if (fd < 0) throw runtime_error("cannot open " + fn);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+    close(fd);
+    throw runtime_error("truncated model file " + fn);
+  }
+  len = static_cast<size_t>(st.st_size);
+  void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) throw runtime_error("cannot map " + fn);
+  base = static_cast<char*>(p);
+#else
+  ifstream in(fn, ios::binary | ios::ate);
+  if (!in) throw runtime_error("cannot open " + fn);
+  len = static_cast<size_t>(in.tellg());
+  if (len < HEADER_SIZE) throw runtime_error("truncated model file " + fn);
+  base = static_cast<char*>(Eigen::internal::aligned_malloc(len));
+  in.seekg(0);
+  in.read(base, len);
+#endif
+
+  try {
+    if (memcmp(base, MAGIC, 8) != 0) throw runtime_error("not a model file: " + fn);
+    const unsigned int version = get<uint32_t>(base + 8);
+    if (version > VERSION) throw runtime_error("unsupported model file version " + to_string(version) + ": " + fn);
+    const unsigned int count = get<uint32_t>(base + 12);
+    if (get<uint64_t>(base + 16) != len || HEADER_SIZE + count * ENTRY_SIZE > len)
+      throw runtime_error("truncated model file " + fn);
+
+    index.reserve(count);
+    for (unsigned int k = 0; k != count; ++k) {
+      const char* p = base + HEADER_SIZE + k * ENTRY_SIZE;
+      Entry e;
+      e.name = string(p, strnlen(p, NAME_SIZE));
+      e.descr = string(p + NAME_SIZE, strnlen(p + NAME_SIZE, DESCR_SIZE));
+      p += NAME_SIZE + DESCR_SIZE;
+      const unsigned int ndim = get<uint32_t>(p);
+      if (ndim > MAX_DIMS) throw runtime_error("bad index entry " + e.name + " in " + fn);
+      unsigned long long items = 1;
+      for (unsigned int i = 0; i != ndim; ++i) {
+        e.shape.push_back(get<uint64_t>(p + 8 + i * 8));
+        items *= e.shape.back();
+      }
+      p += 8 + MAX_DIMS * 8;
+      e.offset = get<uint64_t>(p);
+      e.bytes = get<uint64_t>(p + 8);
+      e.checksum = get<uint64_t>(p + 16);
+      if (e.bytes != items * item_size(e.descr) || e.offset % ALIGN != 0 ||
+          e.offset > len || e.bytes > len - e.offset)
+        throw runtime_error("bad index entry " + e.name + " in " + fn);
+      index.push_back(move(e));
+    }
+  } catch (...) {
+#ifndef _WIN32
+    munmap(base, len);
+#else
+    Eigen::internal::aligned_free(base);
+#endif
+    throw;
+  }
+}
+
+ModelFile::~ModelFile() {
+#ifndef _WIN32
+  munmap(base, len);
+#else
+  Eigen::internal::aligned_free(base);
+#endif
+}
+
+bool ModelFile::has(const string &name) const {
+  for (const Entry& e : index) if (e.name == name) return true;
+  return false;
+}
+
+const ModelFile::Entry& ModelFile::entry(const string &name) const {
+  for (const Entry& e : index) if (e.name == name) return e;
+  throw runtime_error("no array " + name + " in " + file);
+}
+
+const ModelFile::Entry& ModelFile::check(const string &name, const string &descr,
+                                         initializer_list<unsigned long long> ds) const {
+  const Entry& e = entry(name);
+  if (e.descr != descr || e.shape.size() != ds.size() || !equal(ds.begin(), ds.end(), e.shape.cbegin()))
+    throw runtime_error("array " + name + " in " + file + " has dtype " + e.descr + " shape " +
+                        mkString(e.shape.cbegin(), e.shape.cend(), "(", ",", ")") + ", expected " +
+                        descr + " " + mkString(ds.begin(), ds.end(), "(", ",", ")"));
+  return e;
+}
+
+namespace {
+  class MemBuf : public streambuf {
+  public:
+    MemBuf(char* p, size_t n) { setg(p, p, p + n); }
+  };
+
+  class MemStream : public istream {
+    MemBuf buf;
+  public:
+    MemStream(char* p, size_t n) : istream(nullptr), buf(p, n) { rdbuf(&buf); }
+  };
+}
+
+unique_ptr<istream> ModelFile::open(const Entry &e) const {
+  return unique_ptr<istream>(new MemStream(data(e), e.bytes));
+}
+
+void ModelFile::verify() const {
+  for (const Entry& e : index) {
+    if (checksum(data(e), e.bytes) != e.checksum)
+      throw runtime_error("checksum mismatch for array " + e.name + " in " + file);
+  }
+}
+
+void ModelFileWriter::add(const string &name, const string &descr, size_t itemSize,
+                          initializer_list<unsigned long long> ds, const Fill &fill) {
+  if (name.size() >= NAME_SIZE || descr.size() >= DESCR_SIZE || ds.size() > MAX_DIMS)
+    throw invalid_argument("cannot store array " + name);
+  unsigned long long items = 1;
+  for (auto d : ds) items *= d;
+  index.push_back(ModelFile::Entry {name, descr, vector<unsigned long long>(ds), 0, items * itemSize, 0});
+  fills.push_back(fill);
+}
+
+void ModelFileWriter::add(const string &name, const string &descr, size_t itemSize,
+                          initializer_list<unsigned long long> ds, const void *p) {
+  const char* cp = static_cast<const char*>(p);
+  add(name, descr, itemSize, ds, [cp](char* dst, size_t ofs, size_t n) { memcpy(dst, cp + ofs, n); });
+}
+
+void ModelFileWriter::write() {
+  const size_t start = align_up(HEADER_SIZE + index.size() * ENTRY_SIZE);
+  size_t pos = start;
+  for (auto& e : index) {
+    e.offset = pos;
+    pos = align_up(pos + e.bytes);
+  }
+  const size_t total = pos;
+
+  // write to a temporary file and rename, so that a model mapped from fn stays valid
+  const string tmp = file + ".tmp";
+  ofstream out(tmp, ios::binary);
+  if (!out) throw runtime_error("cannot open " + tmp);
+  vector<char> buf(WRITE_BLOCK);
+  fill(buf.begin(), buf.end(), 0);
+  out.write(buf.data(), start);
+  for (size_t k = 0; k != index.size(); ++k) {
+    auto& e = index[k];
+    Sum sum;
+    for (size_t ofs = 0; ofs < e.bytes; ofs += WRITE_BLOCK) {
+      const size_t n = min(static_cast<size_t>(e.bytes - ofs), WRITE_BLOCK);
+      fills[k](buf.data(), ofs, n);
+      sum.update(buf.data(), n);
+      out.write(buf.data(), n);
+    }
+    e.checksum = sum.value();
+    const size_t end = k + 1 == index.size()? total : index[k + 1].offset;
+    fill(buf.begin(), buf.end(), 0);
+    out.write(buf.data(), end - e.offset - e.bytes);
+  }
+
+  string head(start, '\0');
+  head.replace(0, 8, MAGIC, 8);
+  put<uint32_t>(head, 8, ModelFile::VERSION);
+  put<uint32_t>(head, 12, static_cast<uint32_t>(index.size()));
+  put<uint64_t>(head, 16, total);
+  for (size_t k = 0; k != index.size(); ++k) {
+    const auto& e = index[k];
+    size_t p = HEADER_SIZE + k * ENTRY_SIZE;
+    head.replace(p, e.name.size(), e.name);
+    head.replace(p + NAME_SIZE, e.descr.size(), e.descr);
+    p += NAME_SIZE + DESCR_SIZE;
+    put<uint32_t>(head, p, static_cast<uint32_t>(e.shape.size()));
+    for (size_t i = 0; i != e.shape.size(); ++i) put<uint64_t>(head, p + 8 + i * 8, e.shape[i]);
+    p += 8 + MAX_DIMS * 8;
+    put<uint64_t>(head, p, e.offset);
+    put<uint64_t>(head, p + 8, e.bytes);
+    put<uint64_t>(head, p + 16, e.checksum);
+  }
+  out.seekp(0);
+  out.write(head.data(), head.size());
+  out.close();
+  if (!out) throw runtime_error("failed to write " + tmp);
+
+  remove(file.c_str());
+  if (rename(tmp.c_str(), file.c_str()) != 0) throw runtime_error("cannot rename " + tmp + " to " + file);
+}
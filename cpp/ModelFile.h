@@ -0,0 +1,91 @@
+#ifndef __MODELFILE_H
+#define __MODELFILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <istream>
+#include <functional>
+#include <initializer_list>
+
+/* a model saved as one file: a 64-byte header, an index of named arrays,
+ * then the data of each array at a page-aligned offset.
+ *
+ *   header: magic "GLVMODEL", u32 version, u32 number of arrays,
+ *           u64 file size, 40 bytes reserved
+ *   index entry (256 bytes each):
+ *           char name[48], char descr[16] (numpy dtype, e.g. "<f4"),
+ *           u32 ndim, u32 reserved, u64 shape[8], u64 offset, u64 bytes,
+ *           u64 checksum, 96 bytes reserved
+ *
+ * all integers are little endian. the checksum of an array treats its
+ * data, zero padded to a multiple of 8 bytes, as u64 words w_0 .. w_{n-1}
+ * and is b * 0x9E3779B97F4A7C15 + a, where a = sum w_i and
+ * b = sum (n - i) w_i, all mod 2^64. */
+class ModelFile {
+public:
+  static constexpr unsigned int VERSION = 1;
+  static constexpr size_t ALIGN = 4096;
+
+  struct Entry {
+    std::string name;
+    std::string descr;
+    std::vector<unsigned long long> shape;
+    unsigned long long offset;
+    unsigned long long bytes;
+    unsigned long long checksum;
+  };
+
+  static unsigned long long checksum(const char* p, size_t bytes);
+  // whether fn is a regular file starting with the magic
+  static bool isModelFile(const std::string& fn);
+
+  /* maps fn copy-on-write as a whole; arrays are only read from the file
+   * when touched, and writes to them never reach the file. */
+  explicit ModelFile(const std::string& fn);
+  ~ModelFile();
+  ModelFile(const ModelFile& that) = delete;
+  ModelFile& operator=(const ModelFile& that) = delete;
+
+  const std::vector<Entry>& entries() const { return index; }
+  bool has(const std::string& name) const;
+  // throws if missing, or if descr or shape differ (when given)
+  const Entry& entry(const std::string& name) const;
+  const Entry& check(const std::string& name, const std::string& descr,
+                     std::initializer_list<unsigned long long> ds) const;
+  char* data(const Entry& e) const { return base + e.offset; }
+  // a stream over the data of an array
+  std::unique_ptr<std::istream> open(const Entry& e) const;
+  // recompute every checksum; throws on mismatch
+  void verify() const;
+
+private:
+  std::string file;
+  char* base = nullptr;
+  size_t len = 0;
+  std::vector<Entry> index;
+};
+
+/* writes a model file in one sequential pass: arrays are streamed through
+ * a large buffer while their checksums are computed, and the index is
+ * written last at the head of the file. */
+class ModelFileWriter {
+public:
+  // fills dst with bytes [ofs, ofs + n) of the array; ofs is a multiple of 8
+  typedef std::function<void(char* dst, size_t ofs, size_t n)> Fill;
+
+  explicit ModelFileWriter(const std::string& fn) : file(fn) {}
+
+  void add(const std::string& name, const std::string& descr, size_t itemSize,
+           std::initializer_list<unsigned long long> ds, const Fill& fill);
+  void add(const std::string& name, const std::string& descr, size_t itemSize,
+           std::initializer_list<unsigned long long> ds, const void* p);
+  void write();
+
+private:
+  std::string file;
+  std::vector<ModelFile::Entry> index;
+  std::vector<Fill> fills;
+};
+
+#endif //__MODELFILE_H
@@ -1,11 +1,12 @@
 #ifndef __MULTINOMIAL_H
 #define __MULTINOMIAL_H
 
+#include <cstddef>
 
 class RandomGenerator;
 
 class Multinomial {
-  virtual unsigned int sample(RandomGenerator& rd) const = 0;
+  virtual size_t sample(RandomGenerator& rd) const = 0;
 };
 
 #endif //__MULTINOMIAL_H
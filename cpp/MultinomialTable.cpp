@@ -2,9 +2,9 @@
 
 #include "RandomGenerator.h"
 
-unsigned int MultinomialTable::sample(RandomGenerator &rd) const {
+size_t MultinomialTable::sample(RandomGenerator &rd) const {
   size_t i = rd(size);
-  unsigned int a = table[i];
-  unsigned int b = table[i + 1];
-  return (b > a + 1)? a + static_cast<unsigned int>(rd(b - a)) : a;
+  size_t a = table[i];
+  size_t b = table[i + 1];
+  return (b > a + 1)? a + static_cast<size_t>(rd(b - a)) : a;
 }
@@ -12,7 +12,7 @@
 class MultinomialTable : public Multinomial {
 
   size_t size;
-  std::unique_ptr<unsigned int[]> table;
+  std::unique_ptr<size_t[]> table;
   std::vector<double> scan;
 
 public:
@@ -20,7 +20,7 @@ public:
 
   template <typename InputIter>
   MultinomialTable(InputIter prob_begin, InputIter prob_end, size_t sz) :
-      size(sz), table(new unsigned int[sz + 1]) {
+      size(sz), table(new size_t[sz + 1]) {
 
     double total = 0.0;
     for (InputIter cur = prob_begin; cur != prob_end; ++cur) {
@@ -29,18 +29,19 @@ public:
     }
 
     size_t lower = 0;
-    auto scan_sz = static_cast<unsigned int>(scan.size());
-    for (unsigned int i = 0; i != scan_sz; ++i) {
+    const size_t scan_sz = scan.size();
+    for (size_t i = 0; i != scan_sz; ++i) {
       auto higher = static_cast<size_t>((scan[i] /= total) * sz);
       while (lower <= higher) table[lower++] = i;
     }
     table[sz] = scan_sz;
   }
 
-  double prob(unsigned int i) const { return scan[i]; }
-  unsigned int choices() const { return static_cast<unsigned int>(scan.size()); }
+  double prob(size_t i) const { return scan[i]; }
+  size_t choices() const { return scan.size(); }
+  size_t bytes() const { return (size + 1) * sizeof(size_t) + scan.capacity() * sizeof(double); }
 
-  unsigned int sample(RandomGenerator& rd) const override;
+  size_t sample(RandomGenerator& rd) const override;
 };
 
 
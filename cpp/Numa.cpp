@@ -0,0 +1,120 @@
+#include "Numa.h"
+
+#include <fstream>
+#include <thread>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "misc.h"
+
+using namespace std;
+
+numa::Placement numa::parsePlacement(const string &s) {
+  if (s == "none") return NONE;
+  if (s == "interleave") return INTERLEAVE;
+  if (s == "partition") return PARTITION;
+  throw invalid_argument("unknown placement: " + s);
+}
+
+// parse a sysfs list such as "0-3,8-11"
+static vector<int> parse_list(const string& s) {
+  vector<int> ret;
+  for (const string& x : misc::split(s, ',')) {
+    if (x.empty()) continue;
+    auto dash = x.find('-');
+    int lo = stoi(x.substr(0, dash));
+    int hi = dash == string::npos? lo : stoi(x.substr(dash + 1));
+    for (int i = lo; i <= hi; ++i) ret.push_back(i);
+  }
+  return ret;
+}
+
+static vector<vector<int>> read_topology() {
+  vector<vector<int>> ret;
+#ifdef __linux__
+  string online;
+  ifstream in_online("/sys/devices/system/node/online");
+  if (getline(in_online, online)) {
+    for (int node : parse_list(online)) {
+      string cpus;
+      ifstream in_cpus("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+      if (getline(in_cpus, cpus)) {
+        vector<int> cl = parse_list(cpus);
+        if (!cl.empty()) ret.push_back(move(cl));
+      }
+    }
+  }
+#endif
+  if (ret.empty()) {
+    unsigned int n = thread::hardware_concurrency();
+    ret.emplace_back();
+    for (unsigned int i = 0; i != (n == 0? 1 : n); ++i) ret.back().push_back(i);
+  }
+  return ret;
+}
+
+const vector<vector<int>>& numa::nodeCpus() {
+  static const vector<vector<int>> topology = read_topology();
+  return topology;
+}
+
+unsigned int numa::numNodes() {
+  return static_cast<unsigned int>(nodeCpus().size());
+}
+
+#ifdef __linux__
+static bool pin_cpus(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus) CPU_SET(c, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+}
+#else
+static bool pin_cpus(const vector<int>& cpus) { return false; }
+#endif
+
+bool numa::pinThread(int cpu) {
+  return pin_cpus({cpu});
+}
+
+bool numa::pinThreadToNode(unsigned int node) {
+  return pin_cpus(nodeCpus()[node % numNodes()]);
+}
+
+unsigned int numa::workerNode(unsigned int tid) {
+  return tid % numNodes();
+}
+
+int numa::workerCpu(unsigned int tid) {
+  const auto& cpus = nodeCpus()[workerNode(tid)];
+  return cpus[(tid / numNodes()) % cpus.size()];
+}
+
+void numa::placePages(void *p, size_t bytes, const function<unsigned int(size_t)> &nodeOf) {
+  const unsigned int nodes = numNodes();
+  if (nodes == 1 || bytes == 0) return;
+#ifdef __linux__
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+  const size_t page = 4096;
+#endif
+  char* begin = static_cast<char*>(p);
+  const size_t skip = (page - reinterpret_cast<size_t>(begin) % page) % page;
+
+  vector<thread> threads;
+  threads.reserve(nodes);
+  for (unsigned int n = 0; n != nodes; ++n) {
+    threads.emplace_back([=, &nodeOf]() {
+      pinThreadToNode(n);
+      for (size_t off = skip; off < bytes; off += page) {
+        if (nodeOf(off) == n) *static_cast<volatile char*>(begin + off) = 0;
+      }
+    });
+  }
+  for (auto& x : threads) x.join();
+}
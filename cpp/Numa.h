@@ -0,0 +1,46 @@
+#ifndef __NUMA_H
+#define __NUMA_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <functional>
+
+/* thread pinning and first-touch page placement across NUMA nodes.
+ * only implemented for Linux (topology read from sysfs); elsewhere the
+ * machine is seen as one node and pinning is a no-op. */
+namespace numa {
+
+  enum Placement {
+    NONE,        // pages land wherever the initializing thread runs
+    INTERLEAVE,  // pages round-robin over nodes
+    PARTITION    // blocks of entities and relations dealt over nodes
+  };
+
+  Placement parsePlacement(const std::string& s);
+
+  // cpus of each online node; a single node with all cpus if unknown
+  const std::vector<std::vector<int>>& nodeCpus();
+  unsigned int numNodes();
+
+  // pin the calling thread to a single cpu, or to all cpus of a node
+  bool pinThread(int cpu);
+  bool pinThreadToNode(unsigned int node);
+
+  // the cpu for worker tid: spread workers node by node
+  int workerCpu(unsigned int tid);
+  unsigned int workerNode(unsigned int tid);
+
+  /* node owning item i, when blocks of block items are dealt round-robin
+   * over the nodes; as vocabs are sorted by frequency, contiguous ranges
+   * would leave all the hubs on node 0. */
+  inline unsigned int blockNode(unsigned long long i, unsigned long long block, unsigned int nodes) {
+    return static_cast<unsigned int>(i / block % nodes);
+  }
+
+  /* first-touch every page in [p, p + bytes) from a thread running on node
+   * nodeOf(offset of the page). must be called before the memory is written. */
+  void placePages(void* p, size_t bytes, const std::function<unsigned int(size_t)>& nodeOf);
+}
+
+#endif //__NUMA_H
@@ -0,0 +1,202 @@
+#include "QueryKB.h"
+
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+
+#include "HyperParametersKB.h"
+#include "TopK.h"
+
+using namespace std;
+using namespace Eigen;
+
+// expressions scored together in top, so that the table is read once per block
+static constexpr size_t BLOCK = 128;
+// and entities scored at a time, each block kept to the k best of its expressions
+static constexpr ent_index TOP_BLOCK = 1 << 14;
+
+// as split_wrt_brackets of utilityFuncs.py
+static vector<string> split_wrt_brackets(const string& s, char sp) {
+  vector<string> blocks;
+  string part;
+  int count = 0;
+  for (char x : s) {
+    if (count == 0 && x == sp) {
+      blocks.push_back(part);
+      part.clear();
+    } else {
+      part.push_back(x);
+      if (x == '(') ++count;
+      else if (x == ')') --count;
+    }
+  }
+  blocks.push_back(part);
+  return blocks;
+}
+
+static string strip(const string& s) {
+  static const char* ws = " \t\n\r\f\v";
+  const size_t b = s.find_first_not_of(ws);
+  if (b == string::npos) return string();
+  return s.substr(b, s.find_last_not_of(ws) + 1 - b);
+}
+
+static bool startsWith(const string& s, const string& p) { return s.compare(0, p.size(), p) == 0; }
+static bool endsWith(const string& s, char c) { return !s.empty() && s.back() == c; }
+
+QueryKB::QueryKB(const float *tvecs, const float *cvecs, const float *mats, ent_index wsz, unsigned int rsz2,
+                 const vector<string> &words, const vector<string> &roles, size_t cacheSize) :
+    tvecs(tvecs, DIM, wsz), cvecs(cvecs, DIM, wsz), mats(mats), rsz2(rsz2), cache_size(cacheSize) {
+  for (size_t i = 0; i != words.size(); ++i) dict_word[words[i]] = i;
+  for (size_t i = 0; i != roles.size(); ++i) dict_role[roles[i]] = i;
+}
+
+size_t QueryKB::parse(const string &expr, Plan &plan) const {
+  vector<size_t> terms;
+  for (const string& pre : split_wrt_brackets(expr, '+')) {
+    const string s = strip(pre);
+    if (startsWith(s, "trans(") && endsWith(s, ')')) {
+      const string inner = s.substr(6, s.size() - 7);
+      const size_t sep = inner.rfind(", ");
+      if (sep == string::npos) throw invalid_argument("no role in " + s);
+      const auto r = dict_role.find(inner.substr(sep + 2));
+      if (r == dict_role.end() || r->second >= rsz2) throw invalid_argument("unknown role " + inner.substr(sep + 2));
+      size_t x = parse(inner.substr(0, sep), plan);
+      if (plan.nodes[x].kind != Node::TRANS) {
+        plan.nodes.push_back(Node {Node::TRANS, plan.nodes[x].level + 1, 0, {x}, {}});
+        x = plan.nodes.size() - 1;
+      }
+      plan.nodes[x].chain.push_back(r->second);
+      terms.push_back(x);
+    } else if (startsWith(s, "(") && endsWith(s, ')')) {
+      terms.push_back(parse(s.substr(1, s.size() - 2), plan));
+    } else {
+      const auto w = dict_word.find(s);
+      if (w == dict_word.end() || w->second >= static_cast<ent_index>(tvecs.cols())) throw invalid_argument("unknown word " + s);
+      plan.nodes.push_back(Node {Node::WORD, 0, w->second, {}, {}});
+      terms.push_back(plan.nodes.size() - 1);
+    }
+  }
+  // every term is normalized already
+  if (terms.size() == 1) return terms[0];
+  unsigned int level = 0;
+  for (size_t x : terms) level = max(level, plan.nodes[x].level + 1);
+  plan.nodes.push_back(Node {Node::SUM, level, 0, move(terms), {}});
+  return plan.nodes.size() - 1;
+}
+
+QueryKB::Plan QueryKB::compile(const vector<string> &exprs) const {
+  Plan plan;
+  plan.roots.reserve(exprs.size());
+  for (const string& expr : exprs) plan.roots.push_back(parse(expr, plan));
+  for (const Node& n : plan.nodes) plan.levels = max(plan.levels, n.level + 1);
+  return plan;
+}
+
+shared_ptr<const MatrixXf> QueryKB::product(const vector<unsigned int> &chain, size_t cols) {
+  const string key(reinterpret_cast<const char*>(chain.data()), chain.size() * sizeof(unsigned int));
+  {
+    lock_guard<mutex> lock(cache_mtx);
+    const auto it = cached.find(key);
+    if (it != cached.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+    if (cache_size == 0) return nullptr;
+    if (uses.size() > cache_size * 64) uses.clear();
+    if ((uses[key] += cols) < DIM) return nullptr;
+    uses.erase(key);
+  }
+  // numpy sees the column-major mats transposed, so M_rk ... M_r1 is the
+  // transpose of the product of the maps in chain order
+  auto p = make_shared<MatrixXf>(Map<const MatrixXf>(mats + static_cast<size_t>(chain[0]) * DIM * DIM, DIM, DIM));
+  for (size_t i = 1; i != chain.size(); ++i)
+    *p = *p * Map<const MatrixXf>(mats + static_cast<size_t>(chain[i]) * DIM * DIM, DIM, DIM);
+
+  lock_guard<mutex> lock(cache_mtx);
+  if (cached.find(key) == cached.end()) {
+    lru.emplace_front(key, p);
+    cached[key] = lru.begin();
+    if (lru.size() > cache_size) {
+      cached.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+  return p;
+}
+
+void QueryKB::apply(const vector<unsigned int> &chain, MatrixXf &panel) {
+  if (chain.size() > 1) {
+    if (const auto p = product(chain, panel.cols())) {
+      panel = p->transpose() * panel;
+      return;
+    }
+  }
+  for (unsigned int r : chain)
+    panel = Map<const MatrixXf>(mats + static_cast<size_t>(r) * DIM * DIM, DIM, DIM).transpose() * panel;
+}
+
+void QueryKB::evaluate(const Plan &plan, MatrixXf &vecs) {
+  MatrixXf vs(DIM, plan.nodes.size());
+  vector<vector<size_t>> by_level(plan.levels);
+  for (size_t i = 0; i != plan.nodes.size(); ++i) by_level[plan.nodes[i].level].push_back(i);
+
+  MatrixXf panel;
+  for (const auto& level : by_level) {
+    // trans of the same chain run as one product over a panel
+    map<vector<unsigned int>, vector<size_t>> groups;
+    for (size_t i : level) {
+      const Node& n = plan.nodes[i];
+      switch (n.kind) {
+        case Node::WORD:
+          vs.col(i) = tvecs.col(n.word);
+          break;
+        case Node::SUM:
+          vs.col(i).setZero();
+          for (size_t x : n.args) vs.col(i) += vs.col(x);
+          vs.col(i).normalize();
+          break;
+        case Node::TRANS:
+          groups[n.chain].push_back(i);
+          break;
+      }
+    }
+    for (const auto& g : groups) {
+      panel.resize(DIM, g.second.size());
+      for (size_t j = 0; j != g.second.size(); ++j) panel.col(j) = vs.col(plan.nodes[g.second[j]].args[0]);
+      apply(g.first, panel);
+      for (size_t j = 0; j != g.second.size(); ++j) vs.col(g.second[j]) = panel.col(j).normalized();
+    }
+  }
+
+  vecs.resize(DIM, plan.roots.size());
+  for (size_t q = 0; q != plan.roots.size(); ++q) vecs.col(q) = vs.col(plan.roots[q]);
+}
+
+void QueryKB::top(const Plan &plan, size_t k, bool contexts,
+                  Matrix<ent_index, Dynamic, Dynamic> &indices, MatrixXf &scores) {
+  MatrixXf vecs;
+  evaluate(plan, vecs);
+  const auto& tab = contexts ? cvecs : tvecs;
+  const ent_index wsz = tab.cols();
+  k = min<size_t>(k, wsz);
+  indices.resize(k, vecs.cols());
+  scores.resize(k, vecs.cols());
+
+  MatrixXf block;
+  for (Index b = 0; b < vecs.cols(); b += BLOCK) {
+    const Index e = min<Index>(vecs.cols(), b + BLOCK);
+    TopK top(e - b, k);
+    for (ent_index f = 0; f < wsz; f += TOP_BLOCK) {
+      const ent_index fe = min(wsz, f + TOP_BLOCK);
+      block.noalias() = tab.middleCols(f, fe - f).transpose() * vecs.middleCols(b, e - b);
+      top.push(f, block);
+    }
+    top.get(indices, scores, b);
+  }
+}
+
+size_t QueryKB::cachedProducts() {
+  lock_guard<mutex> lock(cache_mtx);
+  return lru.size();
+}
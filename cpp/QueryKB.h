@@ -0,0 +1,79 @@
+#ifndef GLIMVEC_QUERYKB_H
+#define GLIMVEC_QUERYKB_H
+
+#include <vector>
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "Eigen/Core"
+
+#include "BatchKB.h"
+
+/* compositional queries as ModelKB.calc evaluates them: an expression is
+ * terms "word", "(expr)" or "trans(expr, role)" joined by '+', every term
+ * and sum normalized. the model is read in place, in the normalized form of
+ * ModelKB.py and row-major as numpy holds it: tvecs and cvecs of wsz rows,
+ * mats of rsz2 DIM x DIM matrices. */
+class QueryKB {
+public:
+  struct Node {
+    enum Kind : unsigned char { WORD, SUM, TRANS } kind;
+    unsigned int level;              // 0 for words, then one above the args
+    ent_index word;
+    std::vector<size_t> args;        // the terms of a sum, or the operand of trans
+    std::vector<unsigned int> chain; // roles of trans, innermost first
+  };
+  /* nested trans are folded into one chain, since normalizing in between
+   * only scales: trans(trans(x, r1), r2) applies M_r2 M_r1 to x once. */
+  struct Plan {
+    std::vector<Node> nodes;
+    std::vector<size_t> roots; // one per expression
+    unsigned int levels = 0;
+  };
+
+private:
+  Eigen::Map<const Eigen::MatrixXf> tvecs;
+  Eigen::Map<const Eigen::MatrixXf> cvecs;
+  const float* mats;
+  unsigned int rsz2;
+  std::unordered_map<std::string, ent_index> dict_word;
+  std::unordered_map<std::string, unsigned int> dict_role;
+
+  /* products of chains, least recently used last. a chain is multiplied out
+   * once DIM vectors have gone through it, when the product has paid for
+   * itself; until then it is applied role by role. */
+  size_t cache_size;
+  typedef std::pair<std::string, std::shared_ptr<const Eigen::MatrixXf>> Product;
+  std::list<Product> lru;
+  std::unordered_map<std::string, std::list<Product>::iterator> cached;
+  std::unordered_map<std::string, size_t> uses;
+  std::mutex cache_mtx;
+  std::shared_ptr<const Eigen::MatrixXf> product(const std::vector<unsigned int>& chain, size_t cols);
+
+  size_t parse(const std::string& expr, Plan& plan) const;
+  void apply(const std::vector<unsigned int>& chain, Eigen::MatrixXf& panel);
+
+public:
+  QueryKB(const float* tvecs, const float* cvecs, const float* mats, ent_index wsz, unsigned int rsz2,
+          const std::vector<std::string>& words, const std::vector<std::string>& roles, size_t cacheSize);
+
+  // throws std::invalid_argument for malformed expressions or unknown names
+  Plan compile(const std::vector<std::string>& exprs) const;
+
+  // column k of vecs is the vector of expression k
+  void evaluate(const Plan& plan, Eigen::MatrixXf& vecs);
+
+  /* the k best of tvecs (or cvecs, with contexts) by dot product with each
+   * expression, best first as show_top prints them; column q of indices and
+   * scores for expression q. */
+  void top(const Plan& plan, size_t k, bool contexts,
+           Eigen::Matrix<ent_index, Eigen::Dynamic, Eigen::Dynamic>& indices, Eigen::MatrixXf& scores);
+
+  size_t cachedProducts();
+};
+
+
+#endif //GLIMVEC_QUERYKB_H
@@ -0,0 +1,50 @@
+#ifndef GLIMVEC_RINGBUFFER_H
+#define GLIMVEC_RINGBUFFER_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+/* a fixed-capacity ring of items passed from one producer thread to one
+ * consumer thread without locks. items are filled and read in place: the
+ * producer fills back() then push()es it; the consumer reads at(k), the
+ * k-th queued item, and pop()s when done with the oldest. */
+template <typename T>
+class RingBuffer {
+
+  std::unique_ptr<T[]> items;
+  const size_t mask;
+  char pad0[64];
+  std::atomic_size_t head; // next to pop, written by the consumer
+  char pad1[64];
+  std::atomic_size_t tail; // next to push, written by the producer
+  char pad2[64];
+  std::atomic_bool closed;
+
+public:
+  explicit RingBuffer(unsigned int capacityLog2) :
+      items(new T[size_t(1) << capacityLog2]), mask((size_t(1) << capacityLog2) - 1), head(0), tail(0), closed(false) {}
+  RingBuffer(const RingBuffer& that) = delete;
+  RingBuffer& operator=(const RingBuffer& that) = delete;
+
+  // producer: the item to fill next, or nullptr if full
+  T* back() {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    return t - head.load(std::memory_order_acquire) > mask ? nullptr : &items[t & mask];
+  }
+  void push() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+  // producer: no more items will be pushed
+  void close() { closed.store(true, std::memory_order_release); }
+
+  // consumer: the k-th queued item, or nullptr if fewer are queued
+  const T* at(size_t k) const {
+    const size_t h = head.load(std::memory_order_relaxed);
+    return tail.load(std::memory_order_acquire) - h > k ? &items[(h + k) & mask] : nullptr;
+  }
+  void pop() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+  // consumer: true once closed and drained
+  bool done() const { return closed.load(std::memory_order_acquire) && at(0) == nullptr; }
+};
+
+
+#endif //GLIMVEC_RINGBUFFER_H
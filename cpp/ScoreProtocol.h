@@ -0,0 +1,56 @@
+#ifndef GLIMVEC_SCOREPROTOCOL_H
+#define GLIMVEC_SCOREPROTOCOL_H
+
+#include <cstdint>
+
+/* the binary protocol of serveKB over a Unix domain socket, in host byte
+ * order as both ends run on one machine. on connect the server sends a
+ * ScoreHello; the client then sends ScoreRequests, as many as it likes
+ * ahead of the replies. each request gets a ScoreReply followed by n
+ * ScoreAnswers; replies may come out of order, and are matched by id. */
+
+constexpr uint32_t SCORE_MAGIC = 0x4b4d4c47; // "GLMK"
+constexpr uint16_t SCORE_MAX_K = 1000;
+
+enum ScoreStatus : uint32_t {
+  SCORE_OK = 0,
+  SCORE_BAD_ENTITY = 1,
+  SCORE_BAD_RELATION = 2,
+  SCORE_BAD_K = 3,
+};
+
+struct ScoreHello {
+  uint32_t magic;
+  uint32_t relations; // without inverses
+  uint64_t entities;
+};
+
+/* the k best tails of (entity, relation) with direction 1, or the k best
+ * heads of (relation, entity) with direction 0, as ModelKB.get_score ranks
+ * them. */
+struct ScoreRequest {
+  uint64_t id; // echoed in the reply
+  uint64_t entity;
+  uint32_t relation;
+  uint16_t k;
+  uint8_t direction;
+  uint8_t pad;
+};
+
+struct ScoreReply {
+  uint64_t id;
+  uint32_t status;
+  uint32_t n; // answers that follow, best first; 0 unless SCORE_OK
+};
+
+struct ScoreAnswer {
+  uint64_t entity;
+  float score;
+  uint32_t pad;
+};
+
+static_assert(sizeof(ScoreRequest) == 24 && sizeof(ScoreReply) == 16 && sizeof(ScoreAnswer) == 16,
+              "the protocol has no padding of the compiler's");
+
+
+#endif //GLIMVEC_SCOREPROTOCOL_H
@@ -0,0 +1,47 @@
+#include "StepBuffer.h"
+
+using namespace std;
+
+static constexpr unsigned long long COUNT_MASK = 0xffff;
+
+StepBuffer::StepBuffer(StepCounters *steps, unsigned int slotsLog2) :
+    steps(steps), slots(new atomic_ullong[1ull << slotsLog2]), shift(64 - slotsLog2) {
+  for (unsigned long long k = 0; k != 1ull << slotsLog2; ++k) slots[k].store(0, memory_order_relaxed);
+}
+
+void StepBuffer::add(unsigned long long i, unsigned long long d) {
+  atomic_ullong& slot = slots[(i * 0x9E3779B97F4A7C15ull) >> shift];
+  const unsigned long long key = (i + 1) << 16;
+  unsigned long long v = slot.load(memory_order_relaxed);
+  // only drain competes for the slot, by clearing its count
+  while (true) {
+    if ((v & ~COUNT_MASK) == key) {
+      const unsigned long long c = (v & COUNT_MASK) + d;
+      if (c < FLUSH) {
+        if (slot.compare_exchange_weak(v, key | c, memory_order_relaxed)) return;
+      } else if (slot.compare_exchange_weak(v, key, memory_order_relaxed)) {
+        steps->add(i, c);
+        return;
+      }
+    } else if (d >= FLUSH) {
+      steps->add(i, d);
+      return;
+    } else if (slot.compare_exchange_weak(v, key | d, memory_order_relaxed)) {
+      if ((v & COUNT_MASK) != 0) steps->add((v >> 16) - 1, v & COUNT_MASK);
+      return;
+    }
+  }
+}
+
+void StepBuffer::drain() {
+  const unsigned long long n = 1ull << (64 - shift);
+  for (unsigned long long k = 0; k != n; ++k) {
+    unsigned long long v = slots[k].load(memory_order_relaxed);
+    while ((v & COUNT_MASK) != 0) {
+      if (slots[k].compare_exchange_weak(v, v & ~COUNT_MASK, memory_order_relaxed)) {
+        steps->add((v >> 16) - 1, v & COUNT_MASK);
+        break;
+      }
+    }
+  }
+}
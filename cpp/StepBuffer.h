@@ -0,0 +1,36 @@
+#ifndef __STEPBUFFER_H
+#define __STEPBUFFER_H
+
+#include <atomic>
+#include <memory>
+
+#include "StepCounters.h"
+
+/* increments of shared step counters by one thread, held back in a small
+ * direct-mapped table so that the counters of hub entities and frequent
+ * relations are not written by every thread on every step. a slot passes
+ * its count on when it reaches FLUSH, or when another counter takes the
+ * slot; so a shared counter lags the exact count by less than FLUSH per
+ * thread. add is for the owner thread only; drain may run in any thread.
+ * counters are indexed below 2^48. */
+class StepBuffer {
+
+  StepCounters* steps;
+  std::unique_ptr<std::atomic_ullong[]> slots; // (counter + 1) << 16 | count
+  unsigned int shift;
+
+public:
+  static constexpr unsigned long long FLUSH = 256;
+
+  // 2^slotsLog2 slots in front of steps, slotsLog2 >= 1
+  StepBuffer(StepCounters* steps, unsigned int slotsLog2);
+  StepBuffer(const StepBuffer& that) = delete;
+  StepBuffer& operator=(const StepBuffer& that) = delete;
+
+  void add(unsigned long long i, unsigned long long d);
+  // passes all held counts on, making the counters exact if no add runs
+  void drain();
+};
+
+
+#endif //__STEPBUFFER_H
@@ -0,0 +1,31 @@
+#include "StepCounters.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void StepCounters::allocate(size_t n, bool compact) {
+  wide.reset();
+  narrow.reset();
+  if (compact) {
+    narrow = unique_ptr<atomic_uint[]>(new atomic_uint[n]);
+    for (size_t i = 0; i != n; ++i) narrow[i].store(0, memory_order_relaxed);
+  } else {
+    wide = unique_ptr<atomic_ullong[]>(new atomic_ullong[n]);
+    for (size_t i = 0; i != n; ++i) wide[i].store(0, memory_order_relaxed);
+  }
+  len = n;
+}
+
+void StepCounters::set(size_t i, unsigned long long x) {
+  if (narrow) narrow[i].store(static_cast<unsigned int>(min(x, NARROW_MAX)), memory_order_relaxed);
+  else wide[i].store(x, memory_order_relaxed);
+}
+
+void StepCounters::add(size_t i, unsigned long long d) {
+  if (!narrow) {
+    wide[i].fetch_add(d, memory_order_relaxed);
+  } else if (narrow[i].load(memory_order_relaxed) < NARROW_MAX) {
+    narrow[i].fetch_add(static_cast<unsigned int>(min(d, 0xffffULL)), memory_order_relaxed);
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef __STEPCOUNTERS_H
+#define __STEPCOUNTERS_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+/* step counters of vectors or matrices, 64 bits each, or 32 when compact.
+ * compact counters saturate just below 2^32, where the learning rate
+ * 1 / (EL * steps + 1) has long stopped moving; saved models hold 64-bit
+ * counters either way. */
+class StepCounters {
+
+  std::unique_ptr<std::atomic_ullong[]> wide;
+  std::unique_ptr<std::atomic_uint[]> narrow;
+  size_t len = 0;
+
+public:
+  // leaves room for 2^16 concurrent adds of up to 2^16 each past the check
+  static constexpr unsigned long long NARROW_MAX = 0xffff0000ULL;
+
+  // n counters, all 0
+  void allocate(size_t n, bool compact);
+
+  size_t size() const { return len; }
+  bool isCompact() const { return narrow != nullptr; }
+  size_t bytes() const { return len * (narrow ? sizeof(std::atomic_uint) : sizeof(std::atomic_ullong)); }
+  const void* address(size_t i) const { return narrow ? static_cast<const void*>(&narrow[i]) : &wide[i]; }
+
+  unsigned long long operator[](size_t i) const {
+    return narrow ? narrow[i].load(std::memory_order_relaxed) : wide[i].load(std::memory_order_relaxed);
+  }
+  void set(size_t i, unsigned long long x);
+  void add(size_t i, unsigned long long d);
+};
+
+
+#endif //__STEPCOUNTERS_H
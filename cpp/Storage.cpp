@@ -0,0 +1,127 @@
+#include "Storage.h"
+
+#include <stdexcept>
+#include <vector>
+
+#include "Eigen/Core"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+void Storage::allocate(size_t n) {
+  release();
+  ptr = static_cast<float*>(Eigen::internal::aligned_malloc(n * sizeof(float)));
+  len = n;
+}
+
+void Storage::view(float *p, size_t n) {
+  release();
+  ptr = p;
+  len = n;
+  owned = false;
+}
+
+#ifndef _WIN32
+static size_t page_size() {
+  return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void Storage::mapFile(const string &file, size_t n) {
+  release();
+  const size_t bytes = n * sizeof(float);
+  int fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) throw runtime_error("cannot open " + file);
+  if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+    close(fd);
+    throw runtime_error("cannot resize " + file);
+  }
+  void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) throw runtime_error("cannot map " + file);
+  madvise(p, bytes, MADV_RANDOM);
+  base = p;
+  map_len = bytes;
+  ptr = static_cast<float*>(p);
+  len = n;
+  mapped = true;
+}
+
+void Storage::mapPrivate(const string &file, size_t offset, size_t n) {
+  release();
+  const size_t bytes = offset + n * sizeof(float);
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) throw runtime_error("cannot open " + file);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < bytes) {
+    close(fd);
+    throw runtime_error("truncated file " + file);
+  }
+  void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) throw runtime_error("cannot map " + file);
+  base = p;
+  map_len = bytes;
+  ptr = reinterpret_cast<float*>(static_cast<char*>(p) + offset);
+  len = n;
+  mapped = true;
+}
+
+void Storage::release() {
+  if (mapped) munmap(base, map_len);
+  else if (owned) Eigen::internal::aligned_free(ptr);
+  ptr = nullptr;
+  len = 0;
+  mapped = false;
+  owned = true;
+  base = nullptr;
+  map_len = 0;
+}
+
+bool Storage::lock(size_t begin, size_t end) {
+  if (!mapped || begin >= end) return true;
+  const size_t page = page_size();
+  char* b = reinterpret_cast<char*>(ptr + begin);
+  char* pb = b - reinterpret_cast<size_t>(b) % page;
+  return mlock(pb, reinterpret_cast<char*>(ptr + end) - pb) == 0;
+}
+
+double Storage::residentFraction() const {
+  if (!mapped || len == 0) return 1.0;
+  const size_t page = page_size();
+  const size_t pages = (map_len + page - 1) / page;
+  vector<char> vec(pages);
+#ifdef __linux__
+  if (mincore(base, map_len, reinterpret_cast<unsigned char*>(vec.data())) != 0) return -1.0;
+#else
+  if (mincore(static_cast<char*>(base), map_len, vec.data()) != 0) return -1.0;
+#endif
+  size_t resident = 0;
+  for (char x : vec) resident += x & 1;
+  return static_cast<double>(resident) / pages;
+}
+#else
+void Storage::mapFile(const string &file, size_t n) {
+  throw runtime_error("file backed storage is not supported on this platform");
+}
+
+void Storage::mapPrivate(const string &file, size_t offset, size_t n) {
+  throw runtime_error("file backed storage is not supported on this platform");
+}
+
+void Storage::release() {
+  if (owned) Eigen::internal::aligned_free(ptr);
+  ptr = nullptr;
+  len = 0;
+  owned = true;
+}
+
+bool Storage::lock(size_t begin, size_t end) { return true; }
+
+double Storage::residentFraction() const { return 1.0; }
+#endif
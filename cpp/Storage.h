@@ -0,0 +1,44 @@
+#ifndef __STORAGE_H
+#define __STORAGE_H
+
+#include <string>
+#include <cstddef>
+
+/* a float buffer, either on the heap or backed by a memory-mapped file so
+ * that it may exceed physical memory. file mapping is POSIX only. */
+class Storage {
+
+  float* ptr = nullptr;
+  size_t len = 0;
+  bool mapped = false;
+  bool owned = true;
+  void* base = nullptr;
+  size_t map_len = 0;
+
+public:
+  Storage() = default;
+  ~Storage() { release(); }
+  Storage(const Storage& that) = delete;
+  Storage& operator=(const Storage& that) = delete;
+
+  void allocate(size_t n);
+  // create or resize file to hold n floats and map it shared
+  void mapFile(const std::string& file, size_t n);
+  /* map file copy-on-write and view n floats starting at byte offset; the
+   * file is never modified, and pages are only copied when written. */
+  void mapPrivate(const std::string& file, size_t offset, size_t n);
+  // view n floats at p owned by someone else, who must keep them alive
+  void view(float* p, size_t n);
+  void release();
+
+  float* data() const { return ptr; }
+  size_t size() const { return len; }
+  bool isMapped() const { return mapped; }
+
+  // keep the floats in [begin, end) resident in RAM
+  bool lock(size_t begin, size_t end);
+  // fraction of the pages of a mapped file currently in RAM (1 for the heap)
+  double residentFraction() const;
+};
+
+#endif //__STORAGE_H
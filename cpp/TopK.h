@@ -0,0 +1,67 @@
+#ifndef GLIMVEC_TOPK_H
+#define GLIMVEC_TOPK_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+
+#include "Eigen/Core"
+
+#include "BatchKB.h"
+
+/* the k best entities of each of a number of queries, best first and ties to
+ * the lower index, from scores offered a block of entities at a time in
+ * index order: memory stays at a k-sized heap per query besides the block. */
+class TopK {
+
+  typedef std::pair<float, ent_index> Cand;
+  static bool better(const Cand& x, const Cand& y) {
+    return x.first > y.first || (x.first == y.first && x.second < y.second);
+  }
+
+  size_t k;
+  std::vector<std::vector<Cand>> heaps; // the k best so far, the worst on top
+
+public:
+  TopK(size_t queries, size_t k) : k(k), heaps(queries) {
+    for (auto& x : heaps) x.reserve(k);
+  }
+
+  // row j of block holds the scores of entity first + j, a column per query
+  void push(ent_index first, const Eigen::MatrixXf& block) {
+    for (size_t q = 0; q != heaps.size(); ++q) {
+      auto& heap = heaps[q];
+      for (Eigen::Index j = 0; j != block.rows(); ++j) {
+        // entities come in index order, so a tie never displaces
+        const Cand c(block(j, q), first + j);
+        if (heap.size() < k) {
+          heap.push_back(c);
+          std::push_heap(heap.begin(), heap.end(), better);
+        } else if (k != 0 && c.first > heap.front().first) {
+          std::pop_heap(heap.begin(), heap.end(), better);
+          heap.back() = c;
+          std::push_heap(heap.begin(), heap.end(), better);
+        }
+      }
+    }
+  }
+
+  /* column col0 + q of indices and scores for query q, of k rows; the heaps
+   * are emptied */
+  void get(Eigen::Matrix<ent_index, Eigen::Dynamic, Eigen::Dynamic>& indices, Eigen::MatrixXf& scores,
+           Eigen::Index col0 = 0) {
+    for (size_t q = 0; q != heaps.size(); ++q) {
+      auto& heap = heaps[q];
+      std::sort_heap(heap.begin(), heap.end(), better);
+      for (size_t j = 0; j != heap.size(); ++j) {
+        indices(j, col0 + q) = heap[j].second;
+        scores(j, col0 + q) = heap[j].first;
+      }
+      heap.clear();
+    }
+  }
+};
+
+
+#endif //GLIMVEC_TOPK_H
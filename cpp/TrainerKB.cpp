@@ -3,45 +3,51 @@
 #include <fstream>
 #include <cmath>
 #include <random>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <unordered_map>
+#include <thread>
 
 #include "HyperParametersKB.h"
 #include "misc.h"
+#include "TopK.h"
 
 using namespace std;
 using namespace Eigen;
 using namespace misc;
 
 
-/* hyper parameters. */
-static constexpr float vEta = V_ETA;
-static constexpr float mEta = M_ETA;
-static constexpr double orthSkip = ORTH_SKIP;
-static constexpr float orthRate = ORTH_RATE;
-static constexpr float orthEL = (orthRate / orthSkip) * (M_LAMBDA * SQRT_DIM / ORTH_COEF);
-static constexpr float autoFactor = AUTOENC_FACTOR;
-static constexpr float autoEta = AUTOENC_ETA;
-static constexpr double autoSkip = AUTOENC_SKIP;
-static constexpr float jointMEta = JOINT_M_ETA;
-static constexpr float jointM_EL = JOINT_M_ETA * JOINT_M_LAMBDA;
+thread_local TrainerKB::LocalHolds TrainerKB::local_steps;
+static atomic_ullong next_serial(1);
 
-static constexpr float vEL = V_ETA * V_LAMBDA;
-static constexpr float mEL = M_ETA * M_LAMBDA;
-static constexpr float autoEL = AUTOENC_ETA * AUTOENC_LAMBDA;
-
-static constexpr bool disableAutoencoder = DISABLE_AUTOENCODER;
-
-TrainerKB::TrainerKB() {
+TrainerKB::TrainerKB(const HyperParamsKB &hp) :
+    cvecs(nullptr, DIM, 0), tvecs(nullptr, DIM, 0),
+    encoder(nullptr, DIM * DIM, CODE_LEN), decoder(nullptr, DIM * DIM, CODE_LEN),
+    vEta(hp.vEta), mEta(hp.mEta), orthSkip(hp.orthSkip), orthRate(hp.orthRate),
+    orthEL(static_cast<float>((hp.orthRate / hp.orthSkip) * (hp.mLambda * SQRT_DIM / hp.orthCoef))),
+    autoFactor(AUTOENC_FACTOR), autoEta(hp.autoEta), autoSkip(hp.autoSkip),
+    jointMEta(hp.jointMEta), jointM_EL(hp.jointMEta * hp.jointMLambda),
+    vEL(hp.vEta * hp.vLambda), mEL(hp.mEta * hp.mLambda), autoEL(hp.autoEta * hp.autoLambda),
+    disableAutoencoder(hp.disableAutoencoder) {
   for (unsigned int i = 0; i != 256 * 6; ++i)
     sigtab[i] = static_cast<float>(1.0 / (exp(i / 256.0) + 1.0) - 0.5);
   sigtab[256 * 6] = -0.5f;
+  pool = make_shared<LocalPool>();
+  pool->serial = next_serial.fetch_add(1);
 
   Eigen::initParallel();
 }
-/* for experiments, one can slightly change the code to dynamically pass
- * hyper-parameters through constructor, instead of hard coding. */
 
-void TrainerKB::saveParams(const string &outPath) {
-  ofstream out_params(outPath + "params.json");
+// so that threads exiting later do not hand buffers back to this trainer
+TrainerKB::~TrainerKB() {
+  resetSteps();
+}
+
+string TrainerKB::paramsJson() const {
+  stringstream out_params;
   out_params.precision(17);
   out_params << scientific << '{' << endl
              << "  \"trainer\" : \"TrainerKB\"," << endl
@@ -62,9 +68,83 @@ void TrainerKB::saveParams(const string &outPath) {
              << "  \"autoEL\" : " << autoEL << ',' << endl
              << "  \"disableAutoencoder\" : " << disableAutoencoder << endl
              << '}' << endl;
+  return out_params.str();
+}
+
+void TrainerKB::saveParams(const string &outPath) {
+  ofstream out_params(outPath + "params.json");
+  out_params << paramsJson();
   out_params.close();
 }
 
+void TrainerKB::place(float *p, size_t sz, const function<unsigned int(size_t)> &nodeOf) {
+  if (placement == numa::NONE) return;
+  const unsigned int nodes = numa::numNodes();
+  if (placement == numa::INTERLEAVE || !nodeOf)
+    numa::placePages(p, sz * sizeof(float), [=](size_t off) { return (off >> 12) % nodes; });
+  else
+    numa::placePages(p, sz * sizeof(float), nodeOf);
+}
+
+void TrainerKB::placeVecs(ent_index wsz) {
+  auto nodeOf = [=](size_t off) { return entityNode(off / (DIM * sizeof(float))); };
+  place(cvecs.data(), cvecs.size(), nodeOf);
+  place(tvecs.data(), tvecs.size(), nodeOf);
+}
+
+// a relation and its inverse on the same node, in one pass over the store
+void TrainerKB::placeMats() {
+  const unsigned int rsz = mats.size() / 2;
+  const unsigned int nodes = numa::numNodes();
+  place(mstore.data(), mstore.size(), [=](size_t off) {
+    return static_cast<unsigned int>(off / (DIM * DIM * sizeof(float)) % rsz % nodes);
+  });
+}
+
+// entities dealt to nodes 16 at a time, 16 KB of vectors or whole 4 KB pages
+static constexpr ent_index NODE_BLOCK = 16;
+
+unsigned int TrainerKB::entityNode(ent_index i) const {
+  return numa::blockNode(i, NODE_BLOCK, numa::numNodes());
+}
+
+void TrainerKB::tailVectors(const vector<pair<ent_index, unsigned int>> &queries, MatrixXf &vs) const {
+  vs.resize(DIM, queries.size());
+  for (size_t q = 0; q != queries.size(); ++q) {
+    const ent_index hi = queries[q].first;
+    const auto& m = mats[queries[q].second];
+    // numpy sees the column-major mats transposed
+    vs.col(q).noalias() = m.transpose() * tvecs.col(hi);
+    vs.col(q) *= sqrtf(DIM / m.squaredNorm()) / tvecs.col(hi).norm();
+  }
+}
+
+void TrainerKB::tailBlock(const MatrixXf &vs, ent_index first, ent_index n, MatrixXf &scores) const {
+  scores.noalias() = cvecs.middleCols(first, n).transpose() * vs;
+  for (ent_index j = 0; j != n; ++j)
+    scores.row(j) /= 1.0f + vEL * static_cast<float>(v_steps[first + j]);
+}
+
+void TrainerKB::topTails(const vector<pair<ent_index, unsigned int>> &queries, size_t k,
+                         Matrix<ent_index, Dynamic, Dynamic> &indices, MatrixXf &scores) const {
+  const ent_index wsz = cvecs.cols();
+  const size_t qsz = queries.size();
+  k = min<size_t>(k, wsz);
+  MatrixXf vs;
+  tailVectors(queries, vs);
+
+  TopK top(qsz, k);
+  MatrixXf block;
+  for (ent_index b = 0; b < wsz; b += TAIL_BLOCK) {
+    const ent_index e = min(wsz, b + TAIL_BLOCK);
+    tailBlock(vs, b, e - b, block);
+    top.push(b, block);
+  }
+  indices.resize(k, qsz);
+  scores.resize(k, qsz);
+  top.get(indices, scores);
+}
+
 static string array_string(const Ref<const ArrayXf>& a) {
   return mkString(a.data(), a.data() + a.size(), "[", ", ", "]\n");
 }
@@ -73,62 +153,335 @@ static string vec_string(const Ref<const VectorXf>& v) {
   return mkString(v.data(), v.data() + 8, "[", ", ", "...]\n");
 }
 
-void TrainerKB::update(RandomGenerator &rnd, unsigned int hi,
-                       const vector<vector<pair<unsigned int, unsigned int>>> &pths) {
+TrainerKB::LocalSteps& TrainerKB::localSteps() {
+  vector<LocalHold>& held = local_steps.held;
+  for (const auto& x : held) {
+    if (x.serial == pool->serial) return *x.steps;
+  }
+  /* first steps of this thread since the counters were allocated; holds on
+   * buffers dropped since, by a reset or with their trainer, are let go. */
+  held.erase(remove_if(held.begin(), held.end(), [](const LocalHold& x) {
+    const auto p = x.pool.lock();
+    return !p || p->serial != x.serial;
+  }), held.end());
+  lock_guard<mutex> lock(pool->mtx);
+  LocalSteps* x;
+  if (pool->idle.empty()) {
+    pool->locals.emplace_back(new LocalSteps(*this, pool->locals.size()));
+    x = pool->locals.back().get();
+  } else {
+    x = pool->idle.back();
+    pool->idle.pop_back();
+  }
+  held.push_back(LocalHold {pool, pool->serial, x});
+  return *x;
+}
+
+/* the pool may have dropped the buffers since, or outlived its trainer;
+ * both change its serial under the lock. */
+void TrainerKB::LocalHold::release() {
+  if (const auto p = pool.lock()) {
+    lock_guard<mutex> lock(p->mtx);
+    if (p->serial == serial) {
+      steps->v.drain();
+      steps->m.drain();
+      steps->d.drain();
+      steps->shard = -1;
+      p->idle.push_back(steps);
+    }
+  }
+}
+
+void TrainerKB::resetSteps() {
+  lock_guard<mutex> lock(pool->mtx);
+  pool->locals.clear();
+  pool->idle.clear();
+  pool->serial = next_serial.fetch_add(1);
+}
+
+const float* TrainerKB::parameters(const string &name, vector<size_t> &shape) const {
+  if (name == "cvecs" || name == "tvecs") {
+    shape = {static_cast<size_t>(cvecs.cols()), DIM};
+    return name == "cvecs" ? cvecs.data() : tvecs.data();
+  }
+  if (name == "mats") {
+    shape = {mats.size(), DIM, DIM};
+    return mstore.data();
+  }
+  if (name == "encoder" || name == "decoder") {
+    shape = {CODE_LEN, DIM, DIM};
+    return name == "encoder" ? encoder.data() : decoder.data();
+  }
+  return nullptr;
+}
+
+void TrainerKB::stepCounts(vector<unsigned long long> &vsteps, vector<unsigned long long> &msteps,
+                           unsigned long long &dstep) {
+  flushSteps();
+  vsteps.resize(cvecs.cols() * 2);
+  for (size_t i = 0; i != vsteps.size(); ++i) vsteps[i] = v_steps[i];
+  msteps.resize(mats.size());
+  for (size_t i = 0; i != msteps.size(); ++i) msteps[i] = m_steps[i];
+  dstep = denc_step[0];
+}
+
+vector<pair<string, size_t>> TrainerKB::memoryUsage() const {
+  const auto store = [](const char* name, const Storage& s) {
+    return make_pair(string(name) + (s.isMapped() ? " (mapped)" : ""), s.size() * sizeof(float));
+  };
+  vector<pair<string, size_t>> ret;
+  ret.push_back(store("cvecs", cstore));
+  ret.push_back(store("tvecs", tstore));
+  ret.push_back(store("mats", mstore));
+  ret.push_back(store("encoder", estore));
+  ret.push_back(store("decoder", dstore));
+  ret.emplace_back(compact_steps ? "step counters (32-bit)" : "step counters",
+                   v_steps.bytes() + m_steps.bytes() + denc_step.bytes());
+  ret.emplace_back("step counters at last save", saved_vsteps.bytes() + saved_msteps.bytes());
+  if (shards) {
+    ret.emplace_back("shards", shards->owners.size() * sizeof(unsigned short) +
+                     shards->rings.size() * (sizeof(Increment) << INCREMENT_RING_LOG2));
+  }
+  return ret;
+}
+
+void TrainerKB::enableProfiler(unsigned int rate) {
+  profiler = unique_ptr<ContentionProfiler>(new ContentionProfiler(cvecs.cols(), mats.size(), rate));
+}
+
+// announces a write to the contention profiler, if any, for its scope
+class ProfiledWrite {
+  ContentionProfiler* prof;
+  unsigned int tid;
+public:
+  ProfiledWrite(ContentionProfiler* prof, unsigned int tid, ContentionProfiler::Kind kind, size_t index,
+                const float* p, size_t n) : prof(prof), tid(tid) {
+    if (prof) prof->begin(tid, kind, index, p, n * sizeof(float));
+  }
+  ~ProfiledWrite() { if (prof) prof->end(tid); }
+};
+
+void TrainerKB::flushSteps() {
+  lock_guard<mutex> lock(pool->mtx);
+  for (auto& x : pool->locals) {
+    x->v.drain();
+    x->m.drain();
+    x->d.drain();
+  }
+}
+
+void TrainerKB::prefetch(const BatchKB &b) const {
+  // matrices, at 256 KB each, would only evict the vectors
+  misc::prefetch(tvecs.col(b.head).data(), DIM * sizeof(float));
+  misc::prefetch(v_steps.address(cvecs.cols() + b.head), sizeof(unsigned long long));
+  for (unsigned int i = 0; i != b.size; ++i) {
+    misc::prefetch(cvecs.col(b.tails[i]).data(), DIM * sizeof(float));
+    misc::prefetch(v_steps.address(b.tails[i]), sizeof(unsigned long long));
+  }
+}
+
+void TrainerKB::setShards(unsigned int n, vector<unsigned short> owners) {
+  if (n == 0) {
+    shards.reset();
+    return;
+  }
+  if (owners.size() != static_cast<size_t>(cvecs.cols())) throw runtime_error("one owner per entity expected");
+  shards = unique_ptr<Shards>(new Shards);
+  shards->n = n;
+  shards->owners = move(owners);
+  for (unsigned int i = 0; i != n * n; ++i) shards->rings.emplace_back(new IncrementRing(INCREMENT_RING_LOG2));
+  shards->active = n;
+}
+
+void TrainerKB::joinShard(unsigned int shard) {
+  localSteps().shard = static_cast<int>(shard);
+}
+
+// the slot to fill for owner, applying what comes in while the ring to it is full
+TrainerKB::Increment& TrainerKB::outgoing(RandomGenerator &rnd, LocalSteps &steps, unsigned int owner) {
+  IncrementRing& ring = *shards->rings[owner * shards->n + steps.shard];
+  Increment* x;
+  while (!(x = ring.back())) {
+    if (drainShard(rnd) == 0) this_thread::yield();
+  }
+  return *x;
+}
+
+void TrainerKB::applyIncrement(RandomGenerator &rnd, LocalSteps &steps, const Increment &x) {
+  const Map<const VectorXf> u(x.u, DIM);
+  if (x.matrix) {
+    addMatrix(rnd, steps, static_cast<unsigned int>(x.index), u, Map<const VectorXf>(x.v, DIM));
+  } else {
+    addVector(rnd, steps, x.index, u, x.steps);
+  }
+}
+
+size_t TrainerKB::drainShard(RandomGenerator &rnd) {
+  LocalSteps& steps = localSteps();
+  if (!shards || steps.shard < 0) return 0;
+  size_t ret = 0;
+  const unsigned int n = shards->n;
+  for (unsigned int s = 0; s != n; ++s) {
+    IncrementRing& ring = *shards->rings[steps.shard * n + s];
+    // no more than were queued, so a busy sender cannot hold us here
+    for (size_t k = 0; k != (size_t(1) << INCREMENT_RING_LOG2); ++k) {
+      const Increment* x = ring.at(0);
+      if (!x) break;
+      applyIncrement(rnd, steps, *x);
+      ring.pop();
+      ++ret;
+    }
+  }
+  steps.local_incs -= ret; // counted once, by the sender
+  return ret;
+}
+
+/* as no increment is sent once all have left, a last drain after that
+ * leaves all rings empty. */
+void TrainerKB::leaveShard(RandomGenerator &rnd) {
+  if (!shards) return;
+  shards->active.fetch_sub(1);
+  while (shards->active.load() != 0) {
+    if (drainShard(rnd) == 0) this_thread::yield();
+  }
+  while (drainShard(rnd) != 0);
+}
+
+double TrainerKB::remoteFraction() {
+  lock_guard<mutex> lock(pool->mtx);
+  unsigned long long local = 0, remote = 0;
+  for (const auto& x : pool->locals) {
+    local += x->local_incs;
+    remote += x->remote_incs;
+  }
+  return local + remote == 0 ? 0.0 : static_cast<double>(remote) / (local + remote);
+}
+
+template <typename V>
+void TrainerKB::addVector(RandomGenerator &rnd, LocalSteps &steps, ent_index vi, const MatrixBase<V> &delta,
+                          unsigned long long n) {
+  const ent_index wsz = cvecs.cols();
+  const bool target = vi >= wsz;
+  const ent_index ei = target ? vi - wsz : vi;
+  if (shards && steps.shard >= 0) {
+    const unsigned int owner = shards->owners[ei];
+    if (owner != static_cast<unsigned int>(steps.shard)) {
+      Increment& x = outgoing(rnd, steps, owner);
+      x.index = vi;
+      x.steps = static_cast<unsigned int>(n);
+      x.matrix = false;
+      Map<VectorXf>(x.u, DIM) = delta;
+      shards->rings[owner * shards->n + steps.shard]->push();
+      ++steps.remote_incs;
+      return;
+    }
+    ++steps.local_incs;
+  }
+  {
+    auto& vecs = target ? tvecs : cvecs;
+    ProfiledWrite pw(profiler.get(), steps.tid, target ? ContentionProfiler::TARGET : ContentionProfiler::CONTEXT,
+                     ei, vecs.col(ei).data(), DIM);
+    vecs.col(ei) += delta;
+  }
+  steps.v.add(vi, n);
+}
+
+template <typename U, typename V>
+void TrainerKB::addMatrix(RandomGenerator &rnd, LocalSteps &steps, unsigned int mi, const MatrixBase<U> &u,
+                          const MatrixBase<V> &v) {
+  if (shards && steps.shard >= 0) {
+    const unsigned int owner = mi % shards->n;
+    if (owner != static_cast<unsigned int>(steps.shard)) {
+      Increment& x = outgoing(rnd, steps, owner);
+      x.index = mi;
+      x.steps = 1;
+      x.matrix = true;
+      Map<VectorXf>(x.u, DIM) = u;
+      Map<VectorXf>(x.v, DIM) = v;
+      shards->rings[owner * shards->n + steps.shard]->push();
+      ++steps.remote_incs;
+      return;
+    }
+    ++steps.local_incs;
+  }
+  ProfiledWrite pw(profiler.get(), steps.tid, ContentionProfiler::RELATION, mi, mats[mi].data(), DIM * DIM);
+  mats[mi] += u * v.transpose();
+  mincr_regularize(mi, rnd);
+}
+
+void TrainerKB::update(RandomGenerator &rnd, ent_index hi,
+                       const vector<vector<pair<unsigned int, ent_index>>> &pths) {
+  BatchKB b;
+  if (!b.assign(hi, pths))
+    throw invalid_argument("more than " + to_string(BatchKB::MAX_EDGES) + " edges in the paths of head " + to_string(hi));
+  update(rnd, b);
+}
+
+void TrainerKB::update(RandomGenerator &rnd, const BatchKB &b) {
 
+  const ent_index hi = b.head;
   MatrixXf twv(DIM, 128);
   MatrixXf unwv(DIM, 256);
 
-  unsigned int tdest[128];
-  unsigned int unis[128];
+  Samples s;
+  auto& tdest = s.tdest;
+  auto& unis = s.unis;
 
-  unsigned int inter_tvi[32];
-  unsigned int inter_mi[32];
-  float inter_mnrm[32];
+  auto& inter_tvi = s.inter_tvi;
+  auto& inter_mi = s.inter_mi;
+  auto& inter_mnrm = s.inter_mnrm;
 
-  unsigned int samp_sz = 0;
-  hi += ctvecs.cols() / 2;
-  twv.col(0) = (1.0f / (vEL * static_cast<float>(v_steps[hi].load(memory_order_relaxed)) + 1.0f)) * ctvecs.col(hi);
+  unsigned int& samp_sz = s.samp_sz;
+  const ent_index hvi = cvecs.cols() + hi;
+  twv.col(0) = (1.0f / (vEL * static_cast<float>(v_steps[hvi]) + 1.0f)) * tvecs.col(hi);
   unsigned int csz = 1;
 
-  for (const auto& pth : pths) {
+  /* with a pool of negatives, a sample has no negatives of its own; the
+   * pull of the pool on it takes the place of the first, see addPool. */
+  const bool pooled = b.negs != 0;
+  const unsigned int width = pooled ? 2 : 4;
+
+  // per sample
+  vector<float> scal;
+  vector<unsigned int> choices;
+  for (unsigned int path_k = 0; path_k != b.paths; ++path_k) {
+    const BatchKB::Path pth = b.path(path_k);
     vector<unsigned int> calcs;
     calcs.reserve(pth.size() + 1);
     calcs.push_back(0);
+    const unsigned int samp_sz0 = samp_sz;
     for (unsigned int pth_index = 0; pth_index != pth.size(); ++pth_index) {
       const unsigned int samp_sz4 = samp_sz * 4;
       const unsigned int un_index = samp_sz4 + 128;
       {
-        const unsigned int ui = pth[pth_index].second;
-        unwv.col(un_index) = (1.0f / (vEL * static_cast<float>(v_steps[ui].load(memory_order_relaxed)) + 1.0f)) * ctvecs.col(ui);
+        const ent_index ui = pth[pth_index].second;
+        unwv.col(un_index) = (1.0f / (vEL * static_cast<float>(v_steps[ui]) + 1.0f)) * cvecs.col(ui);
         unis[samp_sz] = ui;
       }
-      unsigned int choice = rnd(calcs.size());
+      const unsigned int choice = rnd(calcs.size());
+      choices.push_back(choice);
       inter_tvi[samp_sz] = calcs[choice];
-      for (unsigned int j = pth_index; j != choice; --j) {
-        MatrixXf m = mats[pth[j].first];
-        unwv.col(un_index) = sqrtf(DIM / m.squaredNorm()) * (m * unwv.col(un_index));
-
-        debug_print("unwv@%d: mi = %d\n", un_index, pth[j].first);
-      }{
-        MatrixXf m = mats[pth[pth_index].first];
-        twv.col(csz) = sqrtf(DIM / m.squaredNorm()) * (m.transpose() * twv.col(calcs.back()));
+      {
+        const auto& m = mats[pth[pth_index].first];
+        scal.push_back(sqrtf(DIM / m.squaredNorm()));
+        twv.col(csz).noalias() = scal.back() * (m.transpose() * twv.col(calcs.back()));
         calcs.push_back(csz);
         tdest[samp_sz] = csz++;
 
         debug_print("twv: mi = %d, src = %d, dest = %d\n", pth[pth_index].first, calcs.back(), csz - 1);
-      }{
+      }
+      if (!pooled) {
         const unsigned int calcs_choice1 = calcs[choice + 1];
         for (unsigned int k = 1; k != 4; ++k) {
           const unsigned int samp_sz_k32 = samp_sz + k * 32;
           vector<unsigned int> nmis(pth_index - choice); {
             const unsigned int un_index_k = un_index + k;
-            const unsigned int ni = rnd(ctvecs.cols() / 2);
-            unwv.col(un_index_k) = (1.0f / (vEL * static_cast<float>(v_steps[ni].load(memory_order_relaxed)) + 1.0f)) * ctvecs.col(ni);
+            const ent_index ni = rnd(cvecs.cols());
+            unwv.col(un_index_k) = (1.0f / (vEL * static_cast<float>(v_steps[ni]) + 1.0f)) * cvecs.col(ni);
             unis[samp_sz_k32] = ni;
             for (auto& x : nmis) {
               x = rnd(mats.size());
-              MatrixXf m = mats[x];
+              const auto& m = mats[x];
               unwv.col(un_index_k) = sqrtf(DIM / m.squaredNorm()) * (m * unwv.col(un_index_k));
 
               debug_print("unwv@%d: mi = %d\n", un_index_k, x);
@@ -139,13 +492,13 @@ void TrainerKB::update(RandomGenerator &rnd, unsigned int hi,
           } else {
             tdest[samp_sz_k32] = samp_sz_k32;
             auto rev = nmis.crbegin(); {
-              MatrixXf m = mats[*rev];
-              twv.col(samp_sz_k32) = sqrtf(DIM / m.squaredNorm()) * (m.transpose() * twv.col(calcs_choice1));
+              const auto& m = mats[*rev];
+              twv.col(samp_sz_k32).noalias() = sqrtf(DIM / m.squaredNorm()) * (m.transpose() * twv.col(calcs_choice1));
 
               debug_print("twv: mi = %d, src = %d, dest = %d\n", *rev, calcs_choice1, samp_sz_k32);
             }
             for (++rev; rev != nmis.crend(); ++rev) {
-              MatrixXf m = mats[*rev];
+              const auto& m = mats[*rev];
               twv.col(samp_sz_k32) = sqrtf(DIM / m.squaredNorm()) * (m.transpose() * twv.col(samp_sz_k32));
 
               debug_print("twv: mi = %d, src = %d, dest = %d\n", *rev, samp_sz_k32, samp_sz_k32);
@@ -155,24 +508,89 @@ void TrainerKB::update(RandomGenerator &rnd, unsigned int hi,
       }
       const unsigned int mi = pth[choice].first;
       inter_mi[samp_sz] = mi;
-      MatrixXf mat = mats[mi];
-      float nrm = sqrtf(mat.squaredNorm() / DIM);
-      inter_mnrm[samp_sz] = fminf(nrm / (mEL * static_cast<float>(m_steps[mi].load(memory_order_relaxed)) + 1.0f), 4.0f);
-      unwv.middleCols(samp_sz4, 4) = (1.0f / nrm) * (mat * unwv.middleCols(un_index, 4));
-
-      debug_print("unwv4-128@%d: mi = %d\n", samp_sz4, pth[choice].first);
+      inter_mnrm[samp_sz] = fminf(1.0f / scal[samp_sz0 + choice] / (mEL * static_cast<float>(m_steps[mi]) + 1.0f), 4.0f);
+      ++samp_sz;
+    }
+  }
 
-      while (choice-- != 0) {
-        MatrixXf m = mats[pth[choice].first];
-        unwv.middleCols(samp_sz4, 4) = sqrtf(DIM / m.squaredNorm()) * (m * unwv.middleCols(samp_sz4, 4));
+  MatrixXf dnegs;
+  if (pooled) addPool(b, s, twv, unwv, dnegs);
 
-        debug_print("unwv4@%d: mi = %d\n", samp_sz4, pth[choice].first);
+  /* the positive at position p goes through M_p ... M_0, and its negatives
+   * join it at M_choice; sweeping down the path, each M_j is applied once
+   * to a panel of all the vectors passing through it, instead of once per
+   * position and choice. */
+  vector<pair<unsigned int, unsigned int>> moves;
+  MatrixXf panel;
+  MatrixXf prod;
+  unsigned int samp_sz0 = 0;
+  for (unsigned int path_k = 0; path_k != b.paths; ++path_k) {
+    const BatchKB::Path pth = b.path(path_k);
+    for (unsigned int j = pth.size(); j-- != 0;) {
+      moves.clear();
+      for (unsigned int p = j; p != pth.size(); ++p) {
+        const unsigned int samp_sz4 = (samp_sz0 + p) * 4;
+        const unsigned int un_index = samp_sz4 + 128;
+        const unsigned int choice = choices[samp_sz0 + p];
+        if (choice < j) {
+          moves.emplace_back(un_index, un_index);
+          if (pooled) moves.emplace_back(un_index + 1, un_index + 1);
+        } else {
+          for (unsigned int l = 0; l != width; ++l) moves.emplace_back((choice == j ? un_index : samp_sz4) + l, samp_sz4 + l);
+        }
       }
-      ++samp_sz;
+      panel.resize(DIM, moves.size());
+      for (size_t k = 0; k != moves.size(); ++k) panel.col(k) = unwv.col(moves[k].first);
+      prod.noalias() = mats[pth[j].first] * panel;
+      for (size_t k = 0; k != moves.size(); ++k) unwv.col(moves[k].second) = scal[samp_sz0 + j] * prod.col(k);
+
+      debug_print("unwv: mi = %d, cols = %d\n", pth[j].first, static_cast<int>(moves.size()));
     }
+    samp_sz0 += pth.size();
   }
 
+  if (pooled) applyPoolGradients(rnd, b, s, twv, unwv, dnegs);
+  else applyGradients(rnd, hi, s, twv, unwv);
+}
+
+void TrainerKB::addPool(const BatchKB &b, const Samples &s, const Ref<const MatrixXf> &twv, Ref<MatrixXf> unwv,
+                        MatrixXf &dnegs) const {
+  const unsigned int samp_sz = s.samp_sz;
+  const unsigned int nsz = b.negs;
+  MatrixXf negs(DIM, nsz);
+  for (unsigned int n = 0; n != nsz; ++n) {
+    const ent_index ni = b.neg[n];
+    negs.col(n) = (1.0f / (vEL * static_cast<float>(v_steps[ni]) + 1.0f)) * cvecs.col(ni);
+  }
+  // each sample meets the pool at the end of its path, as a sampled
+  // negative with choice p does
+  MatrixXf qs(DIM, samp_sz);
+  for (unsigned int k = 0; k != samp_sz; ++k) qs.col(k) = twv.col(s.tdest[k]);
+
+  // all samples against all the pool, in one product
+  ArrayXXf dots = (qs.transpose() * negs).array() * 256.0f - 281.24475f;
+  ArrayXXf sigs = (dots.abs() + 0.5f).min(1536.0f);
+  for (unsigned int n = 0; n != nsz; ++n) {
+    for (unsigned int k = 0; k != samp_sz; ++k) sigs(k, n) = sigtab[static_cast<int>(sigs(k, n))];
+  }
+  // as the 3 negatives of a sample weigh, spread over the pool
+  sigs = (sigs * dots.sign() - 0.5f) * (3.0f / nsz);
+
+  const ArrayXf qscal = vEta * 8.0f / qs.colwise().norm().transpose().array().max(8.0f);
+  dnegs.noalias() = (qs * qscal.matrix().asDiagonal()) * sigs.matrix();
+
+  // the pull on each sample, to go down its path in slot 1
+  const ArrayXf nscal = 1.0f / negs.colwise().norm().transpose().array().max(8.0f);
+  const MatrixXf pull = negs * (sigs.matrix() * nscal.matrix().asDiagonal()).transpose();
+  for (unsigned int k = 0; k != samp_sz; ++k) unwv.col(k * 4 + 129) = pull.col(k);
+}
+
+void TrainerKB::applyGradients(RandomGenerator &rnd, ent_index hi, const Samples &s,
+                               const Ref<const MatrixXf> &twv, const Ref<const MatrixXf> &unwv) {
+  const unsigned int samp_sz = s.samp_sz;
+  const ent_index hvi = cvecs.cols() + hi;
   const unsigned int samp_sz4 = samp_sz * 4;
+  LocalSteps& steps = localSteps();
   ArrayXf dots = (unwv.leftCols(samp_sz4).transpose() * twv.col(0)).array() * 256.0f - 281.24475f;
   ArrayXf sigs = (dots.abs() + 0.5f).min(1536.0f);
   dots = dots.sign();
@@ -189,39 +607,218 @@ void TrainerKB::update(RandomGenerator &rnd, unsigned int hi,
   for (unsigned int k = 0; k != samp_sz; ++k) {
     for (unsigned int l = 0; l != 4; ++l) {
       const unsigned int idx = k + l * 32;
-      const unsigned int des = tdest[idx];
-      const unsigned int uni = unis[idx];
-      ctvecs.col(uni) += vEta * 8.0f / fmaxf(twv.col(des).norm(), 8.0f) * sigs(k * 4 + l) * twv.col(des);
-      v_steps[uni].fetch_add(1, memory_order_relaxed);
+      const unsigned int des = s.tdest[idx];
+      const ent_index uni = s.unis[idx];
+      addVector(rnd, steps, uni, vEta * 8.0f / fmaxf(twv.col(des).norm(), 8.0f) * sigs(k * 4 + l) * twv.col(des), 1);
 
       debug_print("t_norm[%d] = %e\n", idx, twv.col(des).squaredNorm());
-      debug_print("unv@%d += %s\n", uni, vec_string(vEta * 8.0f / fmaxf(twv.col(des).norm(), 8.0f) * sigs(k * 4 + l) * twv.col(des)).c_str());
+      debug_print("unv@%llu += %s\n", uni, vec_string(vEta * 8.0f / fmaxf(twv.col(des).norm(), 8.0f) * sigs(k * 4 + l) * twv.col(des)).c_str());
     }
   }
   ArrayXf un_norm = vEta * 8.0f * sigs / unwv.leftCols(samp_sz4).colwise().norm().transpose().array().max(8.0f);
-  ctvecs.col(hi) += unwv.leftCols(samp_sz4) * un_norm.matrix();
-  v_steps[hi].fetch_add(samp_sz4, memory_order_relaxed);
+  addVector(rnd, steps, hvi, unwv.leftCols(samp_sz4) * un_norm.matrix(), samp_sz4);
 
   debug_print("un_norm = %s\n", array_string(unwv.leftCols(samp_sz4).colwise().squaredNorm().array()).c_str());
-  debug_print("tv@%d += %s\n", hi, vec_string(unwv.leftCols(samp_sz4) * un_norm.matrix()).c_str());
+  debug_print("tv@%llu += %s\n", hi, vec_string(unwv.leftCols(samp_sz4) * un_norm.matrix()).c_str());
 
   for (unsigned int k = 0; k != samp_sz; ++k) {
-    const unsigned int mi = inter_mi[k];
-    const unsigned int tvi = inter_tvi[k];
-    mats[mi] += twv.col(tvi) * (unwv.middleCols(128 + k * 4, 4) *
-                                (mEta * 64.0 * inter_mnrm[k] / fmaxf(twv.col(tvi).norm(), 8.0f) * sigs.segment(k * 4, 4) /
-                                 unwv.middleCols(128 + k * 4, 4).colwise().norm().transpose().array().max(8.0f)).matrix()).transpose();
-    mincr_regularize(mi, rnd);
+    const unsigned int mi = s.inter_mi[k];
+    const unsigned int tvi = s.inter_tvi[k];
+    addMatrix(rnd, steps, mi, twv.col(tvi),
+              unwv.middleCols(128 + k * 4, 4) *
+              (mEta * 64.0 * s.inter_mnrm[k] / fmaxf(twv.col(tvi).norm(), 8.0f) * sigs.segment(k * 4, 4) /
+               unwv.middleCols(128 + k * 4, 4).colwise().norm().transpose().array().max(8.0f)).matrix());
 
     debug_print("inter_tnrm[%d] = %e\n", k, twv.col(tvi).squaredNorm());
     debug_print("un_norm[%d ~ %d] = %s\n", 128 + k * 4, 128 + k * 4 + 3, array_string(unwv.middleCols(128 + k * 4, 4).colwise().squaredNorm().transpose().array()).c_str());
-    debug_print("M@%d: tv = %s\n", inter_mi[k], vec_string(mEta * 8.0f * inter_mnrm[k] / fmaxf(twv.col(tvi).norm(), 8.0f) * twv.col(tvi)).c_str());
-    debug_print("M@%d: unv = %s\n", inter_mi[k], vec_string(unwv.middleCols(128 + k * 4, 4) * (8.0f * sigs.segment(k * 4, 4) / unwv.middleCols(128 + k * 4, 4).colwise().norm().transpose().array().max(8.0f)).matrix()).c_str());
+    debug_print("M@%d: tv = %s\n", s.inter_mi[k], vec_string(mEta * 8.0f * s.inter_mnrm[k] / fmaxf(twv.col(tvi).norm(), 8.0f) * twv.col(tvi)).c_str());
+    debug_print("M@%d: unv = %s\n", s.inter_mi[k], vec_string(unwv.middleCols(128 + k * 4, 4) * (8.0f * sigs.segment(k * 4, 4) / unwv.middleCols(128 + k * 4, 4).colwise().norm().transpose().array().max(8.0f)).matrix()).c_str());
   }
 
   debug_print("update\n");
 }
 
+void TrainerKB::applyPoolGradients(RandomGenerator &rnd, const BatchKB &b, const Samples &s,
+                                   const Ref<const MatrixXf> &twv, const Ref<const MatrixXf> &unwv,
+                                   const MatrixXf &dnegs) {
+  const ent_index hi = b.head;
+  const unsigned int samp_sz = s.samp_sz;
+  const ent_index hvi = cvecs.cols() + hi;
+  LocalSteps& steps = localSteps();
+  // the positives and the pulls of the pool, at depth 0
+  const OuterStride<> stride4(4 * unwv.outerStride());
+  Map<const MatrixXf, 0, OuterStride<>> poss(unwv.data(), DIM, samp_sz, stride4);
+  Map<const MatrixXf, 0, OuterStride<>> pulls(unwv.data() + unwv.outerStride(), DIM, samp_sz, stride4);
+  ArrayXf dots = (poss.transpose() * twv.col(0)).array() * 256.0f - 281.24475f;
+  ArrayXf sigs = (dots.abs() + 0.5f).min(1536.0f);
+  for (unsigned int k = 0; k != samp_sz; ++k) sigs(k) = sigtab[static_cast<int>(sigs(k))];
+  sigs = sigs * dots.sign() + 0.5f;
+
+  debug_print("sigs = %s\n", array_string(sigs).c_str());
+
+  for (unsigned int k = 0; k != samp_sz; ++k) {
+    const unsigned int des = s.tdest[k];
+    const ent_index uni = s.unis[k];
+    addVector(rnd, steps, uni, vEta * 8.0f / fmaxf(twv.col(des).norm(), 8.0f) * sigs(k) * twv.col(des), 1);
+  }
+  // the pool weighs as 3 negatives per sample
+  const unsigned int nsteps = (3 * samp_sz + b.negs - 1) / b.negs;
+  for (unsigned int n = 0; n != b.negs; ++n) addVector(rnd, steps, b.neg[n], dnegs.col(n), nsteps);
+  const ArrayXf un_norm = vEta * 8.0f * sigs / poss.colwise().norm().transpose().array().max(8.0f);
+  addVector(rnd, steps, hvi, poss * un_norm.matrix() + (vEta * 8.0f) * pulls.rowwise().sum(), samp_sz * 4);
+
+  for (unsigned int k = 0; k != samp_sz; ++k) {
+    const unsigned int mi = s.inter_mi[k];
+    const unsigned int tvi = s.inter_tvi[k];
+    const auto up = unwv.middleCols(128 + k * 4, 2);
+    const float tscal = mEta * 64.0f * s.inter_mnrm[k] / fmaxf(twv.col(tvi).norm(), 8.0f);
+    addMatrix(rnd, steps, mi, tscal * twv.col(tvi), sigs(k) / fmaxf(up.col(0).norm(), 8.0f) * up.col(0) + up.col(1));
+  }
+
+  debug_print("update\n");
+}
+
+void TrainerKB::updateBatch(RandomGenerator &rnd, const vector<const BatchKB*> &bs) {
+  for (const BatchKB* b : bs) {
+    if (b->negs != 0) {
+      for (const BatchKB* x : bs) update(rnd, *x);
+      return;
+    }
+  }
+
+  const unsigned int bsz = bs.size();
+  MatrixXf twv(DIM, 128 * bsz);
+  MatrixXf unwv(DIM, 256 * bsz);
+  vector<Samples> samples(bsz);
+
+  // a hop sets column dst of twv (t) or unwv to a matrix times column src
+  struct Hop {
+    unsigned int level;
+    unsigned int mi;
+    bool t;
+    unsigned int src;
+    unsigned int dst;
+  };
+  vector<Hop> hops;
+  vector<unsigned int> tlevel(128 * bsz, 0);
+  vector<unsigned int> ulevel(256 * bsz, 0);
+  unordered_map<unsigned int, float> scal; // sqrt(DIM / |M|^2), once per matrix
+  auto scale = [&](unsigned int mi) {
+    auto it = scal.find(mi);
+    if (it == scal.end()) it = scal.emplace(mi, sqrtf(DIM / mats[mi].squaredNorm())).first;
+    return it->second;
+  };
+  auto hop = [&](unsigned int mi, bool t, unsigned int src, unsigned int dst, unsigned int minLevel) {
+    vector<unsigned int>& level = t ? tlevel : ulevel;
+    level[dst] = max(level[src] + 1, minLevel);
+    scale(mi);
+    hops.push_back(Hop {level[dst], mi, t, src, dst});
+  };
+
+  // sample as update does, recording the hops instead of running them
+  for (unsigned int b = 0; b != bsz; ++b) {
+    Samples& s = samples[b];
+    const unsigned int tofs = b * 128;
+    const unsigned int uofs = b * 256;
+    const ent_index hvi = cvecs.cols() + bs[b]->head;
+    twv.col(tofs) = (1.0f / (vEL * static_cast<float>(v_steps[hvi]) + 1.0f)) * tvecs.col(bs[b]->head);
+    unsigned int csz = 1;
+
+    for (unsigned int path_k = 0; path_k != bs[b]->paths; ++path_k) {
+      const BatchKB::Path pth = bs[b]->path(path_k);
+      vector<unsigned int> calcs;
+      calcs.reserve(pth.size() + 1);
+      calcs.push_back(0);
+      const unsigned int samp_sz0 = s.samp_sz;
+      vector<unsigned int> choices;
+      for (unsigned int pth_index = 0; pth_index != pth.size(); ++pth_index) {
+        const unsigned int samp_sz = s.samp_sz;
+        const unsigned int samp_sz4 = samp_sz * 4;
+        const unsigned int un_index = samp_sz4 + 128;
+        {
+          const ent_index ui = pth[pth_index].second;
+          unwv.col(uofs + un_index) = (1.0f / (vEL * static_cast<float>(v_steps[ui]) + 1.0f)) * cvecs.col(ui);
+          s.unis[samp_sz] = ui;
+        }
+        const unsigned int choice = rnd(calcs.size());
+        choices.push_back(choice);
+        s.inter_tvi[samp_sz] = calcs[choice];
+        hop(pth[pth_index].first, true, tofs + calcs.back(), tofs + csz, 0);
+        calcs.push_back(csz);
+        s.tdest[samp_sz] = csz++;
+
+        const unsigned int calcs_choice1 = calcs[choice + 1];
+        for (unsigned int k = 1; k != 4; ++k) {
+          const unsigned int samp_sz_k32 = samp_sz + k * 32;
+          const unsigned int un_index_k = uofs + un_index + k;
+          vector<unsigned int> nmis(pth_index - choice);
+          const ent_index ni = rnd(cvecs.cols());
+          unwv.col(un_index_k) = (1.0f / (vEL * static_cast<float>(v_steps[ni]) + 1.0f)) * cvecs.col(ni);
+          s.unis[samp_sz_k32] = ni;
+          for (auto& x : nmis) {
+            x = rnd(mats.size());
+            hop(x, false, un_index_k, un_index_k, 0);
+          }
+          if (nmis.empty()) {
+            s.tdest[samp_sz_k32] = calcs_choice1;
+          } else {
+            s.tdest[samp_sz_k32] = samp_sz_k32;
+            auto rev = nmis.crbegin();
+            hop(*rev, true, tofs + calcs_choice1, tofs + samp_sz_k32, 0);
+            for (++rev; rev != nmis.crend(); ++rev) hop(*rev, true, tofs + samp_sz_k32, tofs + samp_sz_k32, 0);
+          }
+        }
+
+        const unsigned int mi = pth[choice].first;
+        s.inter_mi[samp_sz] = mi;
+        const float nrm = 1.0f / scale(mi);
+        s.inter_mnrm[samp_sz] = fminf(nrm / (mEL * static_cast<float>(m_steps[mi]) + 1.0f), 4.0f);
+        ++s.samp_sz;
+      }
+      // the path sweep of update; M_j of the path goes to level size - j
+      for (unsigned int j = pth.size(); j-- != 0;) {
+        const unsigned int lv = pth.size() - j;
+        for (unsigned int p = j; p != pth.size(); ++p) {
+          const unsigned int samp_sz4 = uofs + (samp_sz0 + p) * 4;
+          const unsigned int un_index = samp_sz4 + 128;
+          if (choices[p] < j) hop(pth[j].first, false, un_index, un_index, lv);
+          else for (unsigned int l = 0; l != 4; ++l) hop(pth[j].first, false, (choices[p] == j ? un_index : samp_sz4) + l, samp_sz4 + l, lv);
+        }
+      }
+    }
+  }
+
+  /* a hop only reads columns whose hops are at lower levels, so the hops of
+   * a level are independent, and those with the same matrix form one
+   * matrix-panel product. */
+  sort(hops.begin(), hops.end(), [](const Hop& x, const Hop& y) {
+    if (x.level != y.level) return x.level < y.level;
+    if (x.t != y.t) return x.t < y.t;
+    return x.mi < y.mi;
+  });
+  MatrixXf panel;
+  MatrixXf prod;
+  for (size_t i = 0; i != hops.size();) {
+    const Hop& h = hops[i];
+    size_t e = i + 1;
+    while (e != hops.size() && hops[e].level == h.level && hops[e].t == h.t && hops[e].mi == h.mi) ++e;
+    MatrixXf& wv = h.t ? twv : unwv;
+    panel.resize(DIM, e - i);
+    for (size_t k = i; k != e; ++k) panel.col(k - i) = wv.col(hops[k].src);
+    if (h.t) prod.noalias() = mats[h.mi].transpose() * panel;
+    else prod.noalias() = mats[h.mi] * panel;
+    const float sc = scal[h.mi];
+    for (size_t k = i; k != e; ++k) wv.col(hops[k].dst) = sc * prod.col(k - i);
+
+    debug_print("hops: level = %d, mi = %d, t = %d, n = %d\n", h.level, h.mi, h.t, static_cast<int>(e - i));
+    i = e;
+  }
+
+  for (unsigned int b = 0; b != bsz; ++b) {
+    applyGradients(rnd, bs[b]->head, samples[b], twv.middleCols(b * 128, 128), unwv.middleCols(b * 256, 256));
+  }
+}
+
 static string denc_string(const Ref<const MatrixXf>& m) {
   string ret;
   for (unsigned int l = 0; l != 4; ++l) {
@@ -234,10 +831,13 @@ static string denc_string(const Ref<const MatrixXf>& m) {
 }
 
 void TrainerKB::mincr_regularize(unsigned int mi, RandomGenerator& rnd) {
-  const unsigned long long mstep = m_steps[mi].fetch_add(1, memory_order_relaxed) + 1;
+  LocalSteps& steps = localSteps();
+  steps.m.add(mi, 1);
+  const unsigned long long mstep = m_steps[mi] + 1;
   float mscal = 1.0f / (mEL * static_cast<float>(mstep) + 1.0f);
   if (!disableAutoencoder && rnd.nextDouble() * autoSkip < 1.0) {
-    const unsigned long long dstep = denc_step.fetch_add(1, memory_order_relaxed);
+    steps.d.add(0, 1);
+    const unsigned long long dstep = denc_step[0];
     const float denc_scal = 1.0f / (autoEL * static_cast<float>(dstep) + 1.0f);
 
     const unsigned int ni1 = rnd(mats.size());
@@ -302,161 +902,570 @@ void TrainerKB::mincr_regularize(unsigned int mi, RandomGenerator& rnd) {
   }
 }
 
+// step counters are read and written in blocks instead of one by one
+static constexpr size_t STEPS_BLOCK = 1 << 16;
+
+static void write_steps(ostream& out, const StepCounters& steps, size_t n) {
+  vector<unsigned long long> buf(min(n, STEPS_BLOCK));
+  for (size_t i = 0; i < n; i += STEPS_BLOCK) {
+    const size_t sz = min(n - i, STEPS_BLOCK);
+    for (size_t j = 0; j != sz; ++j) buf[j] = steps[i + j];
+    out.write(reinterpret_cast<const char *>(buf.data()), sz * sizeof(unsigned long long));
+  }
+}
+
+/* reads n counters; the i-th goes to steps[i] if i < split, otherwise to
+ * steps[i - split + ofs]. */
+static void read_steps(istream& in, StepCounters& steps, size_t n, size_t split, size_t ofs) {
+  vector<unsigned long long> buf(min(n, STEPS_BLOCK));
+  for (size_t i = 0; i < n; i += STEPS_BLOCK) {
+    const size_t sz = min(n - i, STEPS_BLOCK);
+    in.read(reinterpret_cast<char *>(buf.data()), sz * sizeof(unsigned long long));
+    for (size_t j = 0; j != sz; ++j) steps.set(i + j < split? i + j : i + j - split + ofs, buf[j]);
+  }
+}
+
+// remove first, so that a model mapped from the same path stays valid
+static void open_out(ofstream& out, const string& fn) {
+  remove(fn.c_str());
+  out.open(fn, ios::binary);
+  if (!out) throw runtime_error("cannot create " + fn);
+}
+
+static void close_out(ofstream& out, const string& fn) {
+  out.close();
+  if (!out) throw runtime_error("cannot write " + fn);
+}
+
 void TrainerKB::saveModel(const string &outPath) {
+  flushSteps();
+  removeDeltas(outPath);
+  if (single_file) {
+    saveModelFile(outPath + "model.glm");
+    return;
+  }
   const void *data;
-  union {
-    unsigned long long l;
-    char c[sizeof(unsigned long long)];
-  } ulc;
   {
-    const unsigned int wsz2 = ctvecs.cols();
-    const unsigned int wsz = wsz2 / 2;
+    const ent_index wsz = cvecs.cols();
     const string vecs_header = createNpyHeader<float>(false, {wsz, DIM});
 
-    ofstream out_cvecs(outPath + "cvecs.npy");
+    ofstream out_cvecs;
+    open_out(out_cvecs, outPath + "cvecs.npy");
     out_cvecs << vecs_header;
-    data = ctvecs.data();
+    data = cvecs.data();
     out_cvecs.write(static_cast<const char *>(data), DIM * wsz * sizeof(float));
-    out_cvecs.close();
-    ofstream out_tvecs(outPath + "tvecs.npy");
+    close_out(out_cvecs, outPath + "cvecs.npy");
+    ofstream out_tvecs;
+    open_out(out_tvecs, outPath + "tvecs.npy");
     out_tvecs << vecs_header;
-    data = ctvecs.data() + DIM * wsz;
+    data = tvecs.data();
     out_tvecs.write(static_cast<const char *>(data), DIM * wsz * sizeof(float));
-    out_tvecs.close();
-    ofstream out_vsteps(outPath + "vsteps.npy");
-    out_vsteps << createNpyHeader<unsigned long long>(false, {wsz2});
-    for (unsigned int i = 0; i != wsz2; ++i) {
-      ulc.l = v_steps[i];
-      out_vsteps.write(ulc.c, sizeof(unsigned long long));
-    }
-    out_vsteps.close();
+    close_out(out_tvecs, outPath + "tvecs.npy");
+    ofstream out_vsteps;
+    open_out(out_vsteps, outPath + "vsteps.npy");
+    out_vsteps << createNpyHeader<unsigned long long>(false, {wsz * 2});
+    write_steps(out_vsteps, v_steps, wsz * 2);
+    close_out(out_vsteps, outPath + "vsteps.npy");
   }{
     const unsigned int rsz2 = mats.size();
 
-    ofstream out_mats(outPath + "mats.npy");
-    out_mats << createNpyHeader<float>(false, {rsz2, DIM, DIM});;
-    for (const auto& m : mats) {
-      data = m.data();
-      out_mats.write(static_cast<const char *>(data), DIM * DIM * sizeof(float));
-    }
-    out_mats.close();
+    ofstream out_mats;
+    open_out(out_mats, outPath + "mats.npy");
+    out_mats << createNpyHeader<float>(false, {rsz2, DIM, DIM});
+    data = mstore.data();
+    out_mats.write(static_cast<const char *>(data), DIM * DIM * rsz2 * sizeof(float));
+    close_out(out_mats, outPath + "mats.npy");
 
-    ofstream out_msteps(outPath + "msteps.npy");
+    ofstream out_msteps;
+    open_out(out_msteps, outPath + "msteps.npy");
     out_msteps << createNpyHeader<unsigned long long>(false, {rsz2});
-    for (unsigned int i = 0; i != rsz2; ++i) {
-      ulc.l = m_steps[i];
-      out_msteps.write(ulc.c, sizeof(unsigned long long));
-    }
-    out_msteps.close();
+    write_steps(out_msteps, m_steps, rsz2);
+    close_out(out_msteps, outPath + "msteps.npy");
   }
   string denc_header = createNpyHeader<float>(false, {CODE_LEN, DIM, DIM});
-  ofstream out_encoder(outPath + "encoder.npy");
+  ofstream out_encoder;
+  open_out(out_encoder, outPath + "encoder.npy");
   out_encoder << denc_header;
   data = encoder.data();
   out_encoder.write(static_cast<const char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
-  out_encoder.close();
-  ofstream out_decoder(outPath + "decoder.npy");
+  close_out(out_encoder, outPath + "encoder.npy");
+  ofstream out_decoder;
+  open_out(out_decoder, outPath + "decoder.npy");
   out_decoder << denc_header;
   data = decoder.data();
   out_decoder.write(static_cast<const char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
-  out_decoder.close();
-  ofstream out_dstep(outPath + "dstep.npy");
+  close_out(out_decoder, outPath + "decoder.npy");
+  ofstream out_dstep;
+  open_out(out_dstep, outPath + "dstep.npy");
   out_dstep << createNpyHeader<unsigned long long>(false, {});
-  ulc.l = denc_step;
-  out_dstep.write(ulc.c, sizeof(unsigned long long));
-  out_dstep.close();
+  write_steps(out_dstep, denc_step, 1);
+  close_out(out_dstep, outPath + "dstep.npy");
+  if (vocab_hashes.size() == static_cast<size_t>(cvecs.cols()) + mats.size() / 2) {
+    ofstream out_vocab;
+    open_out(out_vocab, outPath + "vocab.npy");
+    out_vocab << createNpyHeader<unsigned long long>(false, {vocab_hashes.size()});
+    out_vocab.write(reinterpret_cast<const char *>(vocab_hashes.data()), vocab_hashes.size() * sizeof(unsigned long long));
+    close_out(out_vocab, outPath + "vocab.npy");
+  } else
+    remove((outPath + "vocab.npy").c_str());
 
   debug_print("saveModel Done.\n");
 }
 
-void TrainerKB::loadModel(unsigned int wsz, unsigned int rsz, const string &inPath) {
+// FNV-1a
+static unsigned long long name_hash(const string& s) {
+  unsigned long long h = 0xcbf29ce484222325ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+void TrainerKB::setVocab(const vector<string> &entities, const vector<string> &relations) {
+  vocab_hashes.clear();
+  vocab_hashes.reserve(entities.size() + relations.size());
+  for (const auto& x : entities) vocab_hashes.push_back(name_hash(x));
+  for (const auto& x : relations) vocab_hashes.push_back(name_hash(x));
+}
+
+void TrainerKB::bindModel(ent_index wsz, unsigned int rsz) {
+  new (&cvecs) Map<MatrixXf>(cstore.data(), DIM, wsz);
+  new (&tvecs) Map<MatrixXf>(tstore.data(), DIM, wsz);
+  mats.clear();
+  mats.reserve(rsz * 2);
+  for (unsigned int i = 0; i != rsz * 2; ++i) mats.emplace_back(mstore.data() + DIM * DIM * i, DIM, DIM);
+  new (&encoder) Map<MatrixXf>(estore.data(), DIM * DIM, CODE_LEN);
+  new (&decoder) Map<MatrixXf>(dstore.data(), DIM * DIM, CODE_LEN);
+}
+
+void TrainerKB::allocModel(ent_index wsz, unsigned int rsz) {
+  const ent_index wsz2 = wsz * 2;
+  const unsigned int rsz2 = rsz * 2;
+  if (vecs_prefix.empty()) {
+    cstore.allocate(DIM * wsz);
+    tstore.allocate(DIM * wsz);
+  } else {
+    cstore.mapFile(vecs_prefix + "cvecs", DIM * wsz);
+    tstore.mapFile(vecs_prefix + "tvecs", DIM * wsz);
+  }
+  mstore.allocate(DIM * DIM * rsz2);
+  estore.allocate(DIM * DIM * CODE_LEN);
+  dstore.allocate(DIM * DIM * CODE_LEN);
+  bindModel(wsz, rsz);
+
+  placeVecs(wsz);
+  if (hot_rows != 0) {
+    const ent_index hot = min(hot_rows, wsz);
+    if (!cstore.lock(0, DIM * hot) || !tstore.lock(0, DIM * hot))
+      cerr << "failed to lock hot rows in RAM" << endl;
+  }
+  placeMats();
+  place(encoder.data(), encoder.size(), nullptr);
+  place(decoder.data(), decoder.size(), nullptr);
+
+  resetSteps();
+  v_steps.allocate(wsz2, compact_steps);
+  m_steps.allocate(rsz2, false);
+  denc_step.allocate(1, false);
+}
+
+void TrainerKB::saveModelFile(const string &fn) {
+  flushSteps();
+  const ent_index wsz = cvecs.cols();
+  const unsigned int rsz2 = mats.size();
+  const StepCounters* vs = &v_steps;
+  const StepCounters* ms = &m_steps;
+  const StepCounters* ds = &denc_step;
+  auto steps = [](const StepCounters* steps) {
+    return [=](char* dst, size_t ofs, size_t n) {
+      auto p = reinterpret_cast<unsigned long long*>(dst);
+      for (size_t i = 0; i != n / sizeof(unsigned long long); ++i)
+        p[i] = (*steps)[ofs / sizeof(unsigned long long) + i];
+    };
+  };
+  const string params = paramsJson();
+  const string fdtype = numpy_dtype<float>();
+  const string udtype = numpy_dtype<unsigned long long>();
+
+  ModelFileWriter out(fn);
+  out.add("params", "|u1", 1, {params.size()}, params.data());
+  out.add("cvecs", fdtype, sizeof(float), {wsz, DIM}, cvecs.data());
+  out.add("tvecs", fdtype, sizeof(float), {wsz, DIM}, tvecs.data());
+  out.add("vsteps", udtype, sizeof(unsigned long long), {wsz * 2}, steps(vs));
+  out.add("mats", fdtype, sizeof(float), {rsz2, DIM, DIM}, mstore.data());
+  out.add("msteps", udtype, sizeof(unsigned long long), {rsz2}, steps(ms));
+  out.add("encoder", fdtype, sizeof(float), {CODE_LEN, DIM, DIM}, encoder.data());
+  out.add("decoder", fdtype, sizeof(float), {CODE_LEN, DIM, DIM}, decoder.data());
+  out.add("dstep", udtype, sizeof(unsigned long long), {}, steps(ds));
+  if (vocab_hashes.size() == wsz + rsz2 / 2)
+    out.add("vocab", udtype, sizeof(unsigned long long), {vocab_hashes.size()}, vocab_hashes.data());
+  out.write();
+
+  debug_print("saveModelFile Done.\n");
+}
+
+string TrainerKB::deltaFile(const string &prefix, unsigned int seq) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%06u", seq);
+  return prefix + "delta_" + buf + ".glm";
+}
+
+/* counters are read before the rows they count are copied; as update()
+ * writes a row before bumping its counter, a row changed during a save is
+ * saved again by the next delta. */
+void TrainerKB::markSaved() {
+  flushSteps();
+  const ent_index wsz2 = cvecs.cols() * 2;
+  const unsigned int rsz2 = mats.size();
+  saved_vsteps.allocate(wsz2, compact_steps);
+  for (ent_index i = 0; i != wsz2; ++i) saved_vsteps.set(i, v_steps[i]);
+  saved_msteps.allocate(rsz2, false);
+  for (unsigned int i = 0; i != rsz2; ++i) saved_msteps.set(i, m_steps[i]);
+  saved_dstep = denc_step[0];
+  delta_seq = 0;
+}
+
+// no base until saveBase: the counters are not copied for runs without deltas
+void TrainerKB::dropSaved() {
+  saved_vsteps.allocate(0, false);
+  saved_msteps.allocate(0, false);
+  saved_dstep = 0;
+  delta_seq = 0;
+}
+
+void TrainerKB::saveBase(const string &prefix) {
+  markSaved();
+  saveModel(prefix);
+}
+
+void TrainerKB::removeDeltas(const string &prefix) {
+  for (unsigned int k = 1; remove(deltaFile(prefix, k).c_str()) == 0; ++k);
+}
+
+// fills with rows idx[0], idx[1], ... of width row taken from p
+static ModelFileWriter::Fill gather(const float* p, size_t row, const vector<ent_index>& idx) {
+  return [=, &idx](char* dst, size_t ofs, size_t n) {
+    const size_t rb = row * sizeof(float);
+    while (n != 0) {
+      const size_t r = ofs / rb, o = ofs % rb, m = min(n, rb - o);
+      memcpy(dst, reinterpret_cast<const char*>(p + idx[r] * row) + o, m);
+      dst += m;
+      ofs += m;
+      n -= m;
+    }
+  };
+}
+
+size_t TrainerKB::saveDelta(const string &prefix) {
+  const ent_index wsz = cvecs.cols();
+  const unsigned int rsz2 = mats.size();
+  if (saved_msteps.size() != rsz2) throw logic_error("no base to save a delta to " + prefix + "; saveBase first");
+  flushSteps();
+  vector<ent_index> vidx, crows, trows, midx;
+  vector<unsigned long long> vvals, mvals;
+  for (ent_index i = 0; i != wsz * 2; ++i) {
+    const unsigned long long step = v_steps[i];
+    if (step == saved_vsteps[i]) continue;
+    vidx.push_back(i);
+    vvals.push_back(step);
+    if (i < wsz) crows.push_back(i);
+    else trows.push_back(i - wsz);
+  }
+  for (unsigned int i = 0; i != rsz2; ++i) {
+    const unsigned long long step = m_steps[i];
+    if (step == saved_msteps[i]) continue;
+    midx.push_back(i);
+    mvals.push_back(step);
+  }
+  const unsigned long long dstep = denc_step[0];
+  const bool denc_changed = dstep != saved_dstep;
+
+  const string fdtype = numpy_dtype<float>();
+  const string udtype = numpy_dtype<unsigned long long>();
+  const unsigned long long sizes[2] = {wsz, rsz2};
+  const size_t fsz = sizeof(float);
+  const size_t usz = sizeof(unsigned long long);
+
+  ModelFileWriter out(deltaFile(prefix, delta_seq + 1));
+  out.add("sizes", udtype, usz, {2}, sizes);
+  out.add("vidx", udtype, usz, {vidx.size()}, vidx.data());
+  out.add("vsteps", udtype, usz, {vvals.size()}, vvals.data());
+  out.add("cvecs", fdtype, fsz, {crows.size(), DIM}, gather(cvecs.data(), DIM, crows));
+  out.add("tvecs", fdtype, fsz, {trows.size(), DIM}, gather(tvecs.data(), DIM, trows));
+  out.add("midx", udtype, usz, {midx.size()}, midx.data());
+  out.add("msteps", udtype, usz, {mvals.size()}, mvals.data());
+  out.add("mats", fdtype, fsz, {midx.size(), DIM, DIM}, gather(mstore.data(), DIM * DIM, midx));
+  if (denc_changed) {
+    out.add("encoder", fdtype, fsz, {CODE_LEN, DIM, DIM}, encoder.data());
+    out.add("decoder", fdtype, fsz, {CODE_LEN, DIM, DIM}, decoder.data());
+    out.add("dstep", udtype, usz, {}, &dstep);
+  }
+  out.write();
+  // only once written, so that a failed delta is saved again by the next
+  for (size_t k = 0; k != vidx.size(); ++k) saved_vsteps.set(vidx[k], vvals[k]);
+  for (size_t k = 0; k != midx.size(); ++k) saved_msteps.set(midx[k], mvals[k]);
+  saved_dstep = dstep;
+  ++delta_seq;
+
+  debug_print("saveDelta Done: %zu vectors, %zu matrices.\n", vidx.size(), midx.size());
+  return (vidx.size() * DIM + midx.size() * DIM * DIM + (denc_changed? 2 * DIM * DIM * CODE_LEN : 0)) * fsz;
+}
+
+void TrainerKB::applyDelta(const string &fn) {
+  ModelFile mf(fn);
+  mf.verify();
+  const ent_index wsz = cvecs.cols();
+  const unsigned int rsz2 = mats.size();
+  const string fdtype = numpy_dtype<float>();
+  const string udtype = numpy_dtype<unsigned long long>();
+
+  auto sizes = reinterpret_cast<const unsigned long long*>(mf.data(mf.check("sizes", udtype, {2})));
+  if (sizes[0] != wsz || sizes[1] != rsz2) throw runtime_error(fn + " is a delta of a model of another size");
+
+  const ent_index nv = mf.entry("vidx").shape.at(0);
+  auto vidx = reinterpret_cast<const ent_index*>(mf.data(mf.check("vidx", udtype, {nv})));
+  auto vvals = reinterpret_cast<const unsigned long long*>(mf.data(mf.check("vsteps", udtype, {nv})));
+  const ent_index nc = static_cast<ent_index>(lower_bound(vidx, vidx + nv, wsz) - vidx);
+  auto crows = reinterpret_cast<const float*>(mf.data(mf.check("cvecs", fdtype, {nc, DIM})));
+  auto trows = reinterpret_cast<const float*>(mf.data(mf.check("tvecs", fdtype, {nv - nc, DIM})));
+  for (ent_index k = 0; k != nv; ++k) {
+    const ent_index i = vidx[k];
+    if (i >= wsz * 2) throw runtime_error("bad entity index in " + fn);
+    v_steps.set(i, vvals[k]);
+    if (k < nc) cvecs.col(i) = Map<const VectorXf>(crows + k * DIM, DIM);
+    else tvecs.col(i - wsz) = Map<const VectorXf>(trows + (k - nc) * DIM, DIM);
+  }
+
+  const ent_index nm = mf.entry("midx").shape.at(0);
+  auto midx = reinterpret_cast<const ent_index*>(mf.data(mf.check("midx", udtype, {nm})));
+  auto mvals = reinterpret_cast<const unsigned long long*>(mf.data(mf.check("msteps", udtype, {nm})));
+  auto mrows = reinterpret_cast<const float*>(mf.data(mf.check("mats", fdtype, {nm, DIM, DIM})));
+  for (ent_index k = 0; k != nm; ++k) {
+    if (midx[k] >= rsz2) throw runtime_error("bad relation index in " + fn);
+    m_steps.set(midx[k], mvals[k]);
+    mats[midx[k]] = Map<const MatrixXf>(mrows + k * DIM * DIM, DIM, DIM);
+  }
+
+  if (mf.has("dstep")) {
+    encoder = Map<const MatrixXf>(reinterpret_cast<const float*>(mf.data(mf.check("encoder", fdtype, {CODE_LEN, DIM, DIM}))), DIM * DIM, CODE_LEN);
+    decoder = Map<const MatrixXf>(reinterpret_cast<const float*>(mf.data(mf.check("decoder", fdtype, {CODE_LEN, DIM, DIM}))), DIM * DIM, CODE_LEN);
+    denc_step.set(0, *reinterpret_cast<const unsigned long long*>(mf.data(mf.check("dstep", udtype, {}))));
+  }
+}
+
+/* applies the deltas saved under prefix after the base model, in order, and
+ * continues their numbering. */
+void TrainerKB::replayDeltas(const string &prefix) {
+  unsigned int k = 1;
+  for (; ModelFile::isModelFile(deltaFile(prefix, k)); ++k) applyDelta(deltaFile(prefix, k));
+  if (k == 1) {
+    dropSaved();
+    return;
+  }
+  markSaved();
+  delta_seq = k - 1;
+}
+
+// the model file at path itself, or path + "model.glm"; empty if neither
+static string model_file(const string& path) {
+  if (ModelFile::isModelFile(path)) return path;
+  if (ModelFile::isModelFile(path + "model.glm")) return path + "model.glm";
+  return string();
+}
+
+/* opens array name of a saved model, from the model file mf if given and
+ * otherwise from the npy file under inPath, checking dtype and shape. */
+template <typename T>
+static unique_ptr<istream> open_array(const string& inPath, const ModelFile* mf, const string& name,
+                                      initializer_list<unsigned long long> ds) {
+  if (mf) return mf->open(mf->check(name, numpy_dtype<T>(), ds));
+  unique_ptr<istream> in(new ifstream(inPath + name + ".npy", ios::binary));
+  if (!*in) throw runtime_error("cannot open " + inPath + name + ".npy");
+  checkNpyHeader<T>(*in, ds, inPath + name + ".npy");
+  return in;
+}
+
+/* reads a saved model of wsz entities and rsz relations into the allocated
+ * arrays, which may be larger; the inverse relations and the tvecs are
+ * moved to the second halves of the new sizes. */
+void TrainerKB::readModel(ent_index wsz, unsigned int rsz, const string &inPath) {
+  unique_ptr<ModelFile> mf;
+  const string fn = model_file(inPath);
+  if (!fn.empty()) {
+    mf = unique_ptr<ModelFile>(new ModelFile(fn));
+    mf->verify();
+  }
   void* data;
-  union {
-    char c[sizeof(unsigned long long)];
-    unsigned long long l;
-  } ucl;
   {
-    const unsigned int wsz2 = wsz * 2;
-    ctvecs.resize(DIM, wsz2);
-    ifstream in_cvecs(inPath + "cvecs.npy");
-    checkNpyHeader<float>(in_cvecs, {wsz, DIM});
-    data = ctvecs.data();
-    in_cvecs.read(static_cast<char *>(data), DIM * wsz * sizeof(float));
-    in_cvecs.close();
-    ifstream in_tvecs(inPath + "tvecs.npy");
-    checkNpyHeader<float>(in_tvecs, {wsz, DIM});
-    data = ctvecs.data() + DIM * wsz;
-    in_tvecs.read(static_cast<char *>(data), DIM * wsz * sizeof(float));
-    in_tvecs.close();
-
-    v_steps = unique_ptr<atomic_ullong[]>(new atomic_ullong[wsz2]);
-    ifstream in_vsteps(inPath + "vsteps.npy");
-    checkNpyHeader<unsigned long long>(in_vsteps, {wsz2});
-    for (unsigned int i = 0; i != wsz2; ++i) {
-      in_vsteps.read(ucl.c, sizeof(unsigned long long));
-      v_steps[i] = ucl.l;
-    }
-    in_vsteps.close();
+    const ent_index wsz2 = wsz * 2;
+    auto in_cvecs = open_array<float>(inPath, mf.get(), "cvecs", {wsz, DIM});
+    data = cvecs.data();
+    in_cvecs->read(static_cast<char *>(data), DIM * wsz * sizeof(float));
+    auto in_tvecs = open_array<float>(inPath, mf.get(), "tvecs", {wsz, DIM});
+    data = tvecs.data();
+    in_tvecs->read(static_cast<char *>(data), DIM * wsz * sizeof(float));
+
+    auto in_vsteps = open_array<unsigned long long>(inPath, mf.get(), "vsteps", {wsz2});
+    read_steps(*in_vsteps, v_steps, wsz2, wsz, cvecs.cols());
   }{
     const unsigned int rsz2 = rsz * 2;
-    mats.resize(rsz2);
-
-    ifstream in_mats(inPath + "mats.npy");
-    checkNpyHeader<float>(in_mats, {rsz2, DIM, DIM});
-    for (auto& m : mats) {
-      m.resize(DIM, DIM);
-      data = m.data();
-      in_mats.read(static_cast<char *>(data), DIM * DIM * sizeof(float));
-    }
-    in_mats.close();
+    const unsigned int iofs = mats.size() / 2;
 
-    ifstream in_msteps(inPath + "msteps.npy");
-    m_steps = unique_ptr<atomic_ullong[]>(new atomic_ullong[rsz2]);
-    checkNpyHeader<unsigned long long>(in_msteps, {rsz2});
+    auto in_mats = open_array<float>(inPath, mf.get(), "mats", {rsz2, DIM, DIM});
     for (unsigned int i = 0; i != rsz2; ++i) {
-      in_msteps.read(ucl.c, sizeof(unsigned long long));
-      m_steps[i] = ucl.l;
+      data = mats[i < rsz? i : i - rsz + iofs].data();
+      in_mats->read(static_cast<char *>(data), DIM * DIM * sizeof(float));
     }
-    in_msteps.close();
+
+    auto in_msteps = open_array<unsigned long long>(inPath, mf.get(), "msteps", {rsz2});
+    read_steps(*in_msteps, m_steps, rsz2, rsz, iofs);
   }
-  encoder.resize(DIM * DIM, CODE_LEN);
-  ifstream in_encoder(inPath + "encoder.npy");
-  checkNpyHeader<float>(in_encoder, {CODE_LEN, DIM, DIM});
+  auto in_encoder = open_array<float>(inPath, mf.get(), "encoder", {CODE_LEN, DIM, DIM});
   data = encoder.data();
-  in_encoder.read(static_cast<char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
-  in_encoder.close();
-  decoder.resize(DIM * DIM, CODE_LEN);
-  ifstream in_decoder(inPath + "decoder.npy");
-  checkNpyHeader<float>(in_decoder, {CODE_LEN, DIM, DIM});
+  in_encoder->read(static_cast<char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
+  auto in_decoder = open_array<float>(inPath, mf.get(), "decoder", {CODE_LEN, DIM, DIM});
   data = decoder.data();
-  in_decoder.read(static_cast<char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
-  in_decoder.close();
-  ifstream in_dstep(inPath + "dstep.npy");
-  checkNpyHeader<unsigned long long>(in_dstep, {});
-  in_dstep.read(ucl.c, sizeof(unsigned long long));
-  denc_step = ucl.l;
-  in_dstep.close();
+  in_decoder->read(static_cast<char *>(data), DIM * DIM * CODE_LEN * sizeof(float));
+  auto in_dstep = open_array<unsigned long long>(inPath, mf.get(), "dstep", {});
+  read_steps(*in_dstep, denc_step, 1, 1, 0);
+}
+
+void TrainerKB::loadModel(ent_index wsz, unsigned int rsz, const string &inPath) {
+  allocModel(wsz, rsz);
+  readModel(wsz, rsz, inPath);
+  if (!ModelFile::isModelFile(inPath)) replayDeltas(inPath);
+  else dropSaved();
 
   debug_print("loadModel Done.\n");
 }
 
-void TrainerKB::initModel(unsigned int wsz, unsigned int rsz, RandomGenerator &rg) {
-  debug_print("wsz: %d, rsz: %d\n", wsz, rsz);
+static void map_npy(Storage& st, const string& fn, initializer_list<unsigned long long> ds) {
+  ifstream in(fn, ios::binary);
+  if (!in) throw runtime_error("cannot open " + fn);
+  checkNpyHeader<float>(in, ds, fn);
+  const size_t ofs = static_cast<size_t>(in.tellg());
+  in.close();
+  size_t n = 1;
+  for (auto d : ds) n *= d;
+  st.mapPrivate(fn, ofs, n);
+}
+
+static void view_array(Storage& st, const ModelFile& mf, const string& name, initializer_list<unsigned long long> ds) {
+  const auto& e = mf.check(name, numpy_dtype<float>(), ds);
+  st.view(reinterpret_cast<float*>(mf.data(e)), e.bytes / sizeof(float));
+}
+
+void TrainerKB::mapModel(ent_index wsz, unsigned int rsz, const string &inPath) {
+  const ent_index wsz2 = wsz * 2;
+  const unsigned int rsz2 = rsz * 2;
+  const string fn = model_file(inPath);
+  if (!fn.empty()) {
+    // one mapping of the whole file; checksums are not verified here, as
+    // that would read every page
+    mfile = unique_ptr<ModelFile>(new ModelFile(fn));
+    view_array(cstore, *mfile, "cvecs", {wsz, DIM});
+    view_array(tstore, *mfile, "tvecs", {wsz, DIM});
+    view_array(mstore, *mfile, "mats", {rsz2, DIM, DIM});
+    view_array(estore, *mfile, "encoder", {CODE_LEN, DIM, DIM});
+    view_array(dstore, *mfile, "decoder", {CODE_LEN, DIM, DIM});
+  } else {
+    map_npy(cstore, inPath + "cvecs.npy", {wsz, DIM});
+    map_npy(tstore, inPath + "tvecs.npy", {wsz, DIM});
+    map_npy(mstore, inPath + "mats.npy", {rsz2, DIM, DIM});
+    map_npy(estore, inPath + "encoder.npy", {CODE_LEN, DIM, DIM});
+    map_npy(dstore, inPath + "decoder.npy", {CODE_LEN, DIM, DIM});
+  }
+  bindModel(wsz, rsz);
+
+  resetSteps();
+  v_steps.allocate(wsz2, compact_steps);
+  auto in_vsteps = open_array<unsigned long long>(inPath, mfile.get(), "vsteps", {wsz2});
+  read_steps(*in_vsteps, v_steps, wsz2, wsz2, 0);
+  m_steps.allocate(rsz2, false);
+  auto in_msteps = open_array<unsigned long long>(inPath, mfile.get(), "msteps", {rsz2});
+  read_steps(*in_msteps, m_steps, rsz2, rsz2, 0);
+  denc_step.allocate(1, false);
+  auto in_dstep = open_array<unsigned long long>(inPath, mfile.get(), "dstep", {});
+  read_steps(*in_dstep, denc_step, 1, 1, 0);
+  if (fn != inPath) replayDeltas(inPath);
+  else dropSaved();
+
+  debug_print("mapModel Done.\n");
+}
+
+/* vocabs regenerated by countKB are sorted by frequency anew, which would
+ * give the old rows to other names; so the names saved with the model must
+ * be the first of the current vocab, in the same order. */
+void TrainerKB::checkVocab(ent_index wsz, ent_index wsz0, unsigned int rsz0, const string &inPath) const {
+  unique_ptr<ModelFile> mf;
+  const string fn = model_file(inPath);
+  if (!fn.empty()) mf = unique_ptr<ModelFile>(new ModelFile(fn));
+  if (mf ? !mf->has("vocab") : !ifstream(inPath + "vocab.npy")) {
+    cerr << "model in " << inPath << " has no vocab; cannot check that old names kept their indices" << endl;
+    return;
+  }
+  vector<unsigned long long> old(wsz0 + rsz0);
+  auto in = open_array<unsigned long long>(inPath, mf.get(), "vocab", {old.size()});
+  in->read(reinterpret_cast<char *>(old.data()), old.size() * sizeof(unsigned long long));
+  for (ent_index i = 0; i != wsz0; ++i) {
+    if (old[i] != vocab_hashes[i])
+      throw runtime_error("entity " + to_string(i) + " of the model in " + inPath + " has another name in the "
+                          "vocab; a grown vocab must keep the old lines in order and append new ones");
+  }
+  for (unsigned int i = 0; i != rsz0; ++i) {
+    if (old[wsz0 + i] != vocab_hashes[wsz + i])
+      throw runtime_error("relation " + to_string(i) + " of the model in " + inPath + " has another name in the "
+                          "vocab; a grown vocab must keep the old lines in order and append new ones");
+  }
+}
+
+void TrainerKB::growModel(ent_index wsz, unsigned int rsz, const string &inPath, RandomGenerator &rg) {
+  ent_index wsz0;
+  unsigned int rsz0;
+  const string fn = model_file(inPath);
+  if (!fn.empty()) {
+    ModelFile mf(fn);
+    wsz0 = mf.entry("cvecs").shape.at(0);
+    rsz0 = mf.entry("mats").shape.at(0) / 2;
+  } else {
+    // the sizes only; readModel checks the rest of the headers
+    const auto first_dim = [&inPath](const string& name) {
+      const string fn = inPath + name + ".npy";
+      ifstream in(fn, ios::binary);
+      if (!in) throw runtime_error("cannot open " + fn);
+      const NpyHeader header = readNpyHeader(in, fn);
+      if (header.shape.empty()) throw runtime_error(fn + ": expected an array of at least one dimension");
+      return header.shape[0];
+    };
+    wsz0 = first_dim("cvecs");
+    rsz0 = static_cast<unsigned int>(first_dim("mats") / 2);
+  }
+  if (wsz0 > wsz || rsz0 > rsz) throw runtime_error("model in " + inPath + " is larger than the vocab");
+  if (ModelFile::isModelFile(deltaFile(inPath, 1)))
+    throw runtime_error("model in " + inPath + " has deltas; compact it before growing");
+  if (vocab_hashes.size() == wsz + rsz) checkVocab(wsz, wsz0, rsz0, inPath);
+  initModel(wsz, rsz, rg);
+  readModel(wsz0, rsz0, inPath);
+  dropSaved();
+
+  debug_print("growModel Done: %llu -> %llu entities, %d -> %d relations.\n", wsz0, wsz, rsz0, rsz);
+}
+
+void TrainerKB::initModel(ent_index wsz, unsigned int rsz, RandomGenerator &rg) {
+  debug_print("wsz: %llu, rsz: %d\n", wsz, rsz);
   debug_print("%s\n", rg.toString().c_str());
 
+  allocModel(wsz, rsz);
   normal_distribution<float> gaus(0.0f, static_cast<float>(1.0 / sqrt(DIM)));
   {
-    const unsigned int wsz2 = wsz * 2;
-    ctvecs.resize(DIM, wsz2);
-    for (float *p = ctvecs.data(); p != ctvecs.data() + DIM * wsz; ++p) *p = gaus(rg);
-    ctvecs.rightCols(wsz) = ctvecs.leftCols(wsz);
-    v_steps = unique_ptr<atomic_ullong[]>(new atomic_ullong[wsz2]);
-    for (unsigned int i = 0; i != wsz2; ++i) v_steps[i] = 0;
+    const ent_index wsz2 = wsz * 2;
+    for (float *p = cvecs.data(); p != cvecs.data() + DIM * wsz; ++p) *p = gaus(rg);
+    tvecs = cvecs;
+    for (ent_index i = 0; i != wsz2; ++i) v_steps.set(i, 0);
   }{
     const unsigned int rsz2 = rsz * 2;
-    mats.resize(rsz * 2);
     for (auto& m : mats) {
-      m.resize(DIM, DIM);
       for (unsigned int i = 0; i != DIM; ++i) {
         for (unsigned int j = 0; j != DIM; ++j) {
           float tmp = gaus(rg) * 0.5f;
@@ -465,13 +1474,12 @@ void TrainerKB::initModel(unsigned int wsz, unsigned int rsz, RandomGenerator &r
         }
       }
     }
-    m_steps = unique_ptr<atomic_ullong[]>(new atomic_ullong[rsz2]);
-    for (unsigned int i = 0; i != rsz2; ++i) m_steps[i] = 0;
+    for (unsigned int i = 0; i != rsz2; ++i) m_steps.set(i, 0);
   }
-  encoder.resize(DIM * DIM, CODE_LEN);
   for (float *p = encoder.data(); p != encoder.data() + DIM * DIM * CODE_LEN; ++p) *p = gaus(rg);
   decoder = encoder;
-  denc_step = 0;
+  denc_step.set(0, 0);
+  dropSaved();
 
   debug_print("%s\n", rg.toString().c_str());
   debug_print("initModel Done.\n");
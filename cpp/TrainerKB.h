@@ -5,38 +5,302 @@
 #include <string>
 #include <memory>
 #include <atomic>
+#include <mutex>
 
 #include "Eigen/Core"
 
+#include "HyperParametersKB.h"
 #include "RandomGenerator.h"
 #include "Poisson.h"
+#include "Numa.h"
+#include "Storage.h"
+#include "ModelFile.h"
+#include "StepCounters.h"
+#include "StepBuffer.h"
+#include "ContentionProfiler.h"
+#include "BatchKB.h"
+#include "RingBuffer.h"
 
 class TrainerKB {
 
-  Eigen::MatrixXf ctvecs;
-  std::vector<Eigen::MatrixXf> mats;
-  Eigen::MatrixXf encoder;
-  Eigen::MatrixXf decoder;
+  std::unique_ptr<ModelFile> mfile; // backs the stores after mapModel of a model file
+  Storage cstore;
+  Storage tstore;
+  Storage mstore;
+  Storage estore;
+  Storage dstore;
 
-  std::unique_ptr<std::atomic_ullong[]> v_steps;
-  std::unique_ptr<std::atomic_ullong[]> m_steps;
-  std::atomic_ullong denc_step;
+  Eigen::Map<Eigen::MatrixXf> cvecs;
+  Eigen::Map<Eigen::MatrixXf> tvecs;
+  std::vector<Eigen::Map<Eigen::MatrixXf>> mats;
+  Eigen::Map<Eigen::MatrixXf> encoder;
+  Eigen::Map<Eigen::MatrixXf> decoder;
+
+  StepCounters v_steps;
+  StepCounters m_steps;
+  StepCounters denc_step;
+  bool compact_steps = false;
+
+  /* each thread adds its steps through buffers of its own, taken from
+   * the pool and found again through local_steps; flushSteps passes them
+   * all on. a thread hands its buffers back, drained, when it exits, so
+   * there are no more of them than threads training at once. */
+  struct LocalSteps {
+    StepBuffer v;
+    StepBuffer m;
+    StepBuffer d;
+    unsigned int tid; // index in the pool, names the thread to the profiler
+    int shard = -1;   // with shards, the one this thread works for, see joinShard
+    unsigned long long local_incs = 0;  // increments applied in place
+    unsigned long long remote_incs = 0; // and passed to their owners
+    LocalSteps(TrainerKB& t, unsigned int tid) :
+        v(&t.v_steps, 12), m(&t.m_steps, 10), d(&t.denc_step, 1), tid(tid) {}
+  };
+  struct LocalPool {
+    std::mutex mtx;
+    std::vector<std::unique_ptr<LocalSteps>> locals;
+    std::vector<LocalSteps*> idle; // handed back, to be taken again
+    unsigned long long serial;     // changes whenever locals are dropped
+  };
+  std::shared_ptr<LocalPool> pool;
+  // the buffers a thread holds of one trainer
+  struct LocalHold {
+    std::weak_ptr<LocalPool> pool;
+    unsigned long long serial;
+    LocalSteps* steps;
+    void release();
+  };
+  // those of all trainers a thread trains, as a sweep alternates them
+  struct LocalHolds {
+    std::vector<LocalHold> held;
+    ~LocalHolds() { for (auto& x : held) x.release(); }
+  };
+  static thread_local LocalHolds local_steps;
+  LocalSteps& localSteps();
+  void resetSteps();
+
+  std::unique_ptr<ContentionProfiler> profiler;
+
+  /* an increment for a parameter of another shard: vector index (as in
+   * v_steps) += u and steps, or matrix index += u v^T, regularized after. */
+  struct Increment {
+    unsigned long long index;
+    unsigned int steps;
+    bool matrix;
+    float u[DIM];
+    float v[DIM];
+  };
+  typedef RingBuffer<Increment> IncrementRing;
+  static constexpr unsigned int INCREMENT_RING_LOG2 = 5;
+  struct Shards {
+    unsigned int n;
+    std::vector<unsigned short> owners; // of entities; matrix mi is of shard mi % n
+    std::vector<std::unique_ptr<IncrementRing>> rings; // from shard s to shard t at t * n + s
+    std::atomic_uint active;
+  };
+  std::unique_ptr<Shards> shards;
+  Increment& outgoing(RandomGenerator& rnd, LocalSteps& steps, unsigned int owner);
+  void applyIncrement(RandomGenerator& rnd, LocalSteps& steps, const Increment& x);
+  // vector vi (as indexed in v_steps) += delta, and its counter += n
+  template <typename V>
+  void addVector(RandomGenerator& rnd, LocalSteps& steps, ent_index vi, const Eigen::MatrixBase<V>& delta,
+                 unsigned long long n);
+  // matrix mi += u v^T, then regularized
+  template <typename U, typename V>
+  void addMatrix(RandomGenerator& rnd, LocalSteps& steps, unsigned int mi, const Eigen::MatrixBase<U>& u,
+                 const Eigen::MatrixBase<V>& v);
 
   float sigtab[1537];
 
+  // hyper parameters, as products where updates use them so
+  const float vEta;
+  const float mEta;
+  const double orthSkip;
+  const float orthRate;
+  const float orthEL;
+  const float autoFactor;
+  const float autoEta;
+  const double autoSkip;
+  const float jointMEta;
+  const float jointM_EL;
+  const float vEL;
+  const float mEL;
+  const float autoEL;
+  const bool disableAutoencoder;
+
+  std::string vecs_prefix;
+  ent_index hot_rows = 0;
+
+  bool single_file = false;
+
+  // counters at the last save, to find what a delta needs to write
+  StepCounters saved_vsteps;
+  StepCounters saved_msteps;
+  unsigned long long saved_dstep = 0;
+
+  // hashes of the entity names, then the relation names, in vocab order
+  std::vector<unsigned long long> vocab_hashes;
+  void checkVocab(ent_index wsz, ent_index wsz0, unsigned int rsz0, const std::string& inPath) const;
+  unsigned int delta_seq = 0;
+  void markSaved();
+  void dropSaved();
+  void removeDeltas(const std::string& prefix);
+  void applyDelta(const std::string& fn);
+  void replayDeltas(const std::string& prefix);
+
+  numa::Placement placement = numa::NONE;
+  void place(float* p, size_t sz, const std::function<unsigned int(size_t)>& nodeOf);
+  void placeVecs(ent_index wsz);
+  void placeMats();
+
+  // what update samples for one head, and where its vectors are in twv and unwv
+  struct Samples {
+    unsigned int samp_sz = 0;
+    unsigned int tdest[128];
+    ent_index unis[128];
+    unsigned int inter_tvi[32];
+    unsigned int inter_mi[32];
+    float inter_mnrm[32];
+  };
+  void applyGradients(RandomGenerator& rnd, ent_index hi, const Samples& s,
+                      const Eigen::Ref<const Eigen::MatrixXf>& twv, const Eigen::Ref<const Eigen::MatrixXf>& unwv);
+  /* scores the pool of negatives of b against the samples s, leaving the
+   * gradients of the pool in dnegs and its pull on sample k, to be taken down
+   * the path, in unwv.col(129 + k * 4). */
+  void addPool(const BatchKB& b, const Samples& s, const Eigen::Ref<const Eigen::MatrixXf>& twv,
+               Eigen::Ref<Eigen::MatrixXf> unwv, Eigen::MatrixXf& dnegs) const;
+  void applyPoolGradients(RandomGenerator& rnd, const BatchKB& b, const Samples& s,
+                          const Eigen::Ref<const Eigen::MatrixXf>& twv, const Eigen::Ref<const Eigen::MatrixXf>& unwv,
+                          const Eigen::MatrixXf& dnegs);
   void mincr_regularize(unsigned int mi, RandomGenerator& rnd);
 
+  void bindModel(ent_index wsz, unsigned int rsz);
+  void allocModel(ent_index wsz, unsigned int rsz);
+  void readModel(ent_index wsz, unsigned int rsz, const std::string& inPath);
+
 public:
-  TrainerKB();
+  explicit TrainerKB(const HyperParamsKB& hp = HyperParamsKB());
+  ~TrainerKB();
 
+  ent_index numEntities() const { return cvecs.cols(); }
+  // relations and their inverses
+  unsigned int numRelations() const { return mats.size(); }
+
+  /* the live parameters "cvecs", "tvecs", "mats", "encoder" or "decoder",
+   * laid out as saved, and their shape; nullptr for other names. */
+  const float* parameters(const std::string& name, std::vector<size_t>& shape) const;
+  // copies of the step counters, flushed first
+  void stepCounts(std::vector<unsigned long long>& vsteps, std::vector<unsigned long long>& msteps,
+                  unsigned long long& dstep);
+
+  /* with compactSteps, the step counters of entities are 32 bits instead of
+   * 64; call before the model is loaded or initialized. */
+  void setCompactSteps(bool compactSteps) { compact_steps = compactSteps; }
+  /* bytes held by each part of the model, by name; parts in mapped files
+   * are named so, and only take memory as their pages are touched. */
+  std::vector<std::pair<std::string, size_t>> memoryUsage() const;
+
+  void setPlacement(numa::Placement p) { placement = p; }
+  // with numa::PARTITION, the node storing the vectors of entity i
+  unsigned int entityNode(ent_index i) const;
+
+  /* back cvecs and tvecs by memory-mapped files prefix + "cvecs" and
+   * prefix + "tvecs" instead of the heap, keeping the vectors of the first
+   * hotRows (most frequent) entities locked in RAM. */
+  void setVecsFile(const std::string& prefix, ent_index hotRows) { vecs_prefix = prefix; hot_rows = hotRows; }
+  double residentFraction() const { return (cstore.residentFraction() + tstore.residentFraction()) / 2; }
+
+  /* step counters are added lazily, per thread; makes them exact for the
+   * threads not training at the moment. saving flushes by itself. */
+  void flushSteps();
+
+  /* samples one in rate of the writes to vectors and matrices for the
+   * contention report of ContentionProfiler; call after the model is
+   * loaded or initialized. */
+  void enableProfiler(unsigned int rate);
+  const ContentionProfiler* contentionProfiler() const { return profiler.get(); }
+
+  /* owner-computes updates in place of hogwild: entity i, both its vectors,
+   * belongs to shard owners[i] < n, and relation matrix mi to shard mi % n.
+   * each of n threads calls joinShard with its own shard before updating;
+   * from then on it writes only parameters of its shard, and passes the
+   * increments of the others to their owners through a lock-free ring per
+   * pair of shards. owners apply them in drainShard, which a thread should
+   * call between updates, and in leaveShard, which each calls once when
+   * done and which returns when all are. heads of updates are best taken
+   * from the shard of the thread. the autoencoder is still written by all.
+   * call after the model is loaded or initialized. */
+  void setShards(unsigned int n, std::vector<unsigned short> owners);
+  void joinShard(unsigned int shard);
+  // returns the increments applied
+  size_t drainShard(RandomGenerator& rnd);
+  void leaveShard(RandomGenerator& rnd);
+  // fraction of the increments of joined threads passed to other shards
+  double remoteFraction();
+
+  std::string paramsJson() const;
   void saveParams(const std::string& outPath);
 
-  void update(RandomGenerator& rnd, unsigned int hi,
-              const std::vector<std::vector<std::pair<unsigned int, unsigned int>>>& pths);
+  // entities scored at a time by tailBlock callers, so memory stays small for large KBs
+  static constexpr ent_index TAIL_BLOCK = 1 << 14;
+  /* the scores of entities as tails of queries (head, relation), relation >=
+   * rsz for inverses, normalized as in ModelKB.get_score: tailVectors makes a
+   * column of vs per query, then row j of tailBlock's scores holds the scores
+   * of entity first + j for each query. reads the live parameters, so may run
+   * while training; queries are batched so cvecs is read once for all. */
+  void tailVectors(const std::vector<std::pair<ent_index, unsigned int>>& queries, Eigen::MatrixXf& vs) const;
+  void tailBlock(const Eigen::MatrixXf& vs, ent_index first, ent_index n, Eigen::MatrixXf& scores) const;
+  /* the k best tails of each query by those scores, best first and ties to
+   * the lower index: column q of indices and scores for query q. */
+  void topTails(const std::vector<std::pair<ent_index, unsigned int>>& queries, size_t k,
+                Eigen::Matrix<ent_index, Eigen::Dynamic, Eigen::Dynamic>& indices, Eigen::MatrixXf& scores) const;
+
+  // hints the vectors of the head and tails of b into cache, ahead of an update
+  void prefetch(const BatchKB& b) const;
+
+  /* with b.negs != 0, the samples of b have no negatives of their own but
+   * are all scored against the pool b.neg in one product; each pool
+   * negative weighs 3 / b.negs of a sampled one. */
+  void update(RandomGenerator& rnd, const BatchKB& b);
+  // the nested form, at most BatchKB::MAX_EDGES edges in all; throws invalid_argument for more
+  void update(RandomGenerator& rnd, ent_index hi,
+              const std::vector<std::vector<std::pair<unsigned int, ent_index>>>& pths);
+  /* update for the batches bs, sampled as update does; the hops of all
+   * heads are then run level by level, grouped by relation, so each matrix
+   * is applied once per level to a panel of vectors instead of once per
+   * hop. gradients are applied head by head, as if the heads were updated
+   * by concurrent hogwild threads. batches with pools of negatives are
+   * updated one by one. */
+  void updateBatch(RandomGenerator& rnd, const std::vector<const BatchKB*>& bs);
 
+  /* with singleFile, saveModel writes one model file outPath + "model.glm"
+   * instead of npy files. loading accepts either layout: inPath may be a
+   * model file, or a path holding npy files or a "model.glm". */
+  void setSingleFile(bool singleFile) { single_file = singleFile; }
   void saveModel(const std::string& outPath);
-  void loadModel(unsigned int wsz, unsigned int rsz, const std::string& inPath);
-  void initModel(unsigned int wsz, unsigned int rsz, RandomGenerator& rg);
+  void saveModelFile(const std::string& fn);
+  /* saves only the vectors and matrices whose step counters changed since
+   * the base (the last saveBase, or the load of a model with deltas) or the
+   * last delta, as model file prefix + "delta_NNNNNN.glm"; throws if there
+   * is no base. any saveModel to prefix removes its deltas; loadModel and
+   * mapModel of prefix replay them in order. returns the bytes of
+   * parameters written. the counters of the base are only kept once there
+   * is one. */
+  void saveBase(const std::string& prefix);
+  size_t saveDelta(const std::string& prefix);
+  static std::string deltaFile(const std::string& prefix, unsigned int seq);
+  void loadModel(ent_index wsz, unsigned int rsz, const std::string& inPath);
+  /* views the npy files of a saved model in place through copy-on-write
+   * mappings; only the step counters are read into memory. */
+  void mapModel(ent_index wsz, unsigned int rsz, const std::string& inPath);
+  void initModel(ent_index wsz, unsigned int rsz, RandomGenerator& rg);
+  /* names of the entities and relations in vocab order, saved with the
+   * model (as hashes, array "vocab") so that growModel can check them. */
+  void setVocab(const std::vector<std::string>& entities, const std::vector<std::string>& relations);
+  /* loads a model trained on a prefix of the current vocab; entities and
+   * relations appended since are initialized as in initModel. with both
+   * vocabs known, throws if an old name is not at its old index. */
+  void growModel(ent_index wsz, unsigned int rsz, const std::string& inPath, RandomGenerator& rg);
 };
 
 
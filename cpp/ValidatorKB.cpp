@@ -0,0 +1,116 @@
+#include "ValidatorKB.h"
+
+#include <unordered_map>
+#include <algorithm>
+
+#include "Eigen/Core"
+
+using namespace std;
+using namespace Eigen;
+
+// queries scored together, so that cvecs is read once per block
+static constexpr size_t BLOCK = 128;
+
+ValidatorKB::ValidatorKB(const vector<pair<pair<ent_index, unsigned int>, ent_index>> &triples,
+                         const GraphKB &graph, unsigned int rsz) {
+  const unsigned long long rsz2 = rsz * 2;
+  unordered_map<unsigned long long, vector<ent_index>> valid_answers;
+  for (const auto& x : triples) {
+    valid_answers[x.first.first * rsz2 + x.first.second].push_back(x.second);
+    valid_answers[x.second * rsz2 + x.first.second + rsz].push_back(x.first.first);
+  }
+
+  queries.reserve(triples.size() * 2);
+  auto add = [&](ent_index ei, unsigned int ri, ent_index ai) {
+    Query q {ei, ri, ai, {}};
+    const auto nei = graph[ei];
+    for (size_t j = 0; j != nei.size(); ++j) {
+      const auto edge = nei[j];
+      if (edge.first == ri && edge.second != ai) q.other.push_back(edge.second);
+    }
+    for (ent_index x : valid_answers[ei * rsz2 + ri]) {
+      if (x != ai) q.other.push_back(x);
+    }
+    // sorted and unique, as evaluate walks them a block of entities at a time
+    sort(q.other.begin(), q.other.end());
+    q.other.erase(unique(q.other.begin(), q.other.end()), q.other.end());
+    queries.push_back(move(q));
+  };
+  for (const auto& x : triples) {
+    add(x.first.first, x.first.second, x.second);
+    add(x.second, x.first.second + rsz, x.first.first);
+  }
+}
+
+ValidatorKB::Result ValidatorKB::evaluate(const TrainerKB &trainer, size_t sampleSz, RandomGenerator &rnd) const {
+  const size_t sz = size();
+  vector<size_t> picks(sz);
+  for (size_t i = 0; i != sz; ++i) picks[i] = i;
+  if (sampleSz != 0 && sampleSz < sz) {
+    for (size_t i = 0; i != sampleSz; ++i) swap(picks[i], picks[i + rnd(sz - i)]);
+    picks.resize(sampleSz);
+  }
+  if (picks.empty()) return Result {0.0, 0.0};
+
+  const ent_index wsz = trainer.numEntities();
+  const ent_index nblocks = (wsz + TrainerKB::TAIL_BLOCK - 1) / TrainerKB::TAIL_BLOCK;
+  MatrixXf vs, scores;
+  vector<pair<ent_index, unsigned int>> block;
+  vector<const Query*> qs;
+  vector<ent_index> answer_blocks;
+  vector<float> targets;
+  vector<size_t> above;
+  double rr = 0.0;
+  size_t hits10 = 0;
+  for (size_t b = 0; b < picks.size(); b += BLOCK / 2) {
+    const size_t e = min(picks.size(), b + BLOCK / 2);
+    block.clear();
+    qs.clear();
+    for (size_t i = b; i != e; ++i) {
+      for (const Query* q : {&queries[picks[i] * 2], &queries[picks[i] * 2 + 1]}) {
+        block.emplace_back(q->ei, q->ri);
+        qs.push_back(q);
+      }
+    }
+    trainer.tailVectors(block, vs);
+
+    /* the answers are scored from the same entity blocks as the counts below,
+     * so that ties compare equal to the bit */
+    answer_blocks.clear();
+    for (const Query* q : qs) answer_blocks.push_back(q->ai / TrainerKB::TAIL_BLOCK);
+    sort(answer_blocks.begin(), answer_blocks.end());
+    answer_blocks.erase(unique(answer_blocks.begin(), answer_blocks.end()), answer_blocks.end());
+    targets.resize(qs.size());
+    for (ent_index k : answer_blocks) {
+      const ent_index f = k * TrainerKB::TAIL_BLOCK;
+      trainer.tailBlock(vs, f, min(wsz, f + TrainerKB::TAIL_BLOCK) - f, scores);
+      for (size_t q = 0; q != qs.size(); ++q) {
+        if (qs[q]->ai / TrainerKB::TAIL_BLOCK == k) targets[q] = scores(qs[q]->ai - f, q);
+      }
+    }
+
+    // running counts of the entities above each answer, from the last block scored on
+    above.assign(qs.size(), 0);
+    for (ent_index n = 0; n != nblocks; ++n) {
+      const ent_index f = (answer_blocks.back() + n) % nblocks * TrainerKB::TAIL_BLOCK;
+      const ent_index fe = min(wsz, f + TrainerKB::TAIL_BLOCK);
+      if (n != 0) trainer.tailBlock(vs, f, fe - f, scores);
+      for (size_t q = 0; q != qs.size(); ++q) {
+        const auto col = scores.col(q);
+        above[q] += (col.array() > targets[q]).count();
+        // the other known answers are filtered out
+        const auto& other = qs[q]->other;
+        for (auto it = lower_bound(other.begin(), other.end(), f); it != other.end() && *it < fe; ++it) {
+          if (col(*it - f) > targets[q]) --above[q];
+        }
+      }
+    }
+    for (size_t q = 0; q != qs.size(); ++q) {
+      const size_t rank = above[q] + 1;
+      rr += 1.0 / rank;
+      if (rank <= 10) ++hits10;
+    }
+  }
+  const double n = picks.size() * 2.0;
+  return Result {rr / n, hits10 / n};
+}
@@ -0,0 +1,42 @@
+#ifndef GLIMVEC_VALIDATORKB_H
+#define GLIMVEC_VALIDATORKB_H
+
+#include <vector>
+#include <utility>
+
+#include "TrainerKB.h"
+#include "GraphKB.h"
+#include "RandomGenerator.h"
+
+/* filtered link prediction on validation triples, scored against the live
+ * parameters of a TrainerKB as evaluate.py scores a saved model. */
+class ValidatorKB {
+
+  struct Query {
+    ent_index ei;                  // known end
+    unsigned int ri;               // relation, inverse for head prediction
+    ent_index ai;                  // answer
+    std::vector<ent_index> other;  // other known answers, filtered out
+  };
+  std::vector<Query> queries;
+
+public:
+  struct Result {
+    double mrr;
+    double hits10;
+  };
+
+  /* triples are (head, relation, tail); graph holds the neighbors (relation,
+   * tail) and (relation + rsz, head) of the train triples, and the triples
+   * are added to it for filtering. */
+  ValidatorKB(const std::vector<std::pair<std::pair<ent_index, unsigned int>, ent_index>>& triples,
+              const GraphKB& graph, unsigned int rsz);
+
+  size_t size() const { return queries.size() / 2; }
+
+  // ranks tails and heads of sampleSz random triples (all if 0 or more)
+  Result evaluate(const TrainerKB& trainer, size_t sampleSz, RandomGenerator& rnd) const;
+};
+
+
+#endif //GLIMVEC_VALIDATORKB_H
@@ -0,0 +1,195 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "optparse.h"
+#include "RandomGenerator.h"
+#include "ScoreProtocol.h"
+
+using namespace std;
+
+class option : public optparse {
+public:
+  bool help = false;
+
+  unsigned int conns = 4;
+  unsigned int depth = 1;
+  unsigned long long requests = 100000;
+  unsigned int k = 10;
+  unsigned long long seed = 1;
+
+  BEGIN_OPTION_MAP()
+    ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
+      help = true;
+    ON_OPTION_WITH_ARG(LONGOPT("conns"))
+      conns = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("depth"))
+      depth = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("requests"))
+      requests = static_cast<unsigned long long>(stod(arg));
+    ON_OPTION_WITH_ARG(LONGOPT("k"))
+      k = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("seed"))
+      seed = stoull(arg);
+
+  END_OPTION_MAP()
+};
+
+typedef chrono::steady_clock Clock;
+
+static bool read_full(int fd, void* buf, size_t n) {
+  char* p = static_cast<char*>(buf);
+  while (n != 0) {
+    const ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t n) {
+  const char* p = static_cast<const char*>(buf);
+  while (n != 0) {
+    const ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+struct ConnResult {
+  vector<float> lats; // ms
+  unsigned long long errors = 0;
+  string failure;
+};
+
+/* one connection, keeping depth requests in flight until it has sent
+ * requests of them: random entities, relations and directions. */
+static void conn_para(const string& path, unsigned long long requests, unsigned int depth, unsigned int k,
+                      RandomGenerator rnd, ConnResult* res) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    res->failure = "cannot connect to " + path;
+    if (fd >= 0) close(fd);
+    return;
+  }
+  ScoreHello hello;
+  if (!read_full(fd, &hello, sizeof(hello)) || hello.magic != SCORE_MAGIC) {
+    res->failure = "not a serveKB socket: " + path;
+    close(fd);
+    return;
+  }
+
+  vector<Clock::time_point> sent(requests);
+  uint64_t next = 0;
+  const auto send_next = [&]() {
+    ScoreRequest req {next, rnd(hello.entities), static_cast<uint32_t>(rnd(hello.relations)),
+                      static_cast<uint16_t>(k), static_cast<uint8_t>(rnd(2)), 0};
+    sent[next++] = Clock::now();
+    return write_full(fd, &req, sizeof(req));
+  };
+  bool ok = true;
+  while (ok && next != min<unsigned long long>(depth, requests)) ok = send_next();
+  vector<ScoreAnswer> answers;
+  res->lats.reserve(requests);
+  for (unsigned long long got = 0; ok && got != requests; ++got) {
+    ScoreReply rep;
+    ok = read_full(fd, &rep, sizeof(rep)) && rep.id < requests;
+    if (!ok) break;
+    answers.resize(rep.n);
+    ok = read_full(fd, answers.data(), rep.n * sizeof(ScoreAnswer));
+    res->lats.push_back(chrono::duration<float, milli>(Clock::now() - sent[rep.id]).count());
+    if (rep.status != SCORE_OK) ++res->errors;
+    if (ok && next != requests) ok = send_next();
+  }
+  if (!ok) res->failure = "connection lost";
+  close(fd);
+}
+
+static float percentile(const vector<float>& sorted, double p) {
+  return sorted.empty() ? 0.0f : sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+int main(int argc, char *argv[])
+{
+  try {
+    option opt;
+    int argpos = opt.parse(argv, argc);
+    if (opt.help) {
+      cout << "Load generator for serveKB: random queries over a number of connections." << endl
+           << "  clientKB [OPTION...] SOCKET" << endl
+           << endl << "positional arguments:" << endl
+           << "  SOCKET        path of the socket serveKB listens on" << endl
+           << endl << "optional arguments:" << endl
+           << "  -h, --help    show this help message and exit" << endl
+           << "  --conns       concurrent connections (default: 4)" << endl
+           << "  --depth       requests each connection keeps in flight (default: 1)" << endl
+           << "  --requests    requests in all, spread over the connections (default: 100000)" << endl
+           << "  --k           answers per request, at most 1000 (default: 10)" << endl
+           << "  --seed        random seed (default: 1)" << endl
+          ;
+      return 0;
+    }
+    if (argc - argpos != 1) throw runtime_error("wrong number of arguments");
+    if (opt.conns == 0 || opt.depth == 0) throw runtime_error("--conns and --depth must be positive");
+    if (opt.k == 0 || opt.k > SCORE_MAX_K) throw runtime_error("--k must be from 1 to 1000");
+    const string path(argv[argpos]);
+
+    vector<ConnResult> results(opt.conns);
+    vector<thread> threads;
+    RandomGenerator rg(opt.seed);
+    const auto start = Clock::now();
+    for (unsigned int i = 0; i != opt.conns; ++i) {
+      rg.jump();
+      const unsigned long long n = opt.requests / opt.conns + (i < opt.requests % opt.conns ? 1 : 0);
+      threads.emplace_back(&conn_para, path, n, opt.depth, opt.k, rg, &results[i]);
+    }
+    for (auto& x : threads) x.join();
+    const double secs = chrono::duration<double>(Clock::now() - start).count();
+
+    vector<float> lats;
+    unsigned long long errors = 0;
+    for (const auto& x : results) {
+      if (!x.failure.empty()) throw runtime_error(x.failure);
+      lats.insert(lats.end(), x.lats.cbegin(), x.lats.cend());
+      errors += x.errors;
+    }
+    sort(lats.begin(), lats.end());
+    char buf[200];
+    snprintf(buf, sizeof(buf), "%zu requests in %.3f s: %.0f QPS\tp50 %.3f ms\tp99 %.3f ms\tmax %.3f ms\t%llu errors",
+             lats.size(), secs, lats.size() / secs, percentile(lats, 0.5), percentile(lats, 0.99),
+             lats.empty() ? 0.0f : lats.back(), errors);
+    cout << buf << endl;
+
+  } catch (const optparse::unrecognized_option& e) {
+    cout << "unrecognized option: " << e.what() << endl;
+    return 1;
+  } catch (const optparse::invalid_value& e) {
+    cout << "invalid value: " << e.what() << endl;
+    return 1;
+  } catch (const exception& e) {
+    cout << "use -h or --help to show help." << endl;
+    cout << e.what() << endl;
+  }
+
+  return 0;
+}
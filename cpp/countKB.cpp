@@ -0,0 +1,408 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <cstring>
+
+#include "optparse.h"
+#include "BatchKB.h"
+#include "misc.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+using namespace misc;
+
+class option : public optparse {
+public:
+  bool help = false;
+
+  int para = static_cast<int>(max(1u, thread::hardware_concurrency()));
+  double cut = 0.0;
+  string unk;
+  const char* triples = nullptr;
+
+  BEGIN_OPTION_MAP()
+    ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
+      help = true;
+    ON_OPTION_WITH_ARG(LONGOPT("para"))
+      para = stoi(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("cut"))
+      cut = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("unk"))
+      unk = string(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("triples"))
+      triples = arg;
+
+  END_OPTION_MAP()
+};
+
+// the train file, mapped read-only, or read into memory without mmap
+class TextFile {
+  const char* ptr = nullptr;
+  size_t len = 0;
+  string buf;
+#ifndef _WIN32
+  void* base = nullptr;
+#endif
+
+public:
+  explicit TextFile(const string& file) {
+#ifndef _WIN32
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("cannot open " + file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw runtime_error("cannot stat " + file);
+    }
+    len = static_cast<size_t>(st.st_size);
+    if (len != 0) {
+      base = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED) {
+        close(fd);
+        throw runtime_error("cannot map " + file);
+      }
+      madvise(base, len, MADV_SEQUENTIAL);
+      ptr = static_cast<const char*>(base);
+    }
+    close(fd);
+#else
+    ifstream in(file, ios::binary);
+    if (!in) throw runtime_error("cannot open " + file);
+    buf.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    ptr = buf.data();
+    len = buf.size();
+#endif
+  }
+  ~TextFile() {
+#ifndef _WIN32
+    if (ptr) munmap(base, len);
+#endif
+  }
+  TextFile(const TextFile& that) = delete;
+  TextFile& operator=(const TextFile& that) = delete;
+
+  const char* data() const { return ptr; }
+  size_t size() const { return len; }
+};
+
+// a key, viewed in the arena of a table or in the train file
+struct Key {
+  const char* p;
+  size_t n;
+  bool operator==(const Key& that) const { return n == that.n && memcmp(p, that.p, n) == 0; }
+  /* bytewise, which for UTF-8 is code point order; java compares UTF-16 code
+   * units, which differs only between characters beyond U+FFFF and U+E000 to
+   * U+FFFF. */
+  bool operator<(const Key& that) const {
+    const int c = memcmp(p, that.p, min(n, that.n));
+    return c < 0 || (c == 0 && n < that.n);
+  }
+};
+
+static const size_t NOID = ~static_cast<size_t>(0);
+
+/* counts of keys, which get ids in order of first occurrence. keys are copied
+ * into one arena and found by linear probing on their hash, so that lookups
+ * stay in cache rather than chase nodes and the scattered first occurrences
+ * in the train file. */
+class Table {
+  struct Slot {
+    unsigned long long hash;
+    size_t id;
+  };
+  vector<Slot> slots;
+  string arena;
+  vector<size_t> offs; // key id is arena[offs[id], offs[id + 1])
+  vector<unsigned long long> cnts;
+
+  static unsigned long long hashOf(const Key& k) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i != k.n; ++i) h = (h ^ static_cast<unsigned char>(k.p[i])) * 1099511628211ULL;
+    return h;
+  }
+  bool equals(size_t id, const Key& k) const {
+    return offs[id + 1] - offs[id] == k.n && memcmp(arena.data() + offs[id], k.p, k.n) == 0;
+  }
+  void grow() {
+    vector<Slot> old(slots.size() * 2, Slot {0, NOID});
+    old.swap(slots);
+    const size_t mask = slots.size() - 1;
+    for (const Slot& x : old) {
+      if (x.id == NOID) continue;
+      size_t i = x.hash & mask;
+      while (slots[i].id != NOID) i = (i + 1) & mask;
+      slots[i] = x;
+    }
+  }
+
+public:
+  Table() : slots(1024, Slot {0, NOID}), offs(1, 0) {}
+
+  size_t add(const Key& k, unsigned long long c = 1) {
+    const unsigned long long h = hashOf(k);
+    const size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      Slot& x = slots[i];
+      if (x.id == NOID) {
+        x = Slot {h, cnts.size()};
+        arena.append(k.p, k.n);
+        offs.push_back(arena.size());
+        cnts.push_back(c);
+        if (cnts.size() * 2 > slots.size()) grow();
+        return cnts.size() - 1;
+      }
+      if (x.hash == h && equals(x.id, k)) {
+        cnts[x.id] += c;
+        return x.id;
+      }
+    }
+  }
+  // NOID if absent
+  size_t find(const Key& k) const {
+    const unsigned long long h = hashOf(k);
+    const size_t mask = slots.size() - 1;
+    for (size_t i = h & mask; slots[i].id != NOID; i = (i + 1) & mask)
+      if (slots[i].hash == h && equals(slots[i].id, k)) return slots[i].id;
+    return NOID;
+  }
+
+  size_t size() const { return cnts.size(); }
+  // valid until the next add
+  Key key(size_t id) const { return Key {arena.data() + offs[id], offs[id + 1] - offs[id]}; }
+  unsigned long long count(size_t id) const { return cnts[id]; }
+};
+
+// the lines of [begin, end), counted by one thread
+struct Chunk {
+  const char* begin;
+  const char* end;
+  Table ents;
+  Table rels;
+  vector<size_t> triples; // (head, relation, tail) in ids of ents and rels, if kept
+  string error;
+};
+
+/* a line is split as line.split("\t") in countKB.scala: trailing empty
+ * fields are dropped, and there must be exactly three left. */
+static bool split_line(const char* b, const char* e, Key& head, Key& rel, Key& tail) {
+  const char* t1 = static_cast<const char*>(memchr(b, '\t', e - b));
+  if (!t1) return false;
+  const char* t2 = static_cast<const char*>(memchr(t1 + 1, '\t', e - t1 - 1));
+  if (!t2) return false;
+  const char* t3 = static_cast<const char*>(memchr(t2 + 1, '\t', e - t2 - 1));
+  if (!t3) t3 = e;
+  if (t3 == t2 + 1) return false;
+  for (const char* c = t3; c != e; ++c) if (*c != '\t') return false;
+  head = Key {b, static_cast<size_t>(t1 - b)};
+  rel = Key {t1 + 1, static_cast<size_t>(t2 - t1 - 1)};
+  tail = Key {t2 + 1, static_cast<size_t>(t3 - t2 - 1)};
+  return true;
+}
+
+static void count_chunk(Chunk* c, bool keep_triples) {
+  Key head, rel, tail;
+  for (const char* b = c->begin; b != c->end;) {
+    const char* nl = static_cast<const char*>(memchr(b, '\n', c->end - b));
+    const char* e = nl ? nl : c->end;
+    const char* next = nl ? nl + 1 : c->end;
+    if (e != b && e[-1] == '\r') --e;
+    if (!split_line(b, e, head, rel, tail)) {
+      c->error = "malformed line: " + string(b, e);
+      return;
+    }
+    const size_t h = c->ents.add(head);
+    const size_t r = c->rels.add(rel);
+    const size_t t = c->ents.add(tail);
+    if (keep_triples) {
+      c->triples.push_back(h);
+      c->triples.push_back(r);
+      c->triples.push_back(t);
+    }
+    b = next;
+  }
+}
+
+/* the tables of the chunks merged into one, and for each chunk the merged id
+ * of each of its ids */
+static void merge(const vector<Chunk>& chunks, Table Chunk::* tab, Table& merged, vector<vector<size_t>>& ids) {
+  ids.resize(chunks.size());
+  for (size_t i = 0; i != chunks.size(); ++i) {
+    const Table& t = chunks[i].*tab;
+    ids[i].resize(t.size());
+    for (size_t j = 0; j != t.size(); ++j) ids[i][j] = merged.add(t.key(j), t.count(j));
+  }
+}
+
+/* as CountTable.sortCount: keys counted below cut are backed off to unk, or
+ * dropped if unk is empty; then by count descending and key ascending. as
+ * there, the backed off sum is a separate entry even if unk is also a key. */
+static vector<pair<Key, unsigned long long>> sort_count(const Table& t, double cut, const Key& unk) {
+  vector<pair<Key, unsigned long long>> ret;
+  ret.reserve(t.size() + 1);
+  unsigned long long backed = 0;
+  for (size_t id = 0; id != t.size(); ++id) {
+    if (static_cast<double>(t.count(id)) < cut) {
+      if (unk.n != 0) backed += t.count(id);
+    } else
+      ret.emplace_back(t.key(id), t.count(id));
+  }
+  if (backed != 0) ret.emplace_back(unk, backed);
+  sort(ret.begin(), ret.end(), [](const pair<Key, unsigned long long>& x, const pair<Key, unsigned long long>& y) {
+    return x.second > y.second || (x.second == y.second && x.first < y.first);
+  });
+  return ret;
+}
+
+static void write_count(const string& fn, const vector<pair<Key, unsigned long long>>& count) {
+  ofstream out(fn, ios::binary);
+  if (!out) throw runtime_error("cannot open " + fn);
+  string line;
+  for (const auto& x : count) {
+    line.assign(x.first.p, x.first.n);
+    line += '\t';
+    line += countString(x.second);
+    line += '\n';
+    out << line;
+  }
+}
+
+static const ent_index NONE = ~0ULL;
+
+/* index in the written vocab of each key of the merged table, as trainKB
+ * reads it: a key listed twice gets the later index, keys backed off get
+ * that of unk, and keys dropped get NONE. */
+static vector<ent_index> vocab_index(const Table& t, const vector<pair<Key, unsigned long long>>& count, const Key& unk) {
+  vector<ent_index> ret(t.size(), NONE);
+  ent_index unk_index = NONE;
+  for (size_t i = 0; i != count.size(); ++i) {
+    const size_t id = t.find(count[i].first);
+    if (id != NOID) ret[id] = i;
+    if (unk.n != 0 && count[i].first == unk) unk_index = i;
+  }
+  for (auto& x : ret) if (x == NONE) x = unk_index;
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  try {
+    option opt;
+    int argpos = opt.parse(argv, argc);
+    if (opt.help) {
+      cout << "Count entities and relations of a KB, as countKB.scala." << endl
+           << "  countKB [OPTION...] TRAIN_FILE OUT_VOCAB_ENTITY OUT_VOCAB_RELATION" << endl
+           << endl << "positional arguments:" << endl
+           << "  TRAIN_FILE          train file, tab separated (head, relation, tail) per line" << endl
+           << "  OUT_VOCAB_ENTITY    write counts of entities to this file" << endl
+           << "  OUT_VOCAB_RELATION  write counts of relations to this file" << endl
+           << endl << "optional arguments:" << endl
+           << "  -h, --help          show this help message and exit" << endl
+           << "  --para              number of parallel threads (default: number of cores)" << endl
+           << "  --cut               drop keys counted less than this (default: 0)" << endl
+           << "  --unk               with --cut, add the counts of dropped keys up under this key instead" << endl
+           << "  --triples           also write the triples as (head, relation, tail) indices into the" << endl
+           << "                      vocab files, to this npy file of uint64 (triples with a dropped key" << endl
+           << "                      are left out)" << endl
+          ;
+      return 0;
+    }
+    if (argc - argpos != 3) throw runtime_error("wrong number of arguments");
+    if (opt.para <= 0) throw runtime_error("--para must be positive");
+    string train_fn(argv[argpos]);
+    string out_entity_fn(argv[argpos + 1]);
+    string out_relation_fn(argv[argpos + 2]);
+
+    TextFile file(train_fn);
+    const char* data = file.data();
+    const size_t len = file.size();
+
+    // chunks begin after a line break, so that each line is in one chunk
+    vector<Chunk> chunks(static_cast<size_t>(opt.para));
+    const char* b = data;
+    for (size_t i = 0; i != chunks.size(); ++i) {
+      const char* e = data + len;
+      const char* at = max(b, data + len / chunks.size() * (i + 1));
+      if (i + 1 != chunks.size() && at != e) {
+        const char* nl = static_cast<const char*>(memchr(at, '\n', e - at));
+        if (nl) e = nl + 1;
+      }
+      chunks[i].begin = b;
+      chunks[i].end = e;
+      b = e;
+    }
+
+    vector<thread> threads;
+    for (size_t i = 1; i != chunks.size(); ++i) threads.emplace_back(count_chunk, &chunks[i], opt.triples != nullptr);
+    count_chunk(&chunks[0], opt.triples != nullptr);
+    for (auto& th : threads) th.join();
+    for (const Chunk& c : chunks) if (!c.error.empty()) throw runtime_error(c.error);
+
+    const Key unk {opt.unk.data(), opt.unk.size()};
+    Table ent_table, rel_table;
+    vector<vector<size_t>> ent_ids, rel_ids;
+    merge(chunks, &Chunk::ents, ent_table, ent_ids);
+    merge(chunks, &Chunk::rels, rel_table, rel_ids);
+    const auto ents = sort_count(ent_table, opt.cut, unk);
+    const auto rels = sort_count(rel_table, opt.cut, unk);
+    write_count(out_entity_fn, ents);
+    write_count(out_relation_fn, rels);
+
+    if (opt.triples) {
+      const auto ent_index_of = vocab_index(ent_table, ents, unk);
+      const auto rel_index_of = vocab_index(rel_table, rels, unk);
+      // the header needs the number kept, so triples are mapped twice
+      size_t num = 0, kept = 0;
+      vector<ent_index> buf;
+      auto map_chunk = [&](size_t i) {
+        const auto& c = chunks[i];
+        buf.clear();
+        for (size_t k = 0; k < c.triples.size(); k += 3) {
+          const ent_index h = ent_index_of[ent_ids[i][c.triples[k]]];
+          const ent_index r = rel_index_of[rel_ids[i][c.triples[k + 1]]];
+          const ent_index t = ent_index_of[ent_ids[i][c.triples[k + 2]]];
+          if (h == NONE || r == NONE || t == NONE) continue;
+          buf.push_back(h);
+          buf.push_back(r);
+          buf.push_back(t);
+        }
+      };
+      for (size_t i = 0; i != chunks.size(); ++i) {
+        map_chunk(i);
+        num += chunks[i].triples.size() / 3;
+        kept += buf.size() / 3;
+      }
+      ofstream out(opt.triples, ios::binary);
+      if (!out) throw runtime_error(string("cannot open ") + opt.triples);
+      out << createNpyHeader<ent_index>(false, {kept, 3});
+      for (size_t i = 0; i != chunks.size(); ++i) {
+        map_chunk(i);
+        out.write(reinterpret_cast<const char*>(buf.data()), buf.size() * sizeof(ent_index));
+      }
+      if (kept != num) cerr << num - kept << " triples with dropped keys left out" << endl;
+    }
+    cerr << ents.size() << " entities, " << rels.size() << " relations" << endl;
+
+  } catch (const optparse::unrecognized_option& e) {
+    cout << "unrecognized option: " << e.what() << endl;
+    return 1;
+  } catch (const optparse::invalid_value& e) {
+    cout << "invalid value: " << e.what() << endl;
+    return 1;
+  } catch (const exception& e) {
+    cout << "use -h or --help to show help." << endl;
+    cout << e.what() << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "optparse.h"
+#include "RandomGenerator.h"
+#include "BatchKB.h"
+#include "misc.h"
+
+using namespace std;
+using namespace misc;
+
+class option : public optparse {
+public:
+  bool help = false;
+
+  ent_index entities = 100000;
+  unsigned int relations = 1000;
+  double degree = 10.0;
+  double degreeExp = 2.1;
+  double relSkew = 1.0;
+  unsigned int types = 16;
+  unsigned long long seed = 1;
+
+  BEGIN_OPTION_MAP()
+    ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
+      help = true;
+    ON_OPTION_WITH_ARG(LONGOPT("entities"))
+      entities = static_cast<ent_index>(stod(arg));
+    ON_OPTION_WITH_ARG(LONGOPT("relations"))
+      relations = static_cast<unsigned int>(stod(arg));
+    ON_OPTION_WITH_ARG(LONGOPT("degree"))
+      degree = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("degreeExp"))
+      degreeExp = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("relSkew"))
+      relSkew = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("types"))
+      types = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("seed"))
+      seed = stoull(arg);
+
+  END_OPTION_MAP()
+};
+
+/* ranks 0 to n - 1 drawn with probability about proportional to
+ * (rank + 1)^-a, by inverting the continuous distribution on [1, n + 1). */
+class PowerLaw {
+  ent_index n;
+  double a;
+  double top; // (n + 1)^(1 - a) - 1, or log(n + 1) for a = 1
+
+public:
+  PowerLaw(ent_index n, double a) : n(n), a(a) {
+    top = fabs(a - 1.0) < 1e-9 ? log(n + 1.0) : pow(n + 1.0, 1.0 - a) - 1.0;
+  }
+  ent_index operator()(RandomGenerator& rnd) const {
+    const double u = rnd.nextDouble();
+    const double x = fabs(a - 1.0) < 1e-9 ? exp(u * top) : pow(u * top + 1.0, 1.0 / (1.0 - a));
+    return min(n - 1, static_cast<ent_index>(x) - 1);
+  }
+};
+
+static void append_num(string& s, unsigned long long x) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  do {
+    *--p = static_cast<char>('0' + x % 10);
+    x /= 10;
+  } while (x != 0);
+  s.append(p, buf + sizeof(buf) - p);
+}
+
+// names compare as countKB orders them, count descending then key ascending
+static void write_vocab(const string& fn, char prefix, const vector<unsigned long long>& counts) {
+  vector<pair<string, unsigned long long>> v;
+  for (size_t i = 0; i != counts.size(); ++i) {
+    if (counts[i] == 0) continue;
+    string name(1, prefix);
+    append_num(name, i);
+    v.emplace_back(move(name), counts[i]);
+  }
+  sort(v.begin(), v.end(), [](const pair<string, unsigned long long>& x, const pair<string, unsigned long long>& y) {
+    return x.second > y.second || (x.second == y.second && x.first < y.first);
+  });
+  ofstream out(fn, ios::binary);
+  if (!out) throw runtime_error("cannot open " + fn);
+  string line;
+  for (const auto& x : v) {
+    line = x.first;
+    line += '\t';
+    line += countString(x.second);
+    line += '\n';
+    out << line;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  try {
+    option opt;
+    int argpos = opt.parse(argv, argc);
+    if (opt.help) {
+      cout << "Generate a synthetic KB with power-law degrees, for benchmarks." << endl
+           << "  genKB [OPTION...] OUT_PATH" << endl
+           << endl << "positional arguments:" << endl
+           << "  OUT_PATH      write train.txt, vocab_entity.txt and vocab_relation.txt to this path" << endl
+           << endl << "optional arguments:" << endl
+           << "  -h, --help    show this help message and exit" << endl
+           << "  --entities    number of entities; those drawn in no triple are left out (default: 100000)" << endl
+           << "  --relations   number of relations (default: 1000)" << endl
+           << "  --degree      mean degree of entities, so there are entities * degree / 2 triples" << endl
+           << "                (default: 10)" << endl
+           << "  --degreeExp   entity degrees follow a power law with this exponent, > 1 (default: 2.1)" << endl
+           << "  --relSkew     relation frequencies are proportional to rank^-relSkew (default: 1)" << endl
+           << "  --types       the tails of a relation are all of one of this many types, so that" << endl
+           << "                there is something to learn (default: 16)" << endl
+           << "  --seed        random seed (default: 1)" << endl
+          ;
+      return 0;
+    }
+    if (argc - argpos != 1) throw runtime_error("wrong number of arguments");
+    if (opt.entities < 2 || opt.relations < 1) throw runtime_error("need at least 2 entities and 1 relation");
+    if (opt.degreeExp <= 1.0) throw runtime_error("--degreeExp must be greater than 1");
+    if (opt.types < 1 || opt.types > opt.entities) throw runtime_error("--types must be from 1 to --entities");
+    string out_path(argv[argpos]);
+
+    const auto num = static_cast<unsigned long long>(opt.entities * opt.degree / 2.0);
+    // an entity of degree rank k has degree about k^(-1 / (degreeExp - 1))
+    const double ent_a = 1.0 / (opt.degreeExp - 1.0);
+    const PowerLaw samp_head(opt.entities, ent_a);
+    const PowerLaw samp_rel(opt.relations, opt.relSkew);
+    vector<PowerLaw> samp_tail;
+    for (unsigned int t = 0; t != opt.types; ++t) samp_tail.emplace_back((opt.entities - t + opt.types - 1) / opt.types, ent_a);
+
+    RandomGenerator rnd(opt.seed);
+    vector<unsigned long long> ent_counts(opt.entities), rel_counts(opt.relations);
+    ofstream out(out_path + "train.txt", ios::binary);
+    if (!out) throw runtime_error("cannot open " + out_path + "train.txt");
+    string buf;
+    for (unsigned long long k = 0; k != num; ++k) {
+      const unsigned int r = static_cast<unsigned int>(samp_rel(rnd));
+      const unsigned int t = static_cast<unsigned int>((r * 2654435761ULL >> 8) % opt.types);
+      const ent_index h = samp_head(rnd);
+      ent_index x = samp_tail[t](rnd) * opt.types + t;
+      // no self loops; a few tries suffice as only hubs are drawn often
+      for (int i = 0; x == h && i != 8; ++i) x = samp_tail[t](rnd) * opt.types + t;
+      if (x == h) continue;
+      ++ent_counts[h];
+      ++ent_counts[x];
+      ++rel_counts[r];
+      buf += 'e';
+      append_num(buf, h);
+      buf += "\tr";
+      append_num(buf, r);
+      buf += "\te";
+      append_num(buf, x);
+      buf += '\n';
+      if (buf.size() > (1 << 20)) {
+        out.write(buf.data(), buf.size());
+        buf.clear();
+      }
+    }
+    out.write(buf.data(), buf.size());
+    out.close();
+
+    write_vocab(out_path + "vocab_entity.txt", 'e', ent_counts);
+    write_vocab(out_path + "vocab_relation.txt", 'r', rel_counts);
+    cerr << count_if(ent_counts.cbegin(), ent_counts.cend(), [](unsigned long long c) { return c != 0; })
+         << " entities, " << count_if(rel_counts.cbegin(), rel_counts.cend(), [](unsigned long long c) { return c != 0; })
+         << " relations" << endl;
+
+  } catch (const optparse::unrecognized_option& e) {
+    cout << "unrecognized option: " << e.what() << endl;
+    return 1;
+  } catch (const optparse::invalid_value& e) {
+    cout << "invalid value: " << e.what() << endl;
+    return 1;
+  } catch (const exception& e) {
+    cout << "use -h or --help to show help." << endl;
+    cout << e.what() << endl;
+  }
+
+  return 0;
+}
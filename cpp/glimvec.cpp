@@ -5,9 +5,18 @@
 #include <chrono>
 #include <string>
 #include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
 
 #include "RandomGenerator.h"
 #include "TrainerKB.h"
+#include "BatchKB.h"
+#include "QueryKB.h"
+#include "HyperParametersKB.h"
 
 
 class RefPyObj {
@@ -37,53 +46,120 @@ public:
 };
 
 static RandomGenerator rg(static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()));
-static std::unique_ptr<TrainerKB> ptrain;
+// shared with the views of modelArrays, which keep a replaced trainer alive
+static std::shared_ptr<TrainerKB> ptrain;
+
+/* a save of the trainer, with a Python error set if it failed: RuntimeError
+ * for a misuse, IOError for a file that could not be written. */
+template <typename F>
+static bool glimvec_save(F save) {
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return false;
+  }
+  try {
+    save(*ptrain);
+  } catch (const std::logic_error& e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+    return false;
+  } catch (const std::exception& e) {
+    PyErr_SetString(PyExc_IOError, e.what());
+    return false;
+  }
+  return true;
+}
+
+// the first fields of the lines of a vocab file
+static std::vector<std::string> glimvec_readNames(const char* fn) {
+  std::ifstream in(fn);
+  if (!in) throw std::runtime_error(std::string("cannot open ") + fn);
+  std::vector<std::string> ret;
+  std::string line;
+  while (std::getline(in, line)) ret.push_back(line.substr(0, line.find('\t')));
+  return ret;
+}
 
 static PyObject* glimvec_initTrainer(PyObject *self, PyObject *args, PyObject *keywds) {
-  unsigned int wsz = 0;
+  ent_index wsz = 0;
   unsigned int rsz = 0;
   const char* inpath = nullptr;
   const char* outpath = nullptr;
+  int grow = 0;
+  int mmap = 0;
+  int modelfile = 0;
+  const char* vocab_entity = nullptr;
+  const char* vocab_relation = nullptr;
 
-  static const char *kwlist[] = {"numEnts", "numRels", "inPath", "outPath", nullptr};
+  static const char *kwlist[] = {"numEnts", "numRels", "inPath", "outPath", "grow", "mmap", "modelFile",
+                                 "vocabEntity", "vocabRelation", nullptr};
 
-  if (!PyArg_ParseTupleAndKeywords(args, keywds, "ii|zs", (char**)kwlist,
-                                   &wsz, &rsz, &inpath, &outpath))
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "Ki|zspppzz", (char**)kwlist,
+                                   &wsz, &rsz, &inpath, &outpath, &grow, &mmap, &modelfile,
+                                   &vocab_entity, &vocab_relation))
     return nullptr;
 
   std::string outpathStr;
   if (outpath) outpathStr = std::string(outpath);
 
-  ptrain = std::unique_ptr<TrainerKB>(new TrainerKB());
+  ptrain = std::shared_ptr<TrainerKB>(new TrainerKB());
+  ptrain->setSingleFile(modelfile);
+  if (vocab_entity && vocab_relation) {
+    try {
+      ptrain->setVocab(glimvec_readNames(vocab_entity), glimvec_readNames(vocab_relation));
+    } catch (const std::exception& e) {
+      PyErr_SetString(PyExc_ValueError, e.what());
+      return nullptr;
+    }
+  }
   ptrain->saveParams(outpathStr);
 
-  if (inpath) ptrain->loadModel(wsz, rsz, inpath);
+  if (inpath && grow) {
+    try {
+      ptrain->growModel(wsz, rsz, inpath, rg);
+    } catch (const std::exception& e) {
+      PyErr_SetString(PyExc_ValueError, e.what());
+      return nullptr;
+    }
+    if (!glimvec_save([&](TrainerKB& t) { t.saveModel(outpathStr + "init_"); })) return nullptr;
+  } else if (inpath && mmap) {
+    try {
+      ptrain->mapModel(wsz, rsz, inpath);
+    } catch (const std::exception& e) {
+      PyErr_SetString(PyExc_ValueError, e.what());
+      return nullptr;
+    }
+  } else if (inpath) {
+    try {
+      ptrain->loadModel(wsz, rsz, inpath);
+    } catch (const std::exception& e) {
+      PyErr_SetString(PyExc_ValueError, e.what());
+      return nullptr;
+    }
+  }
   else {
     ptrain->initModel(wsz, rsz, rg);
-    ptrain->saveModel(outpathStr + "init_");
+    if (!glimvec_save([&](TrainerKB& t) { t.saveModel(outpathStr + "init_"); })) return nullptr;
   }
 
   Py_RETURN_NONE;
 }
 
-static unsigned short glimvec_KB_parseResult(RefPyObj result, unsigned int& hi,
-                                             std::vector<std::vector<std::pair<unsigned int, unsigned int>>>& pths) {
-  pths.clear();
+static unsigned short glimvec_KB_parseResult(RefPyObj result, BatchKB& b) {
   if (result && PyTuple_Check(result) && PyTuple_Size(result) == 2) {
-    hi = PyLong_AsLong(PyTuple_GetItem(result, 0));
+    b.reset(PyLong_AsUnsignedLongLong(PyTuple_GetItem(result, 0)));
     if (RefPyObj iter_paths = PyObject_GetIter(PyTuple_GetItem(result, 1))) {
       RefPyObj path;
       while ((path = PyIter_Next(iter_paths))) {
         if (RefPyObj iter_edges = PyObject_GetIter(path)) {
-          std::vector<std::pair<unsigned int, unsigned int>> pth;
           RefPyObj edge;
           while ((edge = PyIter_Next(iter_edges))) {
             if (PyTuple_Check(edge) && PyTuple_Size(edge) == 2) {
-              pth.emplace_back(PyLong_AsLong(PyTuple_GetItem(edge, 0)), PyLong_AsLong(PyTuple_GetItem(edge, 1)));
+              if (b.full()) return 6;
+              b.push(PyLong_AsLong(PyTuple_GetItem(edge, 0)), PyLong_AsUnsignedLongLong(PyTuple_GetItem(edge, 1)));
             } else
               return 4;
           }
-          if (!pth.empty()) pths.push_back(std::move(pth));
+          b.endPath();
         } else
           return 3;
       }
@@ -94,42 +170,293 @@ static unsigned short glimvec_KB_parseResult(RefPyObj result, unsigned int& hi,
   return 0;
 }
 
-static std::atomic_ushort error;
 static const char* err_msg[] = {"a batch should be a (hi, pths) tuple",
                                 "pths not iterable",
                                 "some pth not iterable",
                                 "an edge should be a (ri, ti) tuple",
-                                "failed to build tid"};
-
-static std::atomic_llong remained_batches;
-
-static void glimvec_trainKB_para(int tid, RandomGenerator rnd, PyObject* func) {
-  PyGILState_STATE gstate;
-  gstate = PyGILState_Ensure();
-
-  /* Perform Python actions here. */
-  if (RefPyObj arglist = Py_BuildValue("(i)", tid)) {
-    while(error.load(std::memory_order_acquire) == 0 && remained_batches.fetch_sub(1, std::memory_order_relaxed) > 0) {
-      unsigned int hi;
-      std::vector<std::vector<std::pair<unsigned int, unsigned int>>> pths;
-      unsigned short msg = glimvec_KB_parseResult(PyObject_CallObject(func, arglist), hi, pths);
-      if (msg != 0) {
-        error.store(msg, std::memory_order_release);
-        break;
+                                "failed to build tid",
+                                "a batch should have at most 31 edges"};
+
+/* trains on threads of its own, with batches from a callback as trainKB;
+ * worker tid calls func(tid). the threads may be paused between batches,
+ * which leaves the model quiet for evaluation or saving, and resumed with a
+ * different number of workers. */
+class AsyncTrainKB {
+  std::shared_ptr<TrainerKB> trainer;
+  PyObject* func;
+  const bool bounded;
+  std::atomic_llong remained;
+  std::atomic_llong done;
+  std::atomic_ushort error;
+
+  // workers with tid >= target leave, all wait while paused
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::atomic_bool paused;
+  std::atomic_bool stopped;
+  std::atomic_uint target;
+  unsigned int live = 0;
+  unsigned int parked = 0;
+  bool joining = false; // no more workers once a join has begun
+  std::vector<std::thread> threads;
+
+  std::chrono::steady_clock::time_point last_time;
+  long long last_done = 0;
+
+  // called with the GIL; false if worker tid should leave
+  bool proceed(unsigned int tid) {
+    if (!paused.load(std::memory_order_acquire) && !stopped.load(std::memory_order_acquire) &&
+        tid < target.load(std::memory_order_acquire))
+      return error.load(std::memory_order_acquire) == 0;
+    bool ret;
+    // mtx is let go before the GIL is taken back, as the GIL holder may lock it
+    Py_BEGIN_ALLOW_THREADS
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        ++parked;
+        cv.notify_all();
+        cv.wait(lock, [&] { return !paused || stopped || tid >= target; });
+        --parked;
+        ret = !stopped && tid < target;
+      }
+    Py_END_ALLOW_THREADS
+    return ret && error.load(std::memory_order_acquire) == 0;
+  }
+
+  void work(unsigned int tid, RandomGenerator rnd) {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    {
+      RefPyObj arglist(Py_BuildValue("(i)", tid));
+      if (!arglist) error.store(5, std::memory_order_release);
+      while (arglist && proceed(tid) && (!bounded || remained.fetch_sub(1, std::memory_order_relaxed) > 0)) {
+        BatchKB b;
+        unsigned short msg = glimvec_KB_parseResult(PyObject_CallObject(func, arglist), b);
+        if (msg != 0) {
+          error.store(msg, std::memory_order_release);
+          break;
+        }
+        if (b.paths != 0) {
+          Py_BEGIN_ALLOW_THREADS
+            trainer->update(rnd, b);
+          Py_END_ALLOW_THREADS
+        }
+        done.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    PyGILState_Release(gstate);
+    std::lock_guard<std::mutex> lock(mtx);
+    --live;
+    cv.notify_all();
+  }
+
+  // with mtx held and the GIL, for the rg of the module
+  void spawn(unsigned int para) {
+    while (threads.size() < para) {
+      rg.jump();
+      ++live;
+      threads.emplace_back(&AsyncTrainKB::work, this, static_cast<unsigned int>(threads.size()), rg);
+    }
+  }
+
+public:
+  // numBatches <= 0 trains until stop
+  AsyncTrainKB(std::shared_ptr<TrainerKB> t, PyObject* f, long long numBatches, unsigned int para) :
+      trainer(std::move(t)), func(f), bounded(numBatches > 0), remained(numBatches), done(0), error(0),
+      paused(false), stopped(false), target(para), last_time(std::chrono::steady_clock::now()) {
+    Py_INCREF(func);
+    std::lock_guard<std::mutex> lock(mtx);
+    spawn(para);
+  }
+  // with the GIL
+  ~AsyncTrainKB() {
+    stop();
+    join();
+    Py_DECREF(func);
+  }
+
+  long long batches() const { return done.load(std::memory_order_relaxed); }
+  unsigned int para() const { return target.load(std::memory_order_relaxed); }
+  bool isPaused() const { return paused.load(std::memory_order_relaxed); }
+  bool isStopped() const { return stopped.load(std::memory_order_relaxed); }
+
+  bool running() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return live != 0;
+  }
+
+  // batches per second since the last call, or the start
+  double throughput() {
+    const auto now = std::chrono::steady_clock::now();
+    const long long d = batches();
+    const double secs = std::chrono::duration<double>(now - last_time).count();
+    const double ret = secs > 0.0 ? (d - last_done) / secs : 0.0;
+    last_time = now;
+    last_done = d;
+    return ret;
+  }
+
+  /* with the GIL; returns once every worker waits, or once resumed or
+   * stopped from another thread meanwhile */
+  void pause() {
+    Py_BEGIN_ALLOW_THREADS
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        paused = true;
+        cv.wait(lock, [&] { return parked == live || !paused || stopped; });
+      }
+    Py_END_ALLOW_THREADS
+  }
+
+  // with the GIL; para == 0 keeps the workers as they are
+  void resume(unsigned int para) {
+    std::vector<std::thread> leaving;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (para != 0 && !stopped && !joining) {
+        target = para;
+        if (para < threads.size()) {
+          for (size_t i = para; i != threads.size(); ++i) leaving.push_back(std::move(threads[i]));
+          threads.resize(para);
+        } else {
+          spawn(para);
+        }
       }
-      if (pths.empty()) continue;
-      Py_BEGIN_ALLOW_THREADS
-        ptrain->update(rnd, hi, pths);
-      Py_END_ALLOW_THREADS
+      paused = false;
     }
-  } else {
-    error.store(5, std::memory_order_release);
+    cv.notify_all();
+    Py_BEGIN_ALLOW_THREADS
+      for (auto& x : leaving) x.join();
+    Py_END_ALLOW_THREADS
   }
-  /* Release the thread. No Python API allowed beyond this point. */
-  PyGILState_Release(gstate);
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopped = true;
+    }
+    cv.notify_all();
+  }
+
+  /* with the GIL; the error message of a failed batch, or nullptr. the
+   * workers are taken out under mtx, so that a resume or another join from
+   * another Python thread does not touch them while they are joined. */
+  const char* join() {
+    Py_BEGIN_ALLOW_THREADS
+      std::vector<std::thread> joined;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        joining = true;
+        joined.swap(threads);
+      }
+      for (auto& x : joined) x.join();
+      // another join may have taken them; wait for them to end all the same
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return live == 0; });
+      }
+    Py_END_ALLOW_THREADS
+    const unsigned short err = error.load(std::memory_order_acquire);
+    return err != 0 ? err_msg[err - 1] : nullptr;
+  }
+};
+
+struct TrainingObject {
+  PyObject_HEAD
+  AsyncTrainKB* training;
+};
+
+static AsyncTrainKB& training(PyObject* self) { return *reinterpret_cast<TrainingObject*>(self)->training; }
+
+static PyObject* Training_batches(PyObject *self, PyObject *args) {
+  return PyLong_FromLongLong(training(self).batches());
 }
 
-static PyObject* glimvec_trainKB(PyObject *self, PyObject *args, PyObject *keywds) {
+static PyObject* Training_throughput(PyObject *self, PyObject *args) {
+  return PyFloat_FromDouble(training(self).throughput());
+}
+
+static PyObject* Training_para(PyObject *self, PyObject *args) {
+  return PyLong_FromUnsignedLong(training(self).para());
+}
+
+static PyObject* Training_running(PyObject *self, PyObject *args) {
+  return PyBool_FromLong(training(self).running());
+}
+
+static PyObject* Training_pause(PyObject *self, PyObject *args) {
+  training(self).pause();
+  Py_RETURN_NONE;
+}
+
+static PyObject* Training_resume(PyObject *self, PyObject *args, PyObject *keywds) {
+  int para = 0;
+
+  static const char *kwlist[] = {"para", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "|i", (char**)kwlist,
+                                   &para))
+    return nullptr;
+
+  if (para < 0) {
+    PyErr_SetString(PyExc_ValueError, "para should be positive");
+    return nullptr;
+  }
+  training(self).resume(para);
+  Py_RETURN_NONE;
+}
+
+static PyObject* Training_stop(PyObject *self, PyObject *args) {
+  training(self).stop();
+  Py_RETURN_NONE;
+}
+
+static PyObject* Training_join(PyObject *self, PyObject *args) {
+  AsyncTrainKB& t = training(self);
+  // paused workers never finish, unless stopped
+  if (t.isPaused() && !t.isStopped() && t.running()) {
+    PyErr_SetString(PyExc_RuntimeError, "resume or stop the training first");
+    return nullptr;
+  }
+  if (const char* msg = t.join()) {
+    PyErr_SetString(PyExc_ValueError, msg);
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+static void Training_dealloc(PyObject* self) {
+  delete reinterpret_cast<TrainingObject*>(self)->training;
+  PyTypeObject* tp = Py_TYPE(self);
+  tp->tp_free(self);
+  Py_DECREF(tp);
+}
+
+static PyMethodDef Training_methods[] = {
+    {"batches",  (PyCFunction)Training_batches, METH_NOARGS, "Batches done so far."},
+    {"throughput",  (PyCFunction)Training_throughput, METH_NOARGS, "Batches per second since the last call."},
+    {"para",  (PyCFunction)Training_para, METH_NOARGS, "Number of workers."},
+    {"running",  (PyCFunction)Training_running, METH_NOARGS, "Whether any worker has not finished."},
+    {"pause",  (PyCFunction)Training_pause, METH_NOARGS, "Pause the workers after their current batches."},
+    {"resume",  (PyCFunction)Training_resume, METH_VARARGS | METH_KEYWORDS,
+     "Resume the workers, para of them if given."},
+    {"stop",  (PyCFunction)Training_stop, METH_NOARGS, "Stop the workers after their current batches."},
+    {"join",  (PyCFunction)Training_join, METH_NOARGS, "Wait for the workers to finish."},
+    {nullptr, nullptr, 0, nullptr}        /* Sentinel */
+};
+
+static PyType_Slot Training_slots[] = {
+    {Py_tp_methods, reinterpret_cast<void*>(Training_methods)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(&Training_dealloc)},
+    {0, nullptr}
+};
+
+static PyType_Spec Training_spec = {
+    "glimvec.Training", sizeof(TrainingObject), 0, Py_TPFLAGS_DEFAULT, Training_slots
+};
+
+static PyObject* Training_type = nullptr;
+
+static PyObject* glimvec_startTrainKB(PyObject *self, PyObject *args, PyObject *keywds) {
   PyObject* func = nullptr;
   long long numBatches = 100000;
   int para = 2;
@@ -144,25 +471,173 @@ static PyObject* glimvec_trainKB(PyObject *self, PyObject *args, PyObject *keywd
     PyErr_SetString(PyExc_TypeError, "parameter must be callable");
     return nullptr;
   }
-  Py_INCREF(func);
+  if (para <= 0) {
+    PyErr_SetString(PyExc_ValueError, "para should be positive");
+    return nullptr;
+  }
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return nullptr;
+  }
+  PyObject* obj = PyType_GenericAlloc(reinterpret_cast<PyTypeObject*>(Training_type), 0);
+  if (!obj) return nullptr;
+  reinterpret_cast<TrainingObject*>(obj)->training = new AsyncTrainKB(ptrain, func, numBatches, para);
+  return obj;
+}
+
+static PyObject* glimvec_trainKB(PyObject *self, PyObject *args, PyObject *keywds) {
+  RefPyObj handle(glimvec_startTrainKB(self, args, keywds));
+  if (!handle) return nullptr;
+  return Training_join(handle, nullptr);
+}
+
+/* a 1-d array of integers from the buffer protocol, e.g. a numpy array,
+ * read in place. */
+class IntBuffer {
+  Py_buffer view;
+  bool held = false;
+  char type = 0;
+
+public:
+  IntBuffer() = default;
+  IntBuffer(const IntBuffer& that) = delete;
+  IntBuffer& operator=(const IntBuffer& that) = delete;
+  ~IntBuffer() { if (held) PyBuffer_Release(&view); }
+
+  // false, with a Python error set, if obj is not a contiguous 1-d integer array
+  bool get(PyObject* obj, const char* name) {
+    if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) return false;
+    held = true;
+    const char* fmt = view.format ? view.format : "B";
+    if (*fmt == '@' || *fmt == '=' || *fmt == '<') ++fmt;
+    type = *fmt;
+    if (view.ndim != 1 || fmt[1] != '\0' || std::string("bBhHiIlLqQ").find(type) == std::string::npos) {
+      PyErr_Format(PyExc_TypeError, "%s should be a 1-d array of integers", name);
+      return false;
+    }
+    return true;
+  }
+
+  Py_ssize_t size() const { return view.shape[0]; }
+
+  // negative values come out huge, and fail any range check
+  unsigned long long operator[](Py_ssize_t i) const {
+    const char* p = static_cast<const char*>(view.buf) + i * view.itemsize;
+    const bool sgn = type >= 'a';
+    switch (view.itemsize) {
+      case 1: return sgn ? static_cast<unsigned long long>(*reinterpret_cast<const int8_t*>(p)) : *reinterpret_cast<const uint8_t*>(p);
+      case 2: return sgn ? static_cast<unsigned long long>(*reinterpret_cast<const int16_t*>(p)) : *reinterpret_cast<const uint16_t*>(p);
+      case 4: return sgn ? static_cast<unsigned long long>(*reinterpret_cast<const int32_t*>(p)) : *reinterpret_cast<const uint32_t*>(p);
+      default: return sgn ? static_cast<unsigned long long>(*reinterpret_cast<const int64_t*>(p)) : *reinterpret_cast<const uint64_t*>(p);
+    }
+  }
+};
+
+/* batch b of the arrays has head heads[b] and the paths batchOffsets[b] up
+ * to batchOffsets[b + 1]; path p has the edges (rels[i], tails[i]) for i
+ * from pathOffsets[p] up to pathOffsets[p + 1]. */
+struct KBArrays {
+  IntBuffer heads;
+  IntBuffer batchOffsets;
+  IntBuffer pathOffsets;
+  IntBuffer rels;
+  IntBuffer tails;
+
+  // an error message, or nullptr if the arrays are consistent
+  const char* check(ent_index wsz, unsigned int rsz2) const {
+    const Py_ssize_t n = heads.size();
+    const Py_ssize_t np = pathOffsets.size() - 1;
+    if (batchOffsets.size() != n + 1 || np < 0 || batchOffsets[0] != 0 || batchOffsets[n] != static_cast<unsigned long long>(np))
+      return "batchOffsets should be 0, ..., len(pathOffsets) - 1, of length len(heads) + 1";
+    if (pathOffsets[0] != 0 || pathOffsets[np] != static_cast<unsigned long long>(rels.size()) || tails.size() != rels.size())
+      return "pathOffsets should be 0, ..., len(rels), and tails as long as rels";
+    for (Py_ssize_t b = 0; b != n; ++b) {
+      if (batchOffsets[b] > batchOffsets[b + 1]) return "batchOffsets should be non-decreasing";
+      if (heads[b] >= wsz) return "a head is out of range";
+    }
+    for (Py_ssize_t p = 0; p != np; ++p) {
+      if (pathOffsets[p] > pathOffsets[p + 1]) return "pathOffsets should be non-decreasing";
+    }
+    for (Py_ssize_t b = 0; b != n; ++b) {
+      if (pathOffsets[batchOffsets[b + 1]] - pathOffsets[batchOffsets[b]] > BatchKB::MAX_EDGES)
+        return "a batch should have at most 31 edges";
+    }
+    for (Py_ssize_t i = 0; i != rels.size(); ++i) {
+      if (rels[i] >= rsz2) return "a relation is out of range";
+      if (tails[i] >= wsz) return "a tail is out of range";
+    }
+    return nullptr;
+  }
+
+  void fill(Py_ssize_t b, BatchKB& batch) const {
+    batch.reset(heads[b]);
+    for (unsigned long long p = batchOffsets[b]; p != batchOffsets[b + 1]; ++p) {
+      for (unsigned long long i = pathOffsets[p]; i != pathOffsets[p + 1]; ++i) batch.push(rels[i], tails[i]);
+      batch.endPath();
+    }
+  }
+};
+
+static void glimvec_trainKBArrays_para(RandomGenerator rnd, TrainerKB* trainer, const KBArrays* arrays,
+                                       std::atomic_llong* next) {
+  // batches are taken a few at a time, to keep next off the critical path
+  constexpr long long CHUNK = 16;
+  const long long n = arrays->heads.size();
+  BatchKB b;
+  long long k;
+  while ((k = next->fetch_add(CHUNK, std::memory_order_relaxed)) < n) {
+    for (long long i = k; i != std::min(k + CHUNK, n); ++i) {
+      arrays->fill(i, b);
+      if (b.size != 0) trainer->update(rnd, b);
+    }
+  }
+}
+
+static PyObject* glimvec_trainKBArrays(PyObject *self, PyObject *args, PyObject *keywds) {
+  PyObject* objs[5];
+  int para = 2;
+
+  static const char *kwlist[] = {"heads", "batchOffsets", "pathOffsets", "rels", "tails", "para", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "OOOOO|i", (char**)kwlist,
+                                   &objs[0], &objs[1], &objs[2], &objs[3], &objs[4], &para))
+    return nullptr;
+
+  if (para <= 0) {
+    PyErr_SetString(PyExc_ValueError, "para should be positive");
+    return nullptr;
+  }
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return nullptr;
+  }
+  KBArrays arrays;
+  if (!arrays.heads.get(objs[0], "heads") || !arrays.batchOffsets.get(objs[1], "batchOffsets") ||
+      !arrays.pathOffsets.get(objs[2], "pathOffsets") || !arrays.rels.get(objs[3], "rels") ||
+      !arrays.tails.get(objs[4], "tails"))
+    return nullptr;
+  if (const char* msg = arrays.check(ptrain->numEntities(), ptrain->numRelations())) {
+    PyErr_SetString(PyExc_ValueError, msg);
+    return nullptr;
+  }
+
+  /* the buffers stay held, so the arrays are read in place without the GIL;
+   * the trainer and generators are taken first, as initTrainer may replace
+   * ptrain meanwhile */
+  std::shared_ptr<TrainerKB> trainer = ptrain;
+  std::vector<RandomGenerator> rnds;
+  rnds.reserve(para);
+  for (int i = 0; i != para; ++i) {
+    rg.jump();
+    rnds.push_back(rg);
+  }
   Py_BEGIN_ALLOW_THREADS
-    error.store(0, std::memory_order_release);
-    remained_batches.store(numBatches, std::memory_order_release);
+    std::atomic_llong next(0);
     std::vector<std::thread> threads;
     threads.reserve(para);
-    for (int i = 0; i != para; ++i) {
-      rg.jump();
-      threads.emplace_back(&glimvec_trainKB_para, i, rg, func);
-    }
+    for (const auto& rnd : rnds) threads.emplace_back(&glimvec_trainKBArrays_para, rnd, trainer.get(), &arrays, &next);
     for (auto& x : threads) x.join();
   Py_END_ALLOW_THREADS
-  Py_DECREF(func);
-
-  unsigned short err = error.load(std::memory_order_acquire);
-  if (err != 0) {
-    PyErr_SetString(PyExc_ValueError, err_msg[err - 1]);
-    return nullptr;
-  }
 
   Py_RETURN_NONE;
 }
@@ -179,15 +654,356 @@ static PyObject* glimvec_saveModel(PyObject *self, PyObject *args, PyObject *key
   std::string outpathStr;
   if (outpath) outpathStr = std::string(outpath);
 
-  ptrain->saveModel(outpathStr);
+  if (!glimvec_save([&](TrainerKB& t) { t.saveModel(outpathStr); })) return nullptr;
 
   Py_RETURN_NONE;
 }
 
+static PyObject* glimvec_saveBase(PyObject *self, PyObject *args, PyObject *keywds) {
+  const char* prefix = nullptr;
+
+  static const char *kwlist[] = {"prefix", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "|s", (char**)kwlist,
+                                   &prefix))
+    return nullptr;
+
+  std::string prefixStr;
+  if (prefix) prefixStr = std::string(prefix);
+
+  if (!glimvec_save([&](TrainerKB& t) { t.saveBase(prefixStr); })) return nullptr;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* glimvec_saveDelta(PyObject *self, PyObject *args, PyObject *keywds) {
+  const char* prefix = nullptr;
+
+  static const char *kwlist[] = {"prefix", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "|s", (char**)kwlist,
+                                   &prefix))
+    return nullptr;
+
+  std::string prefixStr;
+  if (prefix) prefixStr = std::string(prefix);
+
+  size_t bytes = 0;
+  if (!glimvec_save([&](TrainerKB& t) { bytes = t.saveDelta(prefixStr); })) return nullptr;
+  return PyLong_FromSize_t(bytes);
+}
+
+/* a read-only float array over the parameters of a trainer, exported
+ * through the buffer protocol, e.g. to numpy.asarray. */
+struct ModelView {
+  PyObject_HEAD
+  std::shared_ptr<TrainerKB>* owner;
+  const float* data;
+  int ndim;
+  Py_ssize_t shape[3];
+  Py_ssize_t strides[3];
+};
+
+static int ModelView_getbuffer(PyObject* self, Py_buffer* view, int flags) {
+  auto* v = reinterpret_cast<ModelView*>(self);
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "the live model is read-only");
+    view->obj = nullptr;
+    return -1;
+  }
+  view->buf = const_cast<float*>(v->data);
+  view->obj = self;
+  Py_INCREF(self);
+  view->itemsize = sizeof(float);
+  view->len = view->itemsize;
+  for (int i = 0; i != v->ndim; ++i) view->len *= v->shape[i];
+  view->readonly = 1;
+  view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("f") : nullptr;
+  view->ndim = v->ndim;
+  view->shape = (flags & PyBUF_ND) ? v->shape : nullptr;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? v->strides : nullptr;
+  view->suboffsets = nullptr;
+  view->internal = nullptr;
+  return 0;
+}
+
+static void ModelView_dealloc(PyObject* self) {
+  delete reinterpret_cast<ModelView*>(self)->owner;
+  PyTypeObject* tp = Py_TYPE(self);
+  tp->tp_free(self);
+  Py_DECREF(tp);
+}
+
+static PyType_Slot ModelView_slots[] = {
+    {Py_bf_getbuffer, reinterpret_cast<void*>(&ModelView_getbuffer)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(&ModelView_dealloc)},
+    {0, nullptr}
+};
+
+static PyType_Spec ModelView_spec = {
+    "glimvec.ModelView", sizeof(ModelView), 0, Py_TPFLAGS_DEFAULT, ModelView_slots
+};
+
+static PyObject* ModelView_type = nullptr;
+
+static PyObject* glimvec_modelArrays(PyObject *self, PyObject *args) {
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return nullptr;
+  }
+  RefPyObj numpy(PyImport_ImportModule("numpy"));
+  if (!numpy) return nullptr;
+  RefPyObj ret(PyDict_New());
+  if (!ret) return nullptr;
+  for (const char* name : {"cvecs", "tvecs", "mats", "encoder", "decoder"}) {
+    std::vector<size_t> shape;
+    const float* data = ptrain->parameters(name, shape);
+    RefPyObj obj(PyType_GenericAlloc(reinterpret_cast<PyTypeObject*>(ModelView_type), 0));
+    if (!obj) return nullptr;
+    auto* v = reinterpret_cast<ModelView*>(static_cast<PyObject*>(obj));
+    v->owner = new std::shared_ptr<TrainerKB>(ptrain);
+    v->data = data;
+    v->ndim = static_cast<int>(shape.size());
+    Py_ssize_t stride = sizeof(float);
+    for (int i = v->ndim; i-- != 0;) {
+      v->shape[i] = static_cast<Py_ssize_t>(shape[i]);
+      v->strides[i] = stride;
+      stride *= v->shape[i];
+    }
+    RefPyObj arr(PyObject_CallMethod(numpy, "asarray", "O", static_cast<PyObject*>(obj)));
+    if (!arr || PyDict_SetItemString(ret, name, arr) != 0) return nullptr;
+  }
+  PyObject* r = ret;
+  Py_INCREF(r);
+  return r;
+}
+
+/* a new numpy array of dtype holding a copy of data, of rows items, or of
+ * rows x cols with cols > 0. */
+static PyObject* numpyCopy(const void* data, Py_ssize_t rows, Py_ssize_t cols, const char* dtype, size_t itemsize) {
+  RefPyObj numpy(PyImport_ImportModule("numpy"));
+  if (!numpy) return nullptr;
+  RefPyObj bytes(PyByteArray_FromStringAndSize(static_cast<const char*>(data),
+                                               rows * std::max<Py_ssize_t>(cols, 1) * itemsize));
+  if (!bytes) return nullptr;
+  RefPyObj arr(PyObject_CallMethod(numpy, "frombuffer", "Os", static_cast<PyObject*>(bytes), dtype));
+  if (!arr || cols <= 0) {
+    PyObject* r = arr;
+    Py_XINCREF(r);
+    return r;
+  }
+  return PyObject_CallMethod(arr, "reshape", "(nn)", rows, cols);
+}
+
+static PyObject* glimvec_stepCounts(PyObject *self, PyObject *args) {
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return nullptr;
+  }
+  std::vector<unsigned long long> vsteps, msteps;
+  unsigned long long dstep;
+  std::shared_ptr<TrainerKB> t = ptrain;
+  Py_BEGIN_ALLOW_THREADS
+    t->stepCounts(vsteps, msteps, dstep);
+  Py_END_ALLOW_THREADS
+
+  RefPyObj numpy(PyImport_ImportModule("numpy"));
+  if (!numpy) return nullptr;
+  RefPyObj vs(numpyCopy(vsteps.data(), vsteps.size(), 0, "uint64", sizeof(unsigned long long)));
+  RefPyObj ms(numpyCopy(msteps.data(), msteps.size(), 0, "uint64", sizeof(unsigned long long)));
+  RefPyObj ds(PyObject_CallMethod(numpy, "uint64", "K", dstep));
+  if (!vs || !ms || !ds) return nullptr;
+  return Py_BuildValue("{sOsOsO}", "vsteps", static_cast<PyObject*>(vs),
+                       "msteps", static_cast<PyObject*>(ms), "dstep", static_cast<PyObject*>(ds));
+}
+
+static PyObject* glimvec_params(PyObject *self, PyObject *args) {
+  if (!ptrain) {
+    PyErr_SetString(PyExc_RuntimeError, "initTrainer first");
+    return nullptr;
+  }
+  RefPyObj json(PyImport_ImportModule("json"));
+  if (!json) return nullptr;
+  return PyObject_CallMethod(json, "loads", "s", ptrain->paramsJson().c_str());
+}
+
+/* a QueryKB over numpy arrays of a model in the normalized form of
+ * ModelKB.py, whose buffers are held as long as the engine. */
+struct QueryObject {
+  PyObject_HEAD
+  QueryKB* query;
+  Py_buffer views[3];
+  int held;
+};
+
+static void Query_dealloc(PyObject* self) {
+  auto* q = reinterpret_cast<QueryObject*>(self);
+  delete q->query;
+  for (int i = 0; i != q->held; ++i) PyBuffer_Release(&q->views[i]);
+  PyTypeObject* tp = Py_TYPE(self);
+  tp->tp_free(self);
+  Py_DECREF(tp);
+}
+
+// false, with a Python error set, if obj is not a sequence of str
+static bool stringList(PyObject* obj, const char* name, std::vector<std::string>& out) {
+  RefPyObj seq(PySequence_Fast(obj, name));
+  if (!seq) return false;
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(static_cast<PyObject*>(seq));
+  out.reserve(n);
+  for (Py_ssize_t i = 0; i != n; ++i) {
+    const char* str = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(static_cast<PyObject*>(seq), i));
+    if (!str) return false;
+    out.emplace_back(str);
+  }
+  return true;
+}
+
+static bool compileQueries(PyObject* self, PyObject* exprs, QueryKB::Plan& plan) {
+  std::vector<std::string> strs;
+  if (!stringList(exprs, "exprs should be a list of str", strs)) return false;
+  try {
+    plan = reinterpret_cast<QueryObject*>(self)->query->compile(strs);
+  } catch (const std::invalid_argument& e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+    return false;
+  }
+  return true;
+}
+
+static PyObject* Query_calc(PyObject *self, PyObject *args, PyObject *keywds) {
+  PyObject* exprs = nullptr;
+
+  static const char *kwlist[] = {"exprs", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "O", (char**)kwlist,
+                                   &exprs))
+    return nullptr;
+
+  QueryKB::Plan plan;
+  if (!compileQueries(self, exprs, plan)) return nullptr;
+  Eigen::MatrixXf vecs;
+  Py_BEGIN_ALLOW_THREADS
+    reinterpret_cast<QueryObject*>(self)->query->evaluate(plan, vecs);
+  Py_END_ALLOW_THREADS
+  return numpyCopy(vecs.data(), vecs.cols(), vecs.rows(), "float32", sizeof(float));
+}
+
+static PyObject* Query_top(PyObject *self, PyObject *args, PyObject *keywds) {
+  PyObject* exprs = nullptr;
+  Py_ssize_t k = 10;
+  int contexts = 0;
+
+  static const char *kwlist[] = {"exprs", "k", "contexts", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|np", (char**)kwlist,
+                                   &exprs, &k, &contexts))
+    return nullptr;
+
+  if (k <= 0) {
+    PyErr_SetString(PyExc_ValueError, "k should be positive");
+    return nullptr;
+  }
+  QueryKB::Plan plan;
+  if (!compileQueries(self, exprs, plan)) return nullptr;
+  Eigen::Matrix<ent_index, Eigen::Dynamic, Eigen::Dynamic> indices;
+  Eigen::MatrixXf scores;
+  Py_BEGIN_ALLOW_THREADS
+    reinterpret_cast<QueryObject*>(self)->query->top(plan, k, contexts, indices, scores);
+  Py_END_ALLOW_THREADS
+  RefPyObj is(numpyCopy(indices.data(), indices.cols(), indices.rows(), "uint64", sizeof(ent_index)));
+  RefPyObj ss(numpyCopy(scores.data(), scores.cols(), scores.rows(), "float32", sizeof(float)));
+  if (!is || !ss) return nullptr;
+  return Py_BuildValue("(OO)", static_cast<PyObject*>(is), static_cast<PyObject*>(ss));
+}
+
+static PyObject* Query_cachedProducts(PyObject *self, PyObject *args) {
+  return PyLong_FromSize_t(reinterpret_cast<QueryObject*>(self)->query->cachedProducts());
+}
+
+static PyMethodDef Query_methods[] = {
+    {"calc",  (PyCFunction)Query_calc, METH_VARARGS | METH_KEYWORDS,
+     "The vectors of a list of expressions, as ModelKB.calc, one row each."},
+    {"top",  (PyCFunction)Query_top, METH_VARARGS | METH_KEYWORDS,
+     "Indices and scores of the k best tvecs (or cvecs, with contexts) for each expression."},
+    {"cachedProducts",  (PyCFunction)Query_cachedProducts, METH_NOARGS, "Number of cached chain products."},
+    {nullptr, nullptr, 0, nullptr}        /* Sentinel */
+};
+
+static PyType_Slot Query_slots[] = {
+    {Py_tp_methods, reinterpret_cast<void*>(Query_methods)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(&Query_dealloc)},
+    {0, nullptr}
+};
+
+static PyType_Spec Query_spec = {
+    "glimvec.QueryKB", sizeof(QueryObject), 0, Py_TPFLAGS_DEFAULT, Query_slots
+};
+
+static PyObject* Query_type = nullptr;
+
+static PyObject* glimvec_queryKB(PyObject *self, PyObject *args, PyObject *keywds) {
+  PyObject* objs[3];
+  PyObject* words = nullptr;
+  PyObject* roles = nullptr;
+  Py_ssize_t cacheSize = 256;
+
+  static const char *kwlist[] = {"tvecs", "cvecs", "mats", "words", "roles", "cacheSize", nullptr};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "OOOOO|n", (char**)kwlist,
+                                   &objs[0], &objs[1], &objs[2], &words, &roles, &cacheSize))
+    return nullptr;
+
+  std::vector<std::string> wordStrs, roleStrs;
+  if (!stringList(words, "words should be a list of str", wordStrs) ||
+      !stringList(roles, "roles should be a list of str", roleStrs))
+    return nullptr;
+  RefPyObj obj(PyType_GenericAlloc(reinterpret_cast<PyTypeObject*>(Query_type), 0));
+  if (!obj) return nullptr;
+  auto* q = reinterpret_cast<QueryObject*>(static_cast<PyObject*>(obj));
+  static const char* names[] = {"tvecs", "cvecs", "mats"};
+  for (int i = 0; i != 3; ++i) {
+    if (PyObject_GetBuffer(objs[i], &q->views[i], PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) return nullptr;
+    ++q->held;
+    const Py_buffer& v = q->views[i];
+    const char* fmt = v.format ? v.format : "B";
+    if (*fmt == '@' || *fmt == '=' || *fmt == '<') ++fmt;
+    const int ndim = i == 2 ? 3 : 2;
+    if (std::string(fmt) != "f" || v.ndim != ndim || v.shape[ndim - 1] != DIM || (ndim == 3 && v.shape[1] != DIM)) {
+      PyErr_Format(PyExc_TypeError, "%s should be a float32 array of the shape saved", names[i]);
+      return nullptr;
+    }
+  }
+  const Py_ssize_t wsz = q->views[0].shape[0];
+  const Py_ssize_t rsz2 = q->views[2].shape[0];
+  if (q->views[1].shape[0] != wsz || static_cast<Py_ssize_t>(wordStrs.size()) > wsz ||
+      static_cast<Py_ssize_t>(roleStrs.size()) > rsz2) {
+    PyErr_SetString(PyExc_ValueError, "tvecs, cvecs and words, or mats and roles, do not match");
+    return nullptr;
+  }
+  q->query = new QueryKB(static_cast<const float*>(q->views[0].buf), static_cast<const float*>(q->views[1].buf),
+                         static_cast<const float*>(q->views[2].buf), wsz, rsz2, wordStrs, roleStrs, cacheSize);
+  PyObject* r = obj;
+  Py_INCREF(r);
+  return r;
+}
+
 static PyMethodDef GlimvecMethods[] = {
     {"initTrainer",  (PyCFunction)glimvec_initTrainer, METH_VARARGS | METH_KEYWORDS, "Init Trainer."},
     {"trainKB",  (PyCFunction)glimvec_trainKB, METH_VARARGS | METH_KEYWORDS, "Train Model from Knowledge Base."},
+    {"startTrainKB",  (PyCFunction)glimvec_startTrainKB, METH_VARARGS | METH_KEYWORDS,
+     "Start training as trainKB does, on threads of its own; returns a Training handle."},
+    {"trainKBArrays",  (PyCFunction)glimvec_trainKBArrays, METH_VARARGS | METH_KEYWORDS,
+     "Train on a block of batches given as integer arrays: heads, batchOffsets, pathOffsets, rels, tails."},
+    {"modelArrays",  (PyCFunction)glimvec_modelArrays, METH_NOARGS,
+     "Read-only numpy arrays over the live cvecs, tvecs, mats, encoder and decoder."},
+    {"stepCounts",  (PyCFunction)glimvec_stepCounts, METH_NOARGS, "Copies of vsteps, msteps and dstep."},
+    {"params",  (PyCFunction)glimvec_params, METH_NOARGS, "The params of the model, as in params.json."},
+    {"queryKB",  (PyCFunction)glimvec_queryKB, METH_VARARGS | METH_KEYWORDS,
+     "A query engine over the tvecs, cvecs and mats of a ModelKB, with its words and roles."},
     {"saveModel",  (PyCFunction)glimvec_saveModel, METH_VARARGS | METH_KEYWORDS, "Save Model."},
+    {"saveBase",  (PyCFunction)glimvec_saveBase, METH_VARARGS | METH_KEYWORDS, "Save Model as the base of deltas."},
+    {"saveDelta",  (PyCFunction)glimvec_saveDelta, METH_VARARGS | METH_KEYWORDS, "Save changes since the last save."},
     {nullptr, nullptr, 0, nullptr}        /* Sentinel */
 };
 
@@ -201,5 +1017,11 @@ static struct PyModuleDef glimvec = {
 };
 
 PyMODINIT_FUNC PyInit_glimvec() {
+  ModelView_type = PyType_FromSpec(&ModelView_spec);
+  if (!ModelView_type) return nullptr;
+  Training_type = PyType_FromSpec(&Training_spec);
+  if (!Training_type) return nullptr;
+  Query_type = PyType_FromSpec(&Query_spec);
+  if (!Query_type) return nullptr;
   return PyModule_Create(&glimvec);
 }
\ No newline at end of file
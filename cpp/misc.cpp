@@ -1,5 +1,7 @@
 #include "misc.h"
 
+#include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 using namespace misc;
@@ -23,31 +25,31 @@ bool misc::isLittleEndian() {
   return x.s == 1;
 }
 
-NpyHeader misc::readNpyHeader(istream &is) {
-  assert(is.get() == 0x93);
-  assert(is.get() == 'N');
-  assert(is.get() == 'U');
-  assert(is.get() == 'M');
-  assert(is.get() == 'P');
-  assert(is.get() == 'Y');
-  assert(is.get() == 0x01);
-  assert(is.get() == 0x00);
-
-  char* buf;
-  buf = new char[2];
-  is.read(buf, 2);
-  auto dict_sz = fromBytes<uint16_t, const char*>(buf, buf + 2, isLittleEndian());
-  delete[] buf;
-  buf = new char[dict_sz];
-  is.read(buf, dict_sz);
-  string dict(buf, dict_sz);
-  delete[] buf;
-  assert(dict.back() == '\n');
-
-  vector<unsigned int> shape;
+string misc::countString(unsigned long long n) {
+  string s = to_string(n);
+  if (n < 10000000ULL) return s + ".0";
+  const int exp = static_cast<int>(s.size()) - 1;
+  s.erase(s.find_last_not_of('0') + 1);
+  string ret(1, s[0]);
+  ret += '.';
+  ret += s.size() == 1 ? string("0") : s.substr(1);
+  return ret + "E" + to_string(exp);
+}
+
+NpyHeader misc::readNpyHeader(istream &is, const string &fn) {
+  static const char magic[] = {'\x93', 'N', 'U', 'M', 'P', 'Y', '\x01', '\x00'};
+  char head[10];
+  if (!is.read(head, sizeof(head)) || !equal(magic, magic + sizeof(magic), head))
+    throw runtime_error(fn + " is not an npy file of version 1.0");
+  const auto dict_sz = fromBytes<uint16_t, const char*>(head + 8, head + 10, isLittleEndian());
+  string dict(dict_sz, '\0');
+  if (!is.read(&dict[0], dict_sz) || dict.empty() || dict.back() != '\n')
+    throw runtime_error(fn + ": truncated npy header");
+
+  vector<unsigned long long> shape;
   for (const string& x : split(getField(dict, "shape", "'\": (\t\n", ")"), ',')) {
     string tmp = getField(x, "", " \t\n", " \t\n");
-    if (!tmp.empty()) shape.push_back(stoi(tmp));
+    if (!tmp.empty()) shape.push_back(stoull(tmp));
   }
 
   return NpyHeader {
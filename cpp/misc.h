@@ -9,7 +9,12 @@
 #include <typeinfo>
 #include <utility>
 #include <initializer_list>
+#include <stdexcept>
 #include <cassert>
+#include <cstddef>
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#endif
 
 #ifdef DEBUG
 constexpr bool DEBUG_TEST = true;
@@ -46,6 +51,21 @@ namespace misc {
 
   bool isLittleEndian();
 
+  // a whole count as the vocab files hold it, java's Double.toString: "424.0", "1.2E7"
+  std::string countString(unsigned long long n);
+
+  // hints that [p, p + bytes) will be read soon
+  inline void prefetch(const void* p, size_t bytes) {
+    const char* c = static_cast<const char*>(p);
+    for (size_t k = 0; k < bytes; k += 64) {
+#ifdef _MSC_VER
+      _mm_prefetch(c + k, _MM_HINT_T0);
+#else
+      __builtin_prefetch(c + k);
+#endif
+    }
+  }
+
   template <typename T>
   std::string toBytes(T x, bool bytesOrder) {
     const void* p = &x;
@@ -111,7 +131,7 @@ namespace misc {
   }
 
   template <typename T>
-  std::string createNpyHeader(bool fortran_order, std::initializer_list<unsigned int> ds) {
+  std::string createNpyHeader(bool fortran_order, std::initializer_list<unsigned long long> ds) {
     std::string dict;
     dict += "{'descr': '";
     dict += numpy_dtype<T>();
@@ -132,8 +152,9 @@ namespace misc {
       }
     }
     dict += ") }";
-    //pad with spaces so that header size is modulo 16 bytes. dict needs to end with \n
-    dict.append(15 - (dict.size() + 10) % 16, ' ');
+    //pad with spaces so that header size is modulo 64 bytes, and the data can be
+    //viewed in place with cache line alignment. dict needs to end with \n
+    dict.append(63 - (dict.size() + 10) % 64, ' ');
     dict += '\n';
 
     std::string header;
@@ -150,20 +171,25 @@ namespace misc {
   struct NpyHeader {
     std::string dtype;
     bool fortran_order;
-    std::vector<unsigned int> shape;
+    std::vector<unsigned long long> shape;
   };
 
-  NpyHeader readNpyHeader(std::istream& is);
+  // throws runtime_error naming fn if is does not start with an npy header
+  NpyHeader readNpyHeader(std::istream& is, const std::string& fn);
 
+  // throws runtime_error naming fn unless the array is of T, in C order, of shape ds
   template <typename T>
-  void checkNpyHeader(std::istream& is, std::initializer_list<unsigned int> ds) {
-    NpyHeader header = readNpyHeader(is);
-    assert(header.dtype == numpy_dtype<T>());
-    assert(header.shape.size() == ds.size());
-    auto it = header.shape.cbegin();
-    for (unsigned int d : ds) {
-      assert(d == *it);
-      ++it;
+  void checkNpyHeader(std::istream& is, std::initializer_list<unsigned long long> ds, const std::string& fn) {
+    const NpyHeader header = readNpyHeader(is, fn);
+    if (header.dtype != numpy_dtype<T>())
+      throw std::runtime_error(fn + ": dtype " + header.dtype + ", expected " + numpy_dtype<T>());
+    if (header.fortran_order) throw std::runtime_error(fn + ": fortran order is not supported");
+    if (header.shape != std::vector<unsigned long long>(ds)) {
+      std::string expected;
+      for (unsigned long long d : ds) expected += std::to_string(d) + ",";
+      std::string found;
+      for (unsigned long long d : header.shape) found += std::to_string(d) + ",";
+      throw std::runtime_error(fn + ": shape (" + found + "), expected (" + expected + ")");
     }
   }
 }
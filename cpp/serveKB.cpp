@@ -0,0 +1,353 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "optparse.h"
+#include "ReaderLines.h"
+#include "TrainerKB.h"
+#include "ScoreProtocol.h"
+
+using namespace std;
+
+class option : public optparse {
+public:
+  bool help = false;
+
+  unsigned int threads = 1;
+  unsigned int maxBatch = 64;
+  unsigned int budget = 1000;
+  double report = 10.0;
+
+  BEGIN_OPTION_MAP()
+    ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
+      help = true;
+    ON_OPTION_WITH_ARG(LONGOPT("threads"))
+      threads = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("maxBatch"))
+      maxBatch = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("budget"))
+      budget = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("report"))
+      report = stod(arg);
+
+  END_OPTION_MAP()
+};
+
+typedef chrono::steady_clock Clock;
+
+static bool read_full(int fd, void* buf, size_t n) {
+  char* p = static_cast<char*>(buf);
+  while (n != 0) {
+    const ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t n) {
+  const char* p = static_cast<const char*>(buf);
+  while (n != 0) {
+    const ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+// a client; closed when the last request of it in flight is answered
+struct Conn {
+  int fd;
+  mutex write_mtx;
+  explicit Conn(int fd) : fd(fd) {}
+  ~Conn() { close(fd); }
+  void send(const vector<char>& buf) {
+    lock_guard<mutex> lock(write_mtx);
+    write_full(fd, buf.data(), buf.size()); // a gone client is noticed by its reader
+  }
+};
+
+struct Pending {
+  shared_ptr<Conn> conn;
+  ScoreRequest req;
+  Clock::time_point arrived;
+};
+
+static volatile sig_atomic_t signaled = 0;
+static atomic_bool stopping(false);
+static mutex pending_mtx;
+static condition_variable pending_cv;
+static deque<Pending> pending;
+
+// latencies since the last report, and totals since start
+static mutex stats_mtx;
+static vector<float> window_lats; // ms
+static unsigned long long window_batches = 0;
+static unsigned long long total_requests = 0;
+static unsigned long long total_batches = 0;
+
+static void on_signal(int) { signaled = 1; }
+
+static vector<char> reply(const ScoreRequest& req, ScoreStatus status, const ent_index* idx, const float* sc,
+                          size_t n) {
+  vector<char> buf(sizeof(ScoreReply) + n * sizeof(ScoreAnswer));
+  ScoreReply rep {req.id, status, static_cast<uint32_t>(n)};
+  memcpy(buf.data(), &rep, sizeof(rep));
+  for (size_t j = 0; j != n; ++j) {
+    ScoreAnswer a {idx[j], sc[j], 0};
+    memcpy(buf.data() + sizeof(rep) + j * sizeof(a), &a, sizeof(a));
+  }
+  return buf;
+}
+
+// the reader thread of a client, joined by the acceptor once done
+struct Reader {
+  thread th;
+  weak_ptr<Conn> conn;
+  atomic_bool done;
+  explicit Reader(const shared_ptr<Conn>& conn) : conn(conn), done(false) {}
+};
+
+static void read_requests(const shared_ptr<Conn>& conn, ent_index wsz, unsigned int rsz) {
+  const ScoreHello hello {SCORE_MAGIC, rsz, wsz};
+  if (!write_full(conn->fd, &hello, sizeof(hello))) return;
+  ScoreRequest req;
+  while (read_full(conn->fd, &req, sizeof(req))) {
+    ScoreStatus status = SCORE_OK;
+    if (req.entity >= wsz) status = SCORE_BAD_ENTITY;
+    else if (req.relation >= rsz || req.direction > 1) status = SCORE_BAD_RELATION;
+    else if (req.k == 0 || req.k > SCORE_MAX_K) status = SCORE_BAD_K;
+    if (status != SCORE_OK) {
+      conn->send(reply(req, status, nullptr, nullptr, 0));
+      continue;
+    }
+    {
+      lock_guard<mutex> lock(pending_mtx);
+      pending.push_back(Pending {conn, req, Clock::now()});
+    }
+    pending_cv.notify_one();
+  }
+}
+
+static void read_para(Reader* self, shared_ptr<Conn> conn, ent_index wsz, unsigned int rsz) {
+  read_requests(conn, wsz, rsz);
+  conn.reset();
+  self->done = true;
+}
+
+// joins the readers whose clients have gone, so that their stacks are freed
+static void reap_readers(vector<unique_ptr<Reader>>& readers) {
+  readers.erase(remove_if(readers.begin(), readers.end(), [](const unique_ptr<Reader>& x) {
+    if (!x->done) return false;
+    x->th.join();
+    return true;
+  }), readers.end());
+}
+
+/* takes the pending requests as a batch once there are maxBatch of them, or
+ * once the oldest has waited the budget, and scores them in one pass over
+ * cvecs. */
+static void score_para(const TrainerKB* ptrain, unsigned int rsz, unsigned int maxBatch,
+                       chrono::microseconds budget) {
+  vector<Pending> batch;
+  vector<pair<ent_index, unsigned int>> queries;
+  Eigen::Matrix<ent_index, Eigen::Dynamic, Eigen::Dynamic> indices;
+  Eigen::MatrixXf scores;
+  vector<float> lats;
+  while (true) {
+    bool more;
+    {
+      unique_lock<mutex> lock(pending_mtx);
+      pending_cv.wait(lock, [] { return !pending.empty() || stopping; });
+      if (pending.empty()) return;
+      const auto deadline = pending.front().arrived + budget;
+      pending_cv.wait_until(lock, deadline, [=] { return pending.size() >= maxBatch || stopping; });
+      if (pending.empty()) continue; // taken by another scorer
+      const size_t n = min<size_t>(pending.size(), maxBatch);
+      batch.assign(make_move_iterator(pending.begin()), make_move_iterator(pending.begin() + n));
+      pending.erase(pending.begin(), pending.begin() + n);
+      more = !pending.empty();
+    }
+    if (more) pending_cv.notify_one();
+
+    queries.clear();
+    size_t k = 0;
+    for (const auto& x : batch) {
+      queries.emplace_back(x.req.entity, x.req.direction ? x.req.relation : x.req.relation + rsz);
+      k = max<size_t>(k, x.req.k);
+    }
+    ptrain->topTails(queries, k, indices, scores);
+    lats.clear();
+    for (size_t q = 0; q != batch.size(); ++q) {
+      const size_t n = min<size_t>(batch[q].req.k, indices.rows());
+      batch[q].conn->send(reply(batch[q].req, SCORE_OK, indices.col(q).data(), scores.col(q).data(), n));
+      lats.push_back(chrono::duration<float, milli>(Clock::now() - batch[q].arrived).count());
+    }
+    batch.clear();
+
+    lock_guard<mutex> lock(stats_mtx);
+    window_lats.insert(window_lats.end(), lats.cbegin(), lats.cend());
+    ++window_batches;
+    total_requests += lats.size();
+    ++total_batches;
+  }
+}
+
+static float percentile(const vector<float>& sorted, double p) {
+  return sorted.empty() ? 0.0f : sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static void report_stats(double secs) {
+  vector<float> lats;
+  unsigned long long batches;
+  {
+    lock_guard<mutex> lock(stats_mtx);
+    lats.swap(window_lats);
+    batches = window_batches;
+    window_batches = 0;
+  }
+  sort(lats.begin(), lats.end());
+  char buf[160];
+  snprintf(buf, sizeof(buf), "%.0f QPS\tp50 %.3f ms\tp99 %.3f ms\tbatch %.1f", lats.size() / secs,
+           percentile(lats, 0.5), percentile(lats, 0.99), batches == 0 ? 0.0 : static_cast<double>(lats.size()) / batches);
+  cerr << buf << endl;
+}
+
+static size_t count_lines(const string& fn) {
+  size_t ret = 0;
+  ReaderLines lines(fn);
+  for (; !lines.empty(); lines.next()) ++ret;
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  try {
+    option opt;
+    int argpos = opt.parse(argv, argc);
+    if (opt.help) {
+      cout << "Serve link prediction queries on a trained model over a Unix domain socket." << endl
+           << "  serveKB [OPTION...] VOCAB_ENTITY VOCAB_RELATION MODEL_PATH SOCKET" << endl
+           << endl << "positional arguments:" << endl
+           << "  VOCAB_ENTITY    counts of entities" << endl
+           << "  VOCAB_RELATION  counts of relations" << endl
+           << "  MODEL_PATH      trained model (npy files or model file), mapped in place" << endl
+           << "  SOCKET          path of the socket to listen on, replaced if it exists" << endl
+           << endl << "optional arguments:" << endl
+           << "  -h, --help      show this help message and exit" << endl
+           << "  --threads       scoring threads (default: 1)" << endl
+           << "  --maxBatch      most queries scored together (default: 64)" << endl
+           << "  --budget        microseconds a query may wait for others to batch with (default: 1000)" << endl
+           << "  --report        seconds between reports of QPS, p50 and p99 latency (default: 10)" << endl
+           << endl << "the protocol is in ScoreProtocol.h; SIGINT or SIGTERM stops the server." << endl
+          ;
+      return 0;
+    }
+    if (argc - argpos != 4) throw runtime_error("wrong number of arguments");
+    if (opt.threads == 0 || opt.maxBatch == 0) throw runtime_error("--threads and --maxBatch must be positive");
+    const string sock_path(argv[argpos + 3]);
+
+    const auto load_start = Clock::now();
+    const ent_index wsz = count_lines(argv[argpos]);
+    const unsigned int rsz = static_cast<unsigned int>(count_lines(argv[argpos + 1]));
+    TrainerKB trainer;
+    trainer.mapModel(wsz, rsz, argv[argpos + 2]);
+    cerr << "loaded in " << chrono::duration<double>(Clock::now() - load_start).count() << " s" << endl;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sock_path.size() >= sizeof(addr.sun_path)) throw runtime_error("socket path too long: " + sock_path);
+    strcpy(addr.sun_path, sock_path.c_str());
+    const int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) throw runtime_error("cannot create socket");
+    unlink(sock_path.c_str());
+    if (::bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(lfd, 128) != 0)
+      throw runtime_error("cannot listen on " + sock_path);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    vector<thread> scorers;
+    for (unsigned int i = 0; i != opt.threads; ++i)
+      scorers.emplace_back(&score_para, &trainer, rsz, opt.maxBatch, chrono::microseconds(opt.budget));
+    vector<unique_ptr<Reader>> readers;
+    cerr << "listening on " << sock_path << endl;
+
+    const auto start = Clock::now();
+    auto last = start;
+    while (!signaled) {
+      pollfd p {lfd, POLLIN, 0};
+      if (poll(&p, 1, 200) > 0) {
+        const int fd = accept(lfd, nullptr, nullptr);
+        if (fd >= 0) {
+          auto conn = make_shared<Conn>(fd);
+          unique_ptr<Reader> r(new Reader(conn));
+          try {
+            r->th = thread(&read_para, r.get(), move(conn), wsz, rsz);
+            readers.push_back(move(r));
+          } catch (const system_error& e) {
+            // out of threads for now; the client sees its connection closed
+            cerr << "cannot start a reader: " << e.what() << endl;
+          }
+        }
+      }
+      reap_readers(readers);
+      const auto now = Clock::now();
+      if (chrono::duration<double>(now - last).count() >= opt.report) {
+        report_stats(chrono::duration<double>(now - last).count());
+        last = now;
+      }
+    }
+
+    // readers stop when their clients are shut down, scorers once all is answered
+    close(lfd);
+    unlink(sock_path.c_str());
+    for (auto& x : readers) {
+      if (auto conn = x->conn.lock()) shutdown(conn->fd, SHUT_RD);
+    }
+    for (auto& x : readers) x->th.join();
+    stopping = true;
+    pending_cv.notify_all();
+    for (auto& x : scorers) x.join();
+    const double secs = chrono::duration<double>(Clock::now() - start).count();
+    cerr << total_requests << " queries in " << total_batches << " batches, " << total_requests / secs
+         << " QPS over " << secs << " s" << endl;
+
+  } catch (const optparse::unrecognized_option& e) {
+    cout << "unrecognized option: " << e.what() << endl;
+    return 1;
+  } catch (const optparse::invalid_value& e) {
+    cout << "invalid value: " << e.what() << endl;
+    return 1;
+  } catch (const exception& e) {
+    cout << "use -h or --help to show help." << endl;
+    cout << e.what() << endl;
+  }
+
+  return 0;
+}
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <atomic>
@@ -7,13 +9,23 @@
 #include <unordered_map>
 #include <cmath>
 #include <utility>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <queue>
+#include <cstdio>
 
 #include "optparse.h"
 #include "ReaderLines.h"
 #include "RandomGenerator.h"
 #include "Poisson.h"
 #include "TrainerKB.h"
+#include "ValidatorKB.h"
+#include "GraphKB.h"
 #include "MultinomialTable.h"
+#include "Numa.h"
+#include "BatchKB.h"
+#include "RingBuffer.h"
 #include "misc.h"
 
 using namespace std;
@@ -29,6 +41,30 @@ public:
   const char* inPath = nullptr;
   string outPath;
   int para = 2;
+  bool pin = false;
+  numa::Placement numaPlace = numa::NONE;
+  bool numaLocalHeads = false;
+  bool grow = false;
+  const char* focus = nullptr;
+  double focusRate = 0.5;
+  string vecsFile;
+  bool mmapModel = false;
+  bool modelFile = false;
+  long long checkpoint = 0;
+  const char* valid = nullptr;
+  long long validEvery = 100000;
+  size_t validSample = 1000;
+  int patience = 3;
+  unsigned int heads = 1;
+  const char* profile = nullptr;
+  int samplers = 0;
+  unsigned int profileRate = 64;
+  ent_index hotRows = 0;
+  unsigned int negPool = 0;
+  bool negPoolFreq = false;
+  const char* sweep = nullptr;
+  bool compact = false;
+  bool sharded = false;
 
   BEGIN_OPTION_MAP()
     ON_OPTION(SHORTOPT('h') || LONGOPT("help"))
@@ -45,42 +81,502 @@ public:
       outPath = string(arg);
     ON_OPTION_WITH_ARG(LONGOPT("para"))
       para = stoi(arg);
+    ON_OPTION(LONGOPT("pin"))
+      pin = true;
+    ON_OPTION_WITH_ARG(LONGOPT("numaPlace"))
+      numaPlace = numa::parsePlacement(arg);
+    ON_OPTION(LONGOPT("numaLocalHeads"))
+      numaLocalHeads = true;
+    ON_OPTION(LONGOPT("grow"))
+      grow = true;
+    ON_OPTION_WITH_ARG(LONGOPT("focus"))
+      focus = arg;
+    ON_OPTION_WITH_ARG(LONGOPT("focusRate"))
+      focusRate = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("vecsFile"))
+      vecsFile = string(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("hotRows"))
+      hotRows = stoull(arg);
+    ON_OPTION(LONGOPT("mmapModel"))
+      mmapModel = true;
+    ON_OPTION(LONGOPT("modelFile"))
+      modelFile = true;
+    ON_OPTION_WITH_ARG(LONGOPT("checkpoint"))
+      checkpoint = stoll(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("valid"))
+      valid = arg;
+    ON_OPTION_WITH_ARG(LONGOPT("validEvery"))
+      validEvery = stoll(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("validSample"))
+      validSample = stoull(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("patience"))
+      patience = stoi(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("heads"))
+      heads = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("samplers"))
+      samplers = stoi(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("profile"))
+      profile = arg;
+    ON_OPTION_WITH_ARG(LONGOPT("profileRate"))
+      profileRate = stoul(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("negPool"))
+      negPool = stoul(arg);
+    ON_OPTION(LONGOPT("negPoolFreq"))
+      negPoolFreq = true;
+    ON_OPTION_WITH_ARG(LONGOPT("sweep"))
+      sweep = arg;
+    ON_OPTION(LONGOPT("compact"))
+      compact = true;
+    ON_OPTION(LONGOPT("sharded"))
+      sharded = true;
 
   END_OPTION_MAP()
 };
 
-static vector<vector<pair<unsigned int, unsigned int>>> graph; // neighbors: (relation_index, tail_index)
+static GraphKB graph; // neighbors: (relation_index, tail_index)
 static MultinomialTable samp_node;
+static vector<ent_index> focus_nodes; // heads of the neighborhoods to train more often
+static double focus_rate;
+static unsigned int neg_pool = 0;
+static bool neg_pool_freq = false;
 static atomic_ullong remained_batches;
+static long long skipped_batches = 0; // left when stopped early
+static long long total_batches;
+static chrono::steady_clock::time_point start_time;
 
-static void trainKB_para(int tid, RandomGenerator rnd, double pl, TrainerKB* ptrain) {
+static void report_progress(long long remained, const TrainerKB* ptrain, bool report_resident) {
+  if (remained % 100000 != 0) return;
+  if (report_resident) {
+    const double secs = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    cerr << remained << "\t" << (total_batches - remained) / secs << " batches/s\t"
+         << ptrain->residentFraction() << " resident" << endl;
+  } else
+    cerr << remained << endl;
+}
+
+// the paths from hi; negatives of a pool are drawn by samp with --negPoolFreq
+static void sample_paths(RandomGenerator& rnd, Poisson& samp_path, const MultinomialTable& samp, ent_index hi,
+                         BatchKB& b) {
+  b.reset(hi);
+  const auto neighbor = graph[hi];
+  for (size_t i = 0; i != neighbor.size() * 2; ++i) {
+    auto edge = neighbor[rnd(neighbor.size())];
+    samp_path.reset();
+    do {
+      b.push(edge.first, edge.second);
+      if (b.full()) break;
+      const auto nei = graph[edge.second];
+      edge = nei[rnd(nei.size())];
+    } while (!samp_path.stop(rnd));
+    b.endPath();
+    if (b.full()) break;
+  }
+  for (unsigned int n = 0; n != neg_pool; ++n) b.pushNeg(neg_pool_freq ? samp.sample(rnd) : rnd(graph.size()));
+}
+
+static void sample_batch(RandomGenerator& rnd, Poisson& samp_path, const MultinomialTable& samp,
+                         const TrainerKB* ptrain, bool local_heads, unsigned int node, BatchKB& b) {
+  ent_index hi;
+  if (!focus_nodes.empty() && rnd.nextDouble() < focus_rate) {
+    hi = focus_nodes[rnd(focus_nodes.size())];
+  } else {
+    hi = samp.sample(rnd);
+    // prefer heads stored on this node, giving up after a few tries
+    for (unsigned int k = 0; local_heads && k != 3 && ptrain->entityNode(hi) != node; ++k)
+      hi = samp.sample(rnd);
+  }
+  sample_paths(rnd, samp_path, samp, hi, b);
+}
+
+// the first fields of the lines of a vocab file
+static vector<string> read_names(const string& fn) {
+  vector<string> ret;
+  ReaderLines lines(fn);
+  while (!lines.empty()) ret.push_back(split(lines.next(), '\t')[0]);
+  return ret;
+}
+
+/* bytes of the parts of the model, the graph and the samplers, as they
+ * stand when training starts; mapped parts take memory as they are read. */
+static void report_memory(const TrainerKB& trainer) {
+  auto parts = trainer.memoryUsage();
+  parts.emplace_back("graph", graph.bytes());
+  parts.emplace_back("node table", samp_node.bytes());
+  parts.emplace_back("focus nodes", focus_nodes.capacity() * sizeof(ent_index));
+  size_t total = 0;
+  char buf[80];
+  cerr << "memory (MB):" << endl;
+  for (const auto& x : parts) {
+    snprintf(buf, sizeof(buf), "  %-30s%10.1f", x.first.c_str(), x.second / 1048576.0);
+    cerr << buf << endl;
+    if (x.first.find("(mapped)") == string::npos) total += x.second;
+  }
+  snprintf(buf, sizeof(buf), "  %-30s%10.1f", "total in RAM", total / 1048576.0);
+  cerr << buf << endl;
+}
+
+/* the share of head draws whose vectors are on each node with partition
+ * placement: the write traffic each node takes, and with --numaLocalHeads
+ * about how far the heads of its workers stray from samp_node. */
+static void report_node_mass(const TrainerKB& trainer) {
+  vector<double> mass(numa::numNodes(), 0.0);
+  double prev = 0.0;
+  for (size_t i = 0; i != samp_node.choices(); ++i) {
+    mass[trainer.entityNode(i)] += samp_node.prob(i) - prev;
+    prev = samp_node.prob(i);
+  }
+  cerr << "head mass per node:";
+  for (double x : mass) cerr << ' ' << x / prev;
+  cerr << endl;
+}
+
+static void update_batches(RandomGenerator& rnd, TrainerKB* ptrain, const vector<const BatchKB*>& bs) {
+  if (bs.size() == 1) ptrain->update(rnd, *bs[0]);
+  else ptrain->updateBatch(rnd, bs);
+}
+
+static void trainKB_para(int tid, RandomGenerator rnd, double pl, TrainerKB* ptrain,
+                         bool pin, bool local_heads, bool report_resident, unsigned int heads) {
   Poisson samp_path(pl);
+  if (pin) numa::pinThread(numa::workerCpu(tid));
+  const unsigned int node = numa::workerNode(tid);
+
+  vector<BatchKB> batches(heads);
+  vector<const BatchKB*> bs;
+  long long remained = 1;
+  while (remained > 0) {
+    bs.clear();
+    // each head is one batch; with heads > 1 they are updated together
+    while (bs.size() != heads && (remained = remained_batches.fetch_sub(1, memory_order_relaxed)) > 0) {
+      report_progress(remained, ptrain, report_resident);
+      sample_batch(rnd, samp_path, samp_node, ptrain, local_heads, node, batches[bs.size()]);
+      bs.push_back(&batches[bs.size()]);
+    }
+    if (!bs.empty()) update_batches(rnd, ptrain, bs);
+  }
+}
+
+/* with --sharded, each worker owns a shard of the entities and draws its
+ * heads from them alone. shards are balanced by how often their entities
+ * are drawn as heads, the most drawn first, each to the lightest shard. */
+struct ShardHeads {
+  vector<ent_index> heads;
+  MultinomialTable samp;
+  double mass = 0.0; // of the head distribution
+};
+static vector<ShardHeads> shard_heads;
+
+static vector<unsigned short> partition_heads(const MultinomialTable& samp, unsigned int n) {
+  const size_t wsz = samp.choices();
+  vector<double> probs(wsz);
+  for (size_t i = 0; i != wsz; ++i) probs[i] = samp.prob(i) - (i == 0 ? 0.0 : samp.prob(i - 1));
+  vector<ent_index> order(wsz);
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&probs](ent_index x, ent_index y) { return probs[x] > probs[y]; });
+
+  typedef pair<double, unsigned int> Load;
+  priority_queue<Load, vector<Load>, greater<Load>> loads;
+  for (unsigned int k = 0; k != n; ++k) loads.emplace(0.0, k);
+  vector<unsigned short> owners(wsz);
+  vector<vector<double>> weights(n);
+  shard_heads = vector<ShardHeads>(n);
+  for (ent_index i : order) {
+    Load x = loads.top();
+    loads.pop();
+    owners[i] = static_cast<unsigned short>(x.second);
+    shard_heads[x.second].heads.push_back(i);
+    weights[x.second].push_back(probs[i]);
+    x.first += probs[i];
+    loads.push(x);
+  }
+  for (unsigned int k = 0; k != n; ++k) {
+    shard_heads[k].samp = MultinomialTable(weights[k].cbegin(), weights[k].cend(), 1 << 16);
+    shard_heads[k].mass = accumulate(weights[k].cbegin(), weights[k].cend(), 0.0);
+  }
+  return owners;
+}
+
+/* the batches of each shard, in proportion to its head mass and summing to
+ * numBatches, the remainder to the largest fractions */
+static vector<long long> shard_shares(long long numBatches) {
+  const size_t n = shard_heads.size();
+  double total = 0.0;
+  for (const auto& x : shard_heads) total += x.mass;
+  vector<long long> shares(n);
+  vector<pair<double, size_t>> fracs(n);
+  long long left = numBatches;
+  for (size_t k = 0; k != n; ++k) {
+    const double exact = total > 0.0 ? numBatches * (shard_heads[k].mass / total) : double(numBatches) / n;
+    shares[k] = min(left, static_cast<long long>(exact));
+    left -= shares[k];
+    fracs[k] = make_pair(exact - shares[k], k);
+  }
+  sort(fracs.begin(), fracs.end(), [](const pair<double, size_t>& x, const pair<double, size_t>& y) {
+    return x.first > y.first || (x.first == y.first && x.second < y.second);
+  });
+  for (size_t j = 0; left > 0; j = (j + 1) % n, --left) ++shares[fracs[j].second];
+  return shares;
+}
+
+/* each shard takes its share of the batches, so that heads keep the
+ * distribution of samp_node however fast the shards run. */
+static void shard_para(int tid, RandomGenerator rnd, double pl, TrainerKB* ptrain, bool pin,
+                       bool report_resident, unsigned int heads, long long share) {
+  Poisson samp_path(pl);
+  if (pin) numa::pinThread(numa::workerCpu(tid));
+  ptrain->joinShard(tid);
+  const ShardHeads& sh = shard_heads[tid];
+
+  vector<BatchKB> batches(heads);
+  vector<const BatchKB*> bs;
+  long long remained = 1;
+  while (remained > 0 && share > 0) {
+    bs.clear();
+    while (bs.size() != heads && share > 0 && (remained = remained_batches.fetch_sub(1, memory_order_relaxed)) > 0) {
+      --share;
+      report_progress(remained, ptrain, report_resident);
+      sample_paths(rnd, samp_path, samp_node, sh.heads[sh.samp.sample(rnd)], batches[bs.size()]);
+      bs.push_back(&batches[bs.size()]);
+    }
+    if (!bs.empty()) update_batches(rnd, ptrain, bs);
+    ptrain->drainShard(rnd);
+  }
+  ptrain->leaveShard(rnd);
+}
+
+/* with --samplers, sampling and updates run in separate threads: each
+ * sampler fills the rings of some workers in turn, and each worker updates
+ * from its own ring, prefetching the vectors of the next batch. */
+typedef RingBuffer<BatchKB> BatchRing;
+static constexpr unsigned int RING_LOG2 = 6;
+
+static void sample_para(RandomGenerator rnd, double pl, TrainerKB* ptrain, vector<BatchRing*> rings,
+                        vector<unsigned int> nodes, bool local_heads, bool report_resident) {
+  Poisson samp_path(pl);
+  size_t r = 0;
+  long long remained;
+  while ((remained = remained_batches.fetch_sub(1, memory_order_relaxed)) > 0) {
+    report_progress(remained, ptrain, report_resident);
+    BatchKB* b;
+    for (size_t tries = 1; !(b = rings[r]->back()); ++tries) {
+      r = (r + 1) % rings.size();
+      if (tries % rings.size() == 0) this_thread::yield(); // all full
+    }
+    sample_batch(rnd, samp_path, samp_node, ptrain, local_heads, nodes[r], *b);
+    rings[r]->push();
+    r = (r + 1) % rings.size();
+  }
+  for (auto x : rings) x->close();
+}
+
+static void update_para(int tid, RandomGenerator rnd, TrainerKB* ptrain, bool pin, unsigned int heads,
+                        BatchRing* ring) {
+  if (pin) numa::pinThread(numa::workerCpu(tid));
+  vector<const BatchKB*> bs;
+  while (!ring->done()) {
+    bs.clear();
+    const BatchKB* b;
+    while (bs.size() != heads && (b = ring->at(bs.size()))) bs.push_back(b);
+    if (bs.empty()) {
+      this_thread::yield();
+      continue;
+    }
+    if ((b = ring->at(bs.size()))) ptrain->prefetch(*b);
+    update_batches(rnd, ptrain, bs);
+    for (size_t k = 0; k != bs.size(); ++k) ring->pop();
+  }
+}
+
+/* one model of a --sweep, from a line "OUT_PATH [OPTION...]" of the sweep
+ * file; sampPow and sampPathLen default to those of the command line, the
+ * others to HyperParametersKB.h. */
+class variant : public optparse {
+public:
+  string outPath;
+  double sampPow;
+  double sampPathLen;
+  HyperParamsKB hp;
+
+  variant(double sampPow, double sampPathLen) : sampPow(sampPow), sampPathLen(sampPathLen) {}
 
+  BEGIN_OPTION_MAP()
+    ON_OPTION_WITH_ARG(LONGOPT("sampPow"))
+      sampPow = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("sampPathLen"))
+      sampPathLen = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("vEta"))
+      hp.vEta = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("vLambda"))
+      hp.vLambda = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("mEta"))
+      hp.mEta = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("mLambda"))
+      hp.mLambda = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("orthSkip"))
+      hp.orthSkip = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("orthRate"))
+      hp.orthRate = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("autoEta"))
+      hp.autoEta = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("autoLambda"))
+      hp.autoLambda = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("autoSkip"))
+      hp.autoSkip = stod(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("jointMEta"))
+      hp.jointMEta = stof(arg);
+    ON_OPTION_WITH_ARG(LONGOPT("jointMLambda"))
+      hp.jointMLambda = stof(arg);
+    ON_OPTION(LONGOPT("noAutoencoder"))
+      hp.disableAutoencoder = true;
+
+  END_OPTION_MAP()
+};
+
+static vector<variant> read_sweep(const string& fn, double sampPow, double sampPathLen) {
+  vector<variant> ret;
+  ReaderLines lines(fn);
+  while (!lines.empty()) {
+    const string line = lines.next();
+    istringstream ss(line);
+    vector<string> tokens;
+    string tok;
+    while (ss >> tok) tokens.push_back(tok);
+    if (tokens.empty() || tokens[0][0] == '#') continue;
+    vector<char*> args;
+    for (auto& x : tokens) args.push_back(&x[0]);
+    ret.emplace_back(sampPow, sampPathLen);
+    if (ret.back().parse(args.data(), static_cast<int>(args.size())) != static_cast<int>(args.size()))
+      throw runtime_error("malformed line in sweep file: " + line);
+    ret.back().outPath = tokens[0];
+  }
+  if (ret.empty()) throw runtime_error("no models in sweep file " + fn);
+  return ret;
+}
+
+// the models of a sweep that sample alike, all updated by each batch sampled for them
+struct SweepGroup {
+  double sampPow;
+  double sampPathLen;
+  MultinomialTable samp;
+  vector<TrainerKB*> models;
+};
+
+static MultinomialTable node_table(const vector<double>& counts, double sampPow) {
+  vector<double> wprobs(counts);
+  for (auto& x : wprobs) x = pow(x, sampPow);
+  return MultinomialTable(wprobs.cbegin(), wprobs.cend(), 1 << 16);
+}
+
+// batch n is sampled for group n % groups.size() and updates each of its models in turn
+static void sweep_para(int tid, RandomGenerator rnd, const vector<SweepGroup>* groups, bool pin) {
+  if (pin) numa::pinThread(numa::workerCpu(tid));
+  vector<Poisson> samp_paths;
+  for (const auto& g : *groups) samp_paths.emplace_back(g.sampPathLen);
+  BatchKB b;
   long long remained;
-  while((remained = remained_batches.fetch_sub(1, memory_order_relaxed)) > 0) {
-    if (remained % 100000 == 0) {
-      cerr << remained << endl;
+  while ((remained = remained_batches.fetch_sub(1, memory_order_relaxed)) > 0) {
+    report_progress(remained, nullptr, false);
+    const size_t gi = static_cast<size_t>(remained) % groups->size();
+    const SweepGroup& g = (*groups)[gi];
+    sample_batch(rnd, samp_paths[gi], g.samp, g.models[0], false, 0, b);
+    for (TrainerKB* m : g.models) m->update(rnd, b);
+  }
+}
+
+/* scores the live model every validEvery batches in the background; saves
+ * the best one so far to bestPath, and stops training when the filtered
+ * MRR has not improved for patience validations. */
+static void validate_para(RandomGenerator rnd, const ValidatorKB* validator, TrainerKB* ptrain,
+                          long long validEvery, size_t validSample, int patience, string bestPath) {
+  long long next = validEvery;
+  double best = -1.0;
+  int bad = 0;
+  long long remained;
+  while ((remained = static_cast<long long>(remained_batches.load(memory_order_relaxed))) > 0) {
+    const long long done = total_batches - remained;
+    if (done < next) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      continue;
     }
-    unsigned int hi = samp_node.sample(rnd);
+    next += validEvery;
+    const auto t0 = chrono::steady_clock::now();
+    const auto result = validator->evaluate(*ptrain, validSample, rnd);
+    cerr << "valid at " << done << " batches: MRR " << result.mrr << "\tH@10 " << result.hits10 << "\t("
+         << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s)";
+    if (result.mrr > best) {
+      best = result.mrr;
+      bad = 0;
+      ptrain->saveModel(bestPath);
+      cerr << "\tbest" << endl;
+    } else if (++bad >= patience) {
+      cerr << "\tstop (best MRR " << best << ")" << endl;
+      skipped_batches = max(0LL, static_cast<long long>(remained_batches.exchange(0, memory_order_relaxed)));
+    } else
+      cerr << endl;
+  }
+}
+
+/* trains the models of opt.sweep together. models of the same sampPow and
+ * sampPathLen form a group sharing its node table and batches; each group
+ * gets numBatches batches. all models start from the same initial values. */
+static void train_sweep(const option& opt, const vector<double>& wcounts, ent_index wsz, unsigned int rsz,
+                        const string& words_fn, const string& roles_fn, chrono::steady_clock::time_point load_start) {
+  if (opt.inPath || !opt.vecsFile.empty() || opt.checkpoint > 0 || opt.valid || opt.samplers > 0 ||
+      opt.profile || opt.heads != 1 || opt.numaLocalHeads || opt.sharded)
+    throw runtime_error("--sweep does not combine with --inPath, --vecsFile, --checkpoint, --valid, --samplers, "
+                        "--profile, --heads, --numaLocalHeads or --sharded");
+  const vector<variant> variants = read_sweep(opt.sweep, opt.sampPow, opt.sampPathLen);
+
+  vector<unique_ptr<TrainerKB>> models;
+  vector<SweepGroup> groups;
+  const RandomGenerator init_rg(static_cast<uint64_t>(chrono::system_clock::now().time_since_epoch().count()));
+  const vector<string> wnames = read_names(words_fn);
+  const vector<string> rnames = read_names(roles_fn);
+  for (const variant& v : variants) {
+    models.emplace_back(new TrainerKB(v.hp));
+    TrainerKB& trainer = *models.back();
+    trainer.setVocab(wnames, rnames);
+    trainer.setPlacement(opt.numaPlace);
+    trainer.setCompactSteps(opt.compact);
+    trainer.setSingleFile(opt.modelFile);
+    trainer.saveParams(v.outPath);
+    RandomGenerator rg = init_rg;
+    trainer.initModel(wsz, rsz, rg);
+    trainer.saveModel(v.outPath + "init_");
 
-    vector<vector<pair<unsigned int, unsigned int>>> pths;
-    unsigned int samp_sz = 0;
-    const auto& neighbor = graph[hi];
-    for (unsigned int i = 0; i != neighbor.size() * 2; ++i) {
-      vector<pair<unsigned int, unsigned int>> pth;
-      auto edge = neighbor[rnd(neighbor.size())];
-      samp_path.reset();
-      do {
-        pth.push_back(edge);
-        if (++samp_sz == 31) break;
-        const auto& nei = graph[edge.second];
-        edge = nei[rnd(nei.size())];
-      } while (!samp_path.stop(rnd));
-      pths.push_back(move(pth));
-      if (samp_sz == 31) break;
+    auto g = find_if(groups.begin(), groups.end(), [&v](const SweepGroup& x) {
+      return x.sampPow == v.sampPow && x.sampPathLen == v.sampPathLen;
+    });
+    if (g == groups.end()) {
+      groups.push_back(SweepGroup {v.sampPow, v.sampPathLen, node_table(wcounts, v.sampPow), {}});
+      g = groups.end() - 1;
     }
-    ptrain->update(rnd, hi, pths);
+    g->models.push_back(&trainer);
+  }
+  cerr << variants.size() << " models in " << groups.size() << " groups" << endl;
+  report_memory(*models[0]);
+
+  RandomGenerator rg = init_rg;
+  rg.jump();
+  remained_batches = opt.numBatches * static_cast<long long>(groups.size());
+  total_batches = remained_batches;
+  start_time = chrono::steady_clock::now();
+  cerr << "loaded in " << chrono::duration<double>(start_time - load_start).count() << " s" << endl;
+  vector<thread> threads;
+  for (int i = 0; i != opt.para; ++i) {
+    rg.jump();
+    threads.emplace_back(&sweep_para, i, rg, &groups, opt.pin);
+  }
+  for (auto& x : threads) x.join();
+  {
+    const double secs = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    cerr << "trained " << total_batches << " batches in " << secs << " s: " << total_batches / secs
+         << " batches/s, " << opt.numBatches * static_cast<long long>(variants.size()) / secs << " updates/s" << endl;
   }
+
+  const auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i != variants.size(); ++i) models[i]->saveModel(variants[i].outPath);
+  cerr << "saved in " << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s" << endl;
 }
 
 int main(int argc, char *argv[])
@@ -100,30 +596,77 @@ int main(int argc, char *argv[])
            << "  --sampPow         samp. node prob. is power of freq. (default: 0.75)" << endl
            << "  --sampPathLen     path length is 1+Poisson(sampPathLen) (default: 0.5)" << endl
            << "  --numBatches      batches to train (default: 1000000)" << endl
-           << "  --inPath          if set, load model from this path for init" << endl
+           << "  --inPath          if set, load model from this path (npy files or model file) for init" << endl
            << "  --outPath         save model to this path (default: working dir)" << endl
            << "  --para            number of parallel threads (default: 2)" << endl
+           << "  --pin             pin worker threads to cores, spread over NUMA nodes" << endl
+           << "  --numaPlace       none, interleave or partition model memory over NUMA nodes (default: none);" << endl
+           << "                    partition deals blocks of 16 entities and single relations round-robin" << endl
+           << "  --numaLocalHeads  workers prefer heads whose vectors are on their node (with partition);" << endl
+           << "                    this skews the heads each worker trains on toward its node's entities" << endl
+           << "  --grow            with --inPath, extend the loaded model to the vocab; new entities" << endl
+           << "                    and relations must be appended at the end of the vocab files, which" << endl
+           << "                    is checked against the names saved with the model" << endl
+           << "  --focus           file of new or changed triples (also in TRAIN_FILE) to train around" << endl
+           << "  --focusRate       fraction of batches with heads from the --focus triples (default: 0.5)" << endl
+           << "  --vecsFile        keep entity vectors in memory-mapped files with this prefix instead of RAM" << endl
+           << "  --hotRows         with --vecsFile, lock vectors of this many most frequent entities in RAM" << endl
+           << "  --mmapModel       with --inPath, map the model files copy-on-write instead of reading them" << endl
+           << "  --modelFile       save model as one file model.glm instead of npy files" << endl
+           << "  --checkpoint      every this many batches, save what changed as a delta on a full model" << endl
+           << "                    saved at start, to OUTPATH ckpt_ (load with --inPath OUTPATH ckpt_)" << endl
+           << "  --valid           validation triples; log filtered MRR while training, keep the best model" << endl
+           << "                    in OUTPATH best_, and stop early when it no longer improves" << endl
+           << "  --validEvery      batches between validations (default: 100000)" << endl
+           << "  --validSample     validation triples sampled each time, 0 for all (default: 1000)" << endl
+           << "  --patience        stop after this many validations without improvement (default: 3)" << endl
+           << "  --heads           heads per update; more heads share the matrix products of their path hops" << endl
+           << "                    (default: 1)" << endl
+           << "  --samplers        if > 0, this many threads sample batches for the --para update threads," << endl
+           << "                    passing them through lock-free rings (default: 0, workers sample)" << endl
+           << "  --profile         sample concurrent writes to vectors and matrices, and write a report of" << endl
+           << "                    the most contended ones to this file after training" << endl
+           << "  --profileRate     with --profile, sample one in this many writes (default: 64)" << endl
+           << "  --negPool         if > 0, each batch draws this many negatives (at most 64), shared by its" << endl
+           << "                    edges and scored in one product, in place of 3 per edge (default: 0)" << endl
+           << "  --negPoolFreq     draw the --negPool negatives as heads are drawn, by frequency, not uniformly" << endl
+           << "  --sweep           file of models to train at once on the one graph, a line \"OUT_PATH [OPTION...]\"" << endl
+           << "                    each, options --sampPow, --sampPathLen, --noAutoencoder and the hyper" << endl
+           << "                    parameters of HyperParametersKB.h (--vEta, --mLambda, --autoSkip, ...);" << endl
+           << "                    models sampling alike are all updated by each batch; --outPath is unused" << endl
+           << "  --compact         32-bit step counters for entities, saturating at about 4e9 steps each" << endl
+           << "  --sharded         owner-computes updates: each of the --para workers owns a shard of the" << endl
+           << "                    entities and relations and draws heads from its own; increments of" << endl
+           << "                    parameters of other shards are passed to their owners through lock-free" << endl
+           << "                    rings, so that only owners write them (not with --samplers or --focus)" << endl
           ;
       return 0;
     }
     if (argc - argpos != 3) throw runtime_error("wrong number of arguments");
+    if (opt.heads == 0) throw runtime_error("--heads must be positive");
+    if (opt.negPool > BatchKB::MAX_NEGS) throw runtime_error("--negPool must be at most 64");
+    if (opt.sharded && (opt.samplers > 0 || opt.focus || opt.numaLocalHeads))
+      throw runtime_error("--sharded does not combine with --samplers, --focus or --numaLocalHeads");
+    if (opt.sharded && (opt.para < 1 || opt.para > 65535)) throw runtime_error("--sharded needs --para from 1 to 65535");
+    neg_pool = opt.negPool;
+    neg_pool_freq = opt.negPoolFreq;
     string words_fn(argv[argpos]);
     string roles_fn(argv[argpos + 1]);
     string train_fn(argv[argpos + 2]);
+    const auto load_start = chrono::steady_clock::now();
 
     // read vocab of entities
-    unordered_map<string, unsigned int> words;
-    unsigned int wsz = 0; {
-      vector<double> wprobs;
+    unordered_map<string, ent_index> words;
+    vector<double> wcounts;
+    ent_index wsz = 0; {
       ReaderLines wlines(words_fn);
       while (!wlines.empty()) {
         auto sp = split(wlines.next(), '\t');
         words[sp[0]] = wsz;
         ++wsz;
-        wprobs.push_back(stod(sp[1]));
+        wcounts.push_back(stod(sp[1]));
       }
-      for (auto& x : wprobs) x = pow(x, opt.sampPow);
-      samp_node = MultinomialTable(wprobs.cbegin(), wprobs.cend(), 1 << 16);
+      samp_node = node_table(wcounts, opt.sampPow);
     }
 
     // read vocab of relations
@@ -137,38 +680,175 @@ int main(int argc, char *argv[])
     }
 
     //read train file, add neighbors to graph
-    graph.resize(wsz);
+    graph.reset(wsz, rsz);
     ReaderLines glines(train_fn);
     while (!glines.empty()) {
       auto sp = split(glines.next(), '\t');
-      const unsigned int head_index = words.at(sp[0]);
-      const unsigned int tail_index = words.at(sp[2]);
-      const unsigned int rel_index = roles.at(sp[1]);
-      graph[head_index].emplace_back(rel_index, tail_index);
-      graph[tail_index].emplace_back(rel_index + rsz, head_index);
+      graph.add(words.at(sp[0]), roles.at(sp[1]), words.at(sp[2]));
+    }
+    graph.finish();
+
+    // read focus triples, whose end points are sampled as heads more often
+    if (opt.focus) {
+      vector<bool> seen(wsz, false);
+      ReaderLines flines(opt.focus);
+      while (!flines.empty()) {
+        auto sp = split(flines.next(), '\t');
+        for (ent_index i : {words.at(sp[0]), words.at(sp[2])}) {
+          if (!seen[i] && !graph[i].empty()) focus_nodes.push_back(i);
+          seen[i] = true;
+        }
+      }
+      focus_rate = opt.focusRate;
+    }
+
+    // read validation triples
+    vector<pair<pair<ent_index, unsigned int>, ent_index>> valid_triples;
+    if (opt.valid) {
+      ReaderLines vlines(opt.valid);
+      while (!vlines.empty()) {
+        auto sp = split(vlines.next(), '\t');
+        auto hit = words.find(sp[0]);
+        auto tit = words.find(sp[2]);
+        auto rit = roles.find(sp[1]);
+        // triples with unknown entities or relations cannot be ranked
+        if (hit == words.end() || tit == words.end() || rit == roles.end()) continue;
+        valid_triples.emplace_back(make_pair(hit->second, rit->second), tit->second);
+      }
     }
+    unique_ptr<ValidatorKB> validator;
+    if (!valid_triples.empty()) validator = unique_ptr<ValidatorKB>(new ValidatorKB(valid_triples, graph, rsz));
+
+    // names are not needed while training; the profile report reads them again
+    unordered_map<string, ent_index>().swap(words);
+    unordered_map<string, unsigned int>().swap(roles);
+
+    if (opt.sweep) {
+      train_sweep(opt, wcounts, wsz, rsz, words_fn, roles_fn, load_start);
+      return 0;
+    }
+    vector<double>().swap(wcounts);
 
     RandomGenerator rg(static_cast<uint64_t>(chrono::system_clock::now().time_since_epoch().count()));
 
     TrainerKB trainer;
+    trainer.setPlacement(opt.numaPlace);
+    trainer.setCompactSteps(opt.compact);
+    if (!opt.vecsFile.empty()) trainer.setVecsFile(opt.vecsFile, opt.hotRows);
+    trainer.setSingleFile(opt.modelFile);
+    trainer.setVocab(read_names(words_fn), read_names(roles_fn));
     trainer.saveParams(opt.outPath);
-    if (opt.inPath) trainer.loadModel(wsz, rsz, opt.inPath);
+    if (opt.inPath && opt.grow) {
+      trainer.growModel(wsz, rsz, opt.inPath, rg);
+      trainer.saveModel(opt.outPath + "init_");
+    } else if (opt.inPath && opt.mmapModel) trainer.mapModel(wsz, rsz, opt.inPath);
+    else if (opt.inPath) trainer.loadModel(wsz, rsz, opt.inPath);
     else {
       trainer.initModel(wsz, rsz, rg);
       trainer.saveModel(opt.outPath + "init_");
     }
 
+    if (opt.checkpoint > 0) trainer.saveBase(opt.outPath + "ckpt_");
+    if (opt.profile) trainer.enableProfiler(opt.profileRate);
+    vector<long long> shares;
+    if (opt.sharded) {
+      if (wsz < static_cast<ent_index>(opt.para)) throw runtime_error("--sharded needs at least --para entities");
+      trainer.setShards(opt.para, partition_heads(samp_node, opt.para));
+      shares = shard_shares(opt.numBatches);
+      size_t top = 0;
+      for (size_t k = 0; k != shard_heads.size(); ++k) {
+        if (shard_heads[k].mass > shard_heads[top].mass) top = k;
+      }
+      cerr << opt.para << " shards, the heaviest with " << shard_heads[top].mass * opt.para
+           << " times the mean head mass and " << shares[top] << " batches" << endl;
+    }
+    report_memory(trainer);
+
     vector<thread> threads;
     threads.reserve(opt.para);
 
     remained_batches = opt.numBatches;
-    for (int i = 0; i != opt.para; ++i) {
+    total_batches = opt.numBatches;
+    start_time = chrono::steady_clock::now();
+    cerr << "loaded in " << chrono::duration<double>(start_time - load_start).count() << " s" << endl;
+    const bool local_heads = opt.numaLocalHeads && opt.numaPlace == numa::PARTITION;
+    if (opt.numaPlace == numa::PARTITION) report_node_mass(trainer);
+    vector<unique_ptr<BatchRing>> rings;
+    if (opt.sharded) {
+      for (int i = 0; i != opt.para; ++i) {
+        rg.jump();
+        threads.emplace_back(&shard_para, i, rg, opt.sampPathLen, &trainer, opt.pin, !opt.vecsFile.empty(),
+                             opt.heads, shares[i]);
+      }
+    } else if (opt.samplers > 0) {
+      const int samplers = min(opt.samplers, opt.para);
+      vector<vector<BatchRing*>> fed(samplers);
+      vector<vector<unsigned int>> nodes(samplers);
+      for (int i = 0; i != opt.para; ++i) {
+        rings.emplace_back(new BatchRing(RING_LOG2));
+        fed[i % samplers].push_back(rings.back().get());
+        nodes[i % samplers].push_back(numa::workerNode(i));
+        rg.jump();
+        threads.emplace_back(&update_para, i, rg, &trainer, opt.pin, opt.heads, rings.back().get());
+      }
+      for (int i = 0; i != samplers; ++i) {
+        rg.jump();
+        threads.emplace_back(&sample_para, rg, opt.sampPathLen, &trainer, fed[i], nodes[i],
+                             local_heads, !opt.vecsFile.empty());
+      }
+    } else {
+      for (int i = 0; i != opt.para; ++i) {
+        rg.jump();
+        threads.emplace_back(&trainKB_para, i, rg, opt.sampPathLen, &trainer,
+                             opt.pin, local_heads, !opt.vecsFile.empty(), opt.heads);
+      }
+    }
+    thread validate;
+    if (validator) {
       rg.jump();
-      threads.emplace_back(&trainKB_para, i, rg, opt.sampPathLen, &trainer);
+      validate = thread(&validate_para, rg, validator.get(), &trainer, opt.validEvery, opt.validSample,
+                        opt.patience, opt.outPath + "best_");
+    }
+    if (opt.checkpoint > 0) {
+      // checkpoints are taken while the workers run, as hogwild as the updates
+      long long next = opt.checkpoint;
+      long long remained;
+      while ((remained = static_cast<long long>(remained_batches.load(memory_order_relaxed))) > 0) {
+        if (total_batches - remained < next) {
+          this_thread::sleep_for(chrono::milliseconds(100));
+          continue;
+        }
+        const auto t0 = chrono::steady_clock::now();
+        const size_t bytes = trainer.saveDelta(opt.outPath + "ckpt_");
+        cerr << "checkpoint at " << total_batches - remained << " batches: " << (bytes >> 20) << " MB in "
+             << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s" << endl;
+        next += opt.checkpoint;
+      }
     }
     for (auto& x : threads) x.join();
+    if (validate.joinable()) validate.join();
+    {
+      const double secs = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+      cerr << "trained " << total_batches - skipped_batches << " batches in " << secs << " s: "
+           << (total_batches - skipped_batches) / secs << " batches/s" << endl;
+      if (opt.sharded) cerr << trainer.remoteFraction() << " of increments passed to other shards" << endl;
+    }
 
-    trainer.saveModel(opt.outPath);
+    {
+      const auto t0 = chrono::steady_clock::now();
+      trainer.saveModel(opt.outPath);
+      cerr << "saved in " << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s" << endl;
+    }
+
+    if (opt.profile) {
+      const vector<string> wnames = read_names(words_fn);
+      const vector<string> rnames = read_names(roles_fn);
+      ofstream out(opt.profile);
+      trainer.contentionProfiler()->report(out, [&](ContentionProfiler::Kind kind, size_t i) {
+        if (kind != ContentionProfiler::RELATION) return wnames[i];
+        return i < rsz ? rnames[i] + ">" : rnames[i - rsz] + "<";
+      }, 100);
+    }
 
   } catch (const optparse::unrecognized_option& e) {
     cout << "unrecognized option: " << e.what() << endl;
@@ -8,13 +8,16 @@ import sys
 import json
 import numpy as np
 
+import modelFile
+import relIndex
+
 from utilityFuncs import readerLine
 from utilityFuncs import show_top
 from utilityFuncs import split_wrt_brackets
 
 
 class Model(object):
-  def __init__(self, words, roles, path):
+  def __init__(self, words, roles, path, mmap=False):
     # load lexicon
     self.list_word = [line.split('\t', 1)[0] for line in readerLine(words)]
     self.dict_word = dict((s, i) for i, s in enumerate(self.list_word))
@@ -25,20 +28,29 @@ class Model(object):
 
     self.dict_role = dict((s, i) for i, s in enumerate(self.list_role))
 
-    # vecs & mats
-    tvecs = np.load(path + 'tvecs.npy')
-    tvecs /= np.sqrt(np.sum(np.square(tvecs), axis=1, keepdims=True))
+    # vecs & mats, from npy files under path or from a model file, with any
+    # deltas replayed; with mmap, files are mapped copy-on-write instead of
+    # read, and norms are computed by einsum so no array is ever duplicated.
+    # path may also be the (arrays, params) of modelFile.live_model, whose
+    # read-only views of a model in training are copied to be normalized
+    if isinstance(path, tuple):
+      arrays, params = path
+    else:
+      arrays, params = modelFile.load_model(path, mmap=mmap)
+    load = lambda name: arrays[name] if arrays[name].flags.writeable else arrays[name].copy()
+
+    tvecs = load('tvecs')
+    tvecs /= np.sqrt(np.einsum('ij,ij->i', tvecs, tvecs))[:, np.newaxis]
     dim = tvecs.shape[1]
 
-    mats = np.load(path + 'mats.npy')
-    mats *= np.sqrt(
-      dim / np.sum(np.square(mats), axis=(1, 2), keepdims=True))
+    mats = load('mats')
+    msq = np.einsum('ijk,ijk->i', mats, mats)
+    self.mat_norms = np.sqrt(msq / dim)
+    mats *= np.sqrt(dim / msq)[:, np.newaxis, np.newaxis]
 
-    cvecs = np.load(path + 'cvecs.npy')
-    with open(path + 'params.json') as params_file:
-      params = json.load(params_file)
+    cvecs = load('cvecs')
     cvecs /= np.expand_dims(
-      1.0 + np.load(path + 'vsteps.npy').astype('float32')
+      1.0 + load('vsteps').astype('float32')
       [:cvecs.shape[0]] * params['vEL'],
       axis=1)
 
@@ -48,18 +60,24 @@ class Model(object):
     self.cvecs = cvecs
     denc_scal = 1.0 / (
       1.0 +
-      np.load(path + 'dstep.npy').astype('float32') * params['autoEL'])
-    self.encoder = np.load(path + 'encoder.npy').reshape(
-      (-1, dim * dim)) * denc_scal
-    self.decoder = np.load(path + 'decoder.npy').reshape(
-      (-1, dim * dim)) * denc_scal
-    self.msteps = np.load(path + 'msteps.npy')
+      load('dstep').astype('float32') * params['autoEL'])
+    self.encoder = load('encoder').reshape((-1, dim * dim))
+    self.encoder *= denc_scal
+    self.decoder = load('decoder').reshape((-1, dim * dim))
+    self.decoder *= denc_scal
+    self.msteps = load('msteps')
+    self.rel_index = None
 
     print(
       "Loaded model. # of relations: {}  # of entities: {}".format(
         len(list_role_pre), len(self.list_word)),
       file=sys.stderr)
 
+  def use_index(self, path=None):
+    """Answers show_m and code_of from the relation index saved by
+    relIndex.py under path, or built now if path is None."""
+    self.rel_index = relIndex.build(self) if path is None else relIndex.load(path)
+
   def get_word_vec(self, word):
     return self.tvecs[self.dict_word[word]]
 
@@ -84,6 +102,12 @@ class Model(object):
     ret /= np.sqrt(np.sum(np.square(ret)))
     return ret
 
+  def query_engine(self, glimvec, cacheSize=256):
+    """A glimvec.QueryKB over this model, for calc and top-k of many
+    expressions at once; it reads the arrays of the model in place."""
+    return glimvec.queryKB(self.tvecs, self.cvecs, self.mats, self.list_word,
+                           self.list_role, cacheSize)
+
   def show_v(self, v, k):
     tsim = self.tvecs.dot(v)
     print("Similar Targets:")
@@ -105,21 +129,19 @@ class Model(object):
     p_dfm, p_mtr = calc_deform(prj)
     prj_dfm = calc_deform(np.dot(prj, prj.T))[0]
 
-    def code_relu(x):
-      code = np.minimum(x, 4. * np.sqrt(self.dim))
-      code_hinge = np.maximum(.5 + .25 * code, 0.)
-      code_grad = np.minimum(code_hinge, 1.)
-      return code_grad * np.maximum(2. * code_hinge, code)
-
-    prj_code = code_relu(self.encoder.dot(prj.flatten()))
+    ri = self.dict_role[r]
+    if self.rel_index is None:
+      prj_code = relIndex.code_relu(self.encoder.dot(prj.flatten()), self.dim)
+      prj_sim = self.mats.reshape(
+        (-1, self.dim * self.dim)).dot(prj.flatten()) / self.dim
+    else:
+      prj_code = self.rel_index['rel_codes'][ri]
+      prj_sim = self.rel_index['rel_gram'][ri]
     prj_dec = self.decoder.transpose().dot(prj_code)
     prj_dec_norm = np.sqrt(self.dim / np.sum(np.square(prj_dec)))
     prj_dec *= prj_dec_norm
     prj_err = prj_dec.dot(prj.flatten()) / self.dim
 
-    prj_sim = self.mats.reshape(
-      (-1, self.dim * self.dim)).dot(prj.flatten()) / self.dim
-
     print("Matrix non-diagonal:  " + str(p_dfm))
     print("Matrix diagonal:    " + str(p_mtr))
     print("Skewness of Matrix:   " + str(prj_dfm))
@@ -129,7 +151,7 @@ class Model(object):
     print("Matrix code:")
     print(prj_code)
     print()
-    print("Step:         " + str(self.msteps[self.dict_role[r]]))
+    print("Step:         " + str(self.msteps[ri]))
     print()
 
     print("Similar Roles:")
@@ -143,27 +165,28 @@ class Model(object):
     return self.cvecs.dot(vec)
 
   def show_mm(self, r1, r2, k):
-    m = self.mats[self.dict_role[r1]].dot(self.mats[self.dict_role[r2]])
-    sim = self.mats.reshape(
-      (-1, self.dim * self.dim)).dot(m.flatten()) / self.dim
+    sim = relIndex.compose_sims(
+      self.mats, [(self.dict_role[r1], self.dict_role[r2])])[0] / self.dim
     print("Similar Roles:")
     show_top(k, sim, self.list_role)
     print()
 
   def mm_rank(self, r1, r2, r):
-    from scipy.stats import rankdata
-    m = self.mats[self.dict_role[r1]].dot(self.mats[self.dict_role[r2]])
-    sim = self.mats.reshape(
-      (-1, self.dim * self.dim)).dot(m.flatten())  # / self.dim
-    return rankdata(-sim)[self.dict_role[r]]
+    return self.mm_ranks([(r1, r2, r)])[0]
 
-  def code_of(self, r):
-    def code_relu(x):
-      code = np.minimum(x, 4. * np.sqrt(self.dim))
-      code_hinge = np.maximum(.5 + .25 * code, 0.)
-      code_grad = np.minimum(code_hinge, 1.)
-      return code_grad * np.maximum(2. * code_hinge, code)
+  def mm_ranks(self, triples):
+    """mm_rank of each (r1, r2, r), composed in blocks."""
+    return relIndex.compose_ranks(self.mats, [
+      (self.dict_role[r1], self.dict_role[r2], self.dict_role[r]) for r1, r2, r in triples])
 
+  def code_of(self, r):
+    if self.rel_index is not None:
+      return self.rel_index['rel_codes'][self.dict_role[r]]
     prj = self.mats[self.dict_role[r]]
-    prj_code = code_relu(self.encoder.dot(prj.flatten()))
-    return prj_code
+    return relIndex.code_relu(self.encoder.dot(prj.flatten()), self.dim)
+
+  def codes(self):
+    """Codes of all roles, in the order of list_role."""
+    if self.rel_index is not None:
+      return self.rel_index['rel_codes']
+    return relIndex.codes(self.mats, self.encoder)
@@ -0,0 +1,115 @@
+# -*- coding: utf-8 -*-
+
+"""End-to-end scaling benchmark of trainKB on synthetic KBs made by genKB:
+for each size in a grid, load time, batches/s for each thread count, peak
+RSS and save time, one tab separated row per run. Peak RSS is of the trainKB
+process alone, taken with os.wait4, so this runs on Linux and MacOS."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import os
+import re
+import sys
+import time
+import argparse
+import subprocess
+
+PATTERNS = {
+    'load_s': re.compile(r'^loaded in (\S+) s$'),
+    'batches_per_s': re.compile(r'^trained \d+ batches in \S+ s: (\S+) batches/s$'),
+    'save_s': re.compile(r'^saved in (\S+) s$'),
+}
+
+COLUMNS = ['entities', 'relations', 'triples', 'para', 'load_s', 'batches_per_s', 'peak_rss_mb', 'save_s']
+
+
+def int_list(s):
+  return [int(float(x)) for x in s.split(',') if x]
+
+
+def run(cmd, log):
+  """Runs cmd with its output to log, and returns the peak RSS in MB and the log."""
+  with open(log, 'w') as err:
+    p = subprocess.Popen(cmd, stdout=err, stderr=err)
+    _, status, usage = os.wait4(p.pid, 0)
+  if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+    raise RuntimeError('failed: ' + ' '.join(cmd) + ', see ' + log)
+  # ru_maxrss is in KB on Linux, bytes on MacOS
+  rss = usage.ru_maxrss / (1 << 20 if sys.platform == 'darwin' else 1 << 10)
+  with open(log) as f:
+    return rss, f.read()
+
+
+def generate(args, path, entities, relations):
+  if os.path.exists(path + 'vocab_relation.txt'):
+    return
+  os.makedirs(path, exist_ok=True)
+  cmd = [os.path.join(args.bin, 'genKB'), '--entities', str(entities), '--relations', str(relations),
+         '--degree', str(args.degree), '--degreeExp', str(args.degreeExp), '--relSkew', str(args.relSkew),
+         path]
+  t0 = time.time()
+  run(cmd, path + 'genKB.log')
+  print('# generated ' + path + ' in %.1f s' % (time.time() - t0), file=sys.stderr)
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Benchmark trainKB on synthetic KBs of growing size.')
+  parser.add_argument('--bin', dest='bin', type=str, default='build',
+                      help='directory of the trainKB and genKB executables (default: build)')
+  parser.add_argument('--workDir', dest='workDir', type=str, default='bench',
+                      help='generated KBs, models and logs go here; KBs are reused (default: bench)')
+  parser.add_argument('--entities', dest='entities', type=int_list, default=int_list('1e4,1e5,1e6'),
+                      help='comma separated entity counts of the grid (default: 1e4,1e5,1e6)')
+  parser.add_argument('--relations', dest='relations', type=int_list, default=int_list('1e2,1e3'),
+                      help='comma separated relation counts of the grid (default: 1e2,1e3)')
+  parser.add_argument('--degree', dest='degree', type=float, default=10.0,
+                      help='mean degree of entities (default: 10)')
+  parser.add_argument('--degreeExp', dest='degreeExp', type=float, default=2.1,
+                      help='power-law exponent of entity degrees (default: 2.1)')
+  parser.add_argument('--relSkew', dest='relSkew', type=float, default=1.0,
+                      help='relation frequencies are proportional to rank^-relSkew (default: 1)')
+  parser.add_argument('--para', dest='para', type=int_list, default=int_list('1,2,4,8'),
+                      help='comma separated thread counts (default: 1,2,4,8)')
+  parser.add_argument('--numBatches', dest='numBatches', type=int, default=100000,
+                      help='batches per run (default: 100000)')
+  parser.add_argument('--trainArgs', dest='trainArgs', type=str, default='',
+                      help='more options for trainKB, space separated (default: none)')
+  parser.add_argument('--out', dest='out', type=str, default=None,
+                      help='also write the rows to this file (default: stdout only)')
+  args = parser.parse_args()
+
+  rows = ['\t'.join(COLUMNS)]
+  print(rows[0])
+  for entities in args.entities:
+    for relations in args.relations:
+      path = os.path.join(args.workDir, 'kb_%d_%d' % (entities, relations)) + os.sep
+      generate(args, path, entities, relations)
+      with open(path + 'train.txt', 'rb') as f:
+        triples = sum(buf.count(b'\n') for buf in iter(lambda: f.read(1 << 24), b''))
+      for para in args.para:
+        out_path = path + 'model_%d' % para + os.sep
+        os.makedirs(out_path, exist_ok=True)
+        cmd = [os.path.join(args.bin, 'trainKB'), '--numBatches', str(args.numBatches), '--para', str(para),
+               '--outPath', out_path] + args.trainArgs.split() + \
+              [path + 'vocab_entity.txt', path + 'vocab_relation.txt', path + 'train.txt']
+        rss, log = run(cmd, out_path + 'trainKB.log')
+        res = {'entities': entities, 'relations': relations, 'triples': triples, 'para': para,
+               'peak_rss_mb': '%.1f' % rss}
+        for line in log.splitlines():
+          for k, pat in PATTERNS.items():
+            m = pat.match(line)
+            if m:
+              res[k] = m.group(1)
+        rows.append('\t'.join(str(res.get(x, '')) for x in COLUMNS))
+        print(rows[-1])
+        sys.stdout.flush()
+
+  if args.out is not None:
+    with open(args.out, 'w') as f:
+      f.write('\n'.join(rows) + '\n')
+
+
+if __name__ == '__main__':
+  main()
@@ -22,9 +22,9 @@ def main():
 
   model = Model(args.words_file, args.roles_file, args.model_path)
 
-  for line in readerLine(args.comprole_file):
-    r1, r2, r, s1, s2 = line.split('\t')
-    print(model.mm_rank(r1, r2, r))
+  triples = [line.split('\t')[:3] for line in readerLine(args.comprole_file)]
+  for rank in model.mm_ranks(triples):
+    print(rank)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,243 @@
+# -*- coding: utf-8 -*-
+"""Read and write single-file models (model.glm), convert them to and from
+the npy layout, and replay or compact delta checkpoints. See
+cpp/ModelFile.h for the format, and TrainerKB::saveDelta for deltas."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import os
+import sys
+import json
+import struct
+import argparse
+from collections import OrderedDict
+import numpy as np
+
+MAGIC = b'GLVMODEL'
+VERSION = 1
+ALIGN = 4096
+HEADER_SIZE = 64
+ENTRY_SIZE = 256
+MAX_DIMS = 8
+
+NAMES = ['cvecs', 'tvecs', 'vsteps', 'mats', 'msteps', 'encoder', 'decoder', 'dstep']
+MASK = (1 << 64) - 1
+
+
+def _align_up(x):
+  return (x + ALIGN - 1) // ALIGN * ALIGN
+
+
+def checksum(buf):
+  """b * 0x9E3779B97F4A7C15 + a over the zero padded u64 words of buf,
+  where a = sum w_i and b = sum (n - i) w_i (mod 2^64)."""
+  raw = np.frombuffer(buf, dtype=np.uint8)
+  tail = len(raw) % 8
+  if tail:
+    pad = np.zeros(8, dtype=np.uint8)
+    pad[:tail] = raw[len(raw) - tail:]
+    words = [raw[:len(raw) - tail].view('<u8'), pad.view('<u8')]
+  else:
+    words = [raw.view('<u8')]
+  n = sum(len(w) for w in words)
+  a = b = 0
+  s = 0
+  step = 1 << 20
+  for w in words:
+    for i in range(0, len(w), step):
+      c = w[i:i + step]
+      weights = np.arange(n - s, n - s - len(c), -1, dtype=np.uint64)
+      a += int(c.sum(dtype=np.uint64))
+      b += int((c * weights).sum(dtype=np.uint64))
+      s += len(c)
+  return ((b & MASK) * 0x9E3779B97F4A7C15 + a) & MASK
+
+
+def is_model_file(fn):
+  try:
+    with open(fn, 'rb') as f:
+      return f.read(8) == MAGIC
+  except (IOError, OSError):
+    return False
+
+
+def load(fn, mmap=False, verify=False):
+  """Returns an OrderedDict of the arrays in fn. With mmap, the arrays are
+  views of one copy-on-write mapping of the file; otherwise copies."""
+  mm = np.memmap(fn, dtype=np.uint8, mode='c')
+  if bytes(mm[:8]) != MAGIC:
+    raise ValueError('not a model file: ' + fn)
+  version, count, size = struct.unpack_from('<IIQ', mm, 8)
+  if version > VERSION:
+    raise ValueError('unsupported model file version {}: {}'.format(version, fn))
+  if size != len(mm):
+    raise ValueError('truncated model file ' + fn)
+  arrays = OrderedDict()
+  for k in range(count):
+    p = HEADER_SIZE + k * ENTRY_SIZE
+    name = bytes(mm[p:p + 48]).rstrip(b'\0').decode('ascii')
+    descr = bytes(mm[p + 48:p + 64]).rstrip(b'\0').decode('ascii')
+    ndim, = struct.unpack_from('<I', mm, p + 64)
+    shape = struct.unpack_from('<{}Q'.format(ndim), mm, p + 72)
+    offset, nbytes, csum = struct.unpack_from('<QQQ', mm, p + 72 + MAX_DIMS * 8)
+    data = mm[offset:offset + nbytes]
+    if verify and checksum(data) != csum:
+      raise ValueError('checksum mismatch for array {} in {}'.format(name, fn))
+    a = data.view(np.dtype(descr)).reshape(shape)
+    arrays[name] = a if mmap else np.array(a)
+  return arrays
+
+
+def save(fn, arrays):
+  """Writes the (name, array) pairs of arrays to fn."""
+  arrays = [(name, np.asarray(a, order='C')) for name, a in arrays]
+  pos = start = _align_up(HEADER_SIZE + len(arrays) * ENTRY_SIZE)
+  offsets = []
+  for _, a in arrays:
+    offsets.append(pos)
+    pos = _align_up(pos + a.nbytes)
+  head = bytearray(start)
+  head[:8] = MAGIC
+  struct.pack_into('<IIQ', head, 8, VERSION, len(arrays), pos)
+  for k, (name, a) in enumerate(arrays):
+    p = HEADER_SIZE + k * ENTRY_SIZE
+    descr = a.dtype.str
+    head[p:p + len(name)] = name.encode('ascii')
+    head[p + 48:p + 48 + len(descr)] = descr.encode('ascii')
+    struct.pack_into('<I', head, p + 64, a.ndim)
+    struct.pack_into('<{}Q'.format(a.ndim), head, p + 72, *a.shape)
+    struct.pack_into('<QQQ', head, p + 72 + MAX_DIMS * 8,
+                     offsets[k], a.nbytes, checksum(a.reshape(-1).view(np.uint8)))
+  tmp = fn + '.tmp'
+  with open(tmp, 'wb') as f:
+    f.write(head)
+    for k, (_, a) in enumerate(arrays):
+      f.seek(offsets[k])
+      a.tofile(f)
+    f.truncate(pos)
+  if os.path.exists(fn):
+    os.remove(fn)
+  os.rename(tmp, fn)
+
+
+def delta_file(prefix, seq):
+  return '{}delta_{:06d}.glm'.format(prefix, seq)
+
+
+def apply_delta(arrays, fn):
+  """Applies the delta fn to arrays in place."""
+  d = load(fn, mmap=True, verify=True)
+  wsz, rsz2 = (int(x) for x in d['sizes'])
+  if arrays['cvecs'].shape[0] != wsz or arrays['mats'].shape[0] != rsz2:
+    raise ValueError(fn + ' is a delta of a model of another size')
+  vidx = d['vidx']
+  arrays['vsteps'][vidx] = d['vsteps']
+  nc = np.searchsorted(vidx, wsz)
+  arrays['cvecs'][vidx[:nc]] = d['cvecs']
+  arrays['tvecs'][vidx[nc:] - wsz] = d['tvecs']
+  midx = d['midx']
+  arrays['msteps'][midx] = d['msteps']
+  arrays['mats'][midx] = d['mats']
+  if 'dstep' in d:
+    arrays['encoder'][...] = d['encoder']
+    arrays['decoder'][...] = d['decoder']
+    arrays['dstep'][...] = d['dstep']
+
+
+def load_model(path, mmap=False):
+  """Returns the arrays and params of the model at path: a model file, or a
+  path prefix of npy files or of a 'model.glm', followed by the deltas saved
+  under the prefix. With mmap, files are mapped copy-on-write."""
+  fn = path if os.path.isfile(path) else path + 'model.glm'
+  if is_model_file(fn):
+    arrays = load(fn, mmap=mmap)
+    params = json.loads(arrays['params'].tobytes().decode('utf-8'))
+  else:
+    mmap_mode = 'c' if mmap else None
+    arrays = OrderedDict((x, np.load(path + x + '.npy', mmap_mode=mmap_mode)) for x in NAMES)
+    # params.json is saved once per run, beside prefixed models like init_
+    params_fn = path + 'params.json'
+    if not os.path.exists(params_fn):
+      params_fn = os.path.join(os.path.dirname(path), 'params.json')
+    with open(params_fn) as params_file:
+      params = json.load(params_file)
+  if fn != path:
+    k = 1
+    while is_model_file(delta_file(path, k)):
+      apply_delta(arrays, delta_file(path, k))
+      k += 1
+  return arrays, params
+
+
+def live_model(glimvec):
+  """Returns the arrays and params of the model being trained by the glimvec
+  module, as load_model does, without any file: the parameters are read-only
+  views of the live model, the step counters a snapshot."""
+  arrays = OrderedDict(glimvec.modelArrays())
+  arrays.update(glimvec.stepCounts())
+  return arrays, glimvec.params()
+
+
+def compact(path):
+  """Replays the deltas under path into its base model, in the layout of the
+  base, and removes them."""
+  arrays, _ = load_model(path)
+  fn = path + 'model.glm'
+  if is_model_file(fn):
+    save(fn, [('params', arrays['params'])] + [(x, arrays[x]) for x in NAMES])
+  else:
+    for x in NAMES:
+      np.save(path + x + '.npy', arrays[x])
+  k = 1
+  while os.path.exists(delta_file(path, k)):
+    os.remove(delta_file(path, k))
+    k += 1
+
+
+def npy_to_file(path, fn):
+  with open(path + 'params.json', 'rb') as f:
+    params = np.frombuffer(f.read(), dtype=np.uint8)
+  save(fn, [('params', params)] + [(x, np.load(path + x + '.npy', mmap_mode='r')) for x in NAMES])
+
+
+def file_to_npy(fn, path):
+  arrays = load(fn, mmap=True, verify=True)
+  with open(path + 'params.json', 'wb') as f:
+    f.write(arrays['params'].tobytes())
+  for x in NAMES:
+    np.save(path + x + '.npy', arrays[x])
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Convert models between npy files and one model file, or compact deltas.')
+  sub = parser.add_subparsers(dest='command')
+  p = sub.add_parser('toFile', help='npy files under IN_PATH to MODEL_FILE')
+  p.add_argument('in_path', metavar='IN_PATH', type=str, help='path prefix of the npy files')
+  p.add_argument('model_file', metavar='MODEL_FILE', type=str, help='model file to write')
+  p = sub.add_parser('toNpy', help='MODEL_FILE to npy files under OUT_PATH')
+  p.add_argument('model_file', metavar='MODEL_FILE', type=str, help='model file to read')
+  p.add_argument('out_path', metavar='OUT_PATH', type=str, help='path prefix of the npy files')
+  p = sub.add_parser('compact', help='merge the deltas under PATH into its base model')
+  p.add_argument('path', metavar='PATH', type=str, help='path prefix of the base model and deltas')
+  p = sub.add_parser('verify', help='check the checksums of MODEL_FILE')
+  p.add_argument('model_file', metavar='MODEL_FILE', type=str, help='model file to check')
+
+  args = parser.parse_args()
+  if args.command == 'toFile':
+    npy_to_file(args.in_path, args.model_file)
+  elif args.command == 'toNpy':
+    file_to_npy(args.model_file, args.out_path)
+  elif args.command == 'compact':
+    compact(args.path)
+  elif args.command == 'verify':
+    for name, a in load(args.model_file, mmap=True, verify=True).items():
+      print(name, a.dtype.str, a.shape)
+  else:
+    parser.print_help()
+    sys.exit(1)
+
+
+if __name__ == '__main__':
+  main()
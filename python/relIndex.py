@@ -0,0 +1,110 @@
+# -*- coding: utf-8 -*-
+
+"""Relation index of a model: the Gram matrix of the normalized relation
+matrices (divided by the dimension, so cosines), the autoencoder codes of all
+relations and the norms of the relation matrices before normalization, stored
+as npy files beside the model. Composition probes M_r1 M_r2 against all
+relations run in blocks of pairs, as one batched matmul and one GEMM each."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import argparse
+import numpy as np
+
+NAMES = ['rel_gram', 'rel_codes', 'rel_norms']
+
+# rows of the Gram matrix, or composition pairs, per GEMM
+BLOCK = 256
+
+
+def code_relu(x, dim):
+  code = np.minimum(x, 4. * np.sqrt(dim))
+  code_hinge = np.maximum(.5 + .25 * code, 0.)
+  code_grad = np.minimum(code_hinge, 1.)
+  return code_grad * np.maximum(2. * code_hinge, code)
+
+
+def gram(mats):
+  """Cosines of all pairs of normalized relation matrices."""
+  n, dim = mats.shape[0], mats.shape[1]
+  flat = mats.reshape((n, -1))
+  ret = np.empty((n, n), dtype=np.float32)
+  for b in range(0, n, BLOCK):
+    ret[b:b + BLOCK] = flat[b:b + BLOCK].dot(flat.T)
+  ret /= dim
+  return ret
+
+
+def codes(mats, encoder):
+  """Codes of all relations; encoder is reshaped to (CODE_LEN, DIM * DIM)."""
+  n, dim = mats.shape[0], mats.shape[1]
+  return code_relu(mats.reshape((n, -1)).dot(encoder.T), dim)
+
+
+def build(model):
+  return {'rel_gram': gram(model.mats),
+          'rel_codes': codes(model.mats, model.encoder),
+          'rel_norms': model.mat_norms}
+
+
+def save(index, path):
+  for x in NAMES:
+    np.save(path + x + '.npy', index[x])
+
+
+def load(path, mmap=False):
+  mmap_mode = 'r' if mmap else None
+  return dict((x, np.load(path + x + '.npy', mmap_mode=mmap_mode)) for x in NAMES)
+
+
+def compose_sims(mats, pairs):
+  """Row k holds the dot products of mats[r1].dot(mats[r2]) with all
+  relation matrices, for the k-th pair (r1, r2)."""
+  pairs = np.asarray(pairs, dtype=np.int64).reshape((-1, 2))
+  n = mats.shape[0]
+  flat = mats.reshape((n, -1))
+  ret = np.empty((len(pairs), n), dtype=np.float32)
+  for b in range(0, len(pairs), BLOCK):
+    p = pairs[b:b + BLOCK]
+    prods = np.matmul(mats[p[:, 0]], mats[p[:, 1]])
+    ret[b:b + BLOCK] = prods.reshape((len(p), -1)).dot(flat.T)
+  return ret
+
+
+def compose_ranks(mats, triples):
+  """Rank of r among all relations by similarity to mats[r1].dot(mats[r2]),
+  for each (r1, r2, r), with ties averaged as scipy.stats.rankdata does."""
+  triples = np.asarray(triples, dtype=np.int64).reshape((-1, 3))
+  pairs, inv = np.unique(triples[:, :2], axis=0, return_inverse=True)
+  inv = inv.reshape(-1)
+  ranks = np.empty(len(triples))
+  for b in range(0, len(pairs), BLOCK):
+    sims = compose_sims(mats, pairs[b:b + BLOCK])
+    ks = np.nonzero((inv >= b) & (inv < b + BLOCK))[0]
+    rows = sims[inv[ks] - b]
+    target = rows[np.arange(len(ks)), triples[ks, 2]][:, np.newaxis]
+    ranks[ks] = np.sum(rows > target, axis=1) + (np.sum(rows == target, axis=1) + 1) / 2
+  return ranks
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Build the relation index of a model.')
+  parser.add_argument('words_file', metavar='VOCAB_ENTITY', type=str,
+                      help='counts of entities')
+  parser.add_argument('roles_file', metavar='VOCAB_RELATION', type=str,
+                      help='counts of relations')
+  parser.add_argument('model_path', metavar='MODEL_PATH', type=str,
+                      help='path to trained model')
+  parser.add_argument('--outPath', dest='outPath', type=str, default=None,
+                      help='save the index to this path (default: MODEL_PATH)')
+  args = parser.parse_args()
+
+  from ModelKB import Model
+  model = Model(args.words_file, args.roles_file, args.model_path, mmap=True)
+  save(build(model), args.model_path if args.outPath is None else args.outPath)
+
+
+if __name__ == '__main__':
+  main()
@@ -1,5 +1,7 @@
 # -*- coding: utf-8 -*-
 
+import sys
+import time
 import argparse
 import math
 import numpy as np
@@ -29,6 +31,16 @@ def main():
                       help='save model to this path (default: working dir)')
   parser.add_argument('--para', dest='para', type=int, default=2,
                       help='number of parallel threads (default: 2)')
+  parser.add_argument('--grow', dest='grow', action='store_true',
+                      help='with --inPath, extend the loaded model to the vocab; new entities and relations must be appended at the end of the vocab files')
+  parser.add_argument('--focus', dest='focus', type=str, default=None,
+                      help='file of new or changed triples (also in TRAIN_FILE) to train around (default: None)')
+  parser.add_argument('--focusRate', dest='focusRate', type=float, default=0.5,
+                      help='fraction of batches with heads from the --focus triples (default: 0.5)')
+  parser.add_argument('--modelFile', dest='modelFile', action='store_true',
+                      help='save model as one file model.glm instead of npy files')
+  parser.add_argument('--reportEvery', dest='reportEvery', type=float, default=60.0,
+                      help='report progress every this many seconds; Ctrl-C stops training and saves (default: 60)')
   parser.add_argument('--glimvecModule', dest='glimvecModule', type=str, default=None,
                       help='path to the pre-trained python library (default: None)')
 
@@ -62,10 +74,24 @@ def main():
     graph[head_index].append((rel_index, tail_index))
     graph[tail_index].append((rel_index + rsz, head_index))
 
+  # read focus triples, whose end points are sampled as heads more often
+  focus_nodes = []
+  if args.focus is not None:
+    seen = set()
+    for line in readerLine(args.focus):
+      head, rel, tail = line.split('\t')
+      for i in (words[head], words[tail]):
+        if i not in seen and graph[i]:
+          focus_nodes.append(i)
+        seen.add(i)
+
   # function for generating batch
   #  sample size in a batch should not exceed 31
   def genBatch(tid):
-    hi = np.random.choice(wsz, p=samp_node_prob)
+    if focus_nodes and np.random.random() < args.focusRate:
+      hi = focus_nodes[np.random.choice(len(focus_nodes))]
+    else:
+      hi = np.random.choice(wsz, p=samp_node_prob)
     pths = []
     samp_sz = 0
     neighbor = graph[hi]
@@ -97,8 +123,20 @@ def main():
     glimvec = importlib.util.module_from_spec(spec)
     spec.loader.exec_module(glimvec)
 
-  glimvec.initTrainer(wsz, rsz, inPath=args.inPath, outPath=args.outPath)
-  glimvec.trainKB(genBatch, args.numBatches, args.para)
+  glimvec.initTrainer(wsz, rsz, inPath=args.inPath, outPath=args.outPath, grow=args.grow,
+                      modelFile=args.modelFile, vocabEntity=args.words_file, vocabRelation=args.roles_file)
+  training = glimvec.startTrainKB(genBatch, args.numBatches, args.para)
+  try:
+    last = time.time()
+    while training.running():
+      time.sleep(0.1)
+      if time.time() - last >= args.reportEvery:
+        last = time.time()
+        print('{} batches, {:.1f} batches/s'.format(training.batches(), training.throughput()),
+              file=sys.stderr)
+  except KeyboardInterrupt:
+    training.stop()
+  training.join()
   glimvec.saveModel(args.outPath)
 
 
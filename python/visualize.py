@@ -111,7 +111,7 @@ def visualize(dataset_dir, model_dir, out_file, text_label, method,
     df['step'] = [model.msteps[model.dict_role[r]] for r in rels]
     df['step_log'] = np.log(df['step'])
 
-    codes = np.vstack(model.code_of(role) for role in rels)
+    codes = model.codes()
 
     if coloring == 'step':
         color_mapper = {